@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+
+//协议描述的所有内存(协议、字段、名字、hash表)都从root所属的arena顺序分配，
+//不单独释放，release_protocol时整体归还
+
+#define ARENA_CHUNK_SIZE (16 * 1024)
+#define ARENA_ALIGN 8
+
+struct arena_chunk {
+	struct arena_chunk* next;
+	size_t size;
+	size_t offset;
+};
+
+#define CHUNK_HEADER ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_DATA(chunk) ((char*)(chunk) + CHUNK_HEADER)
+
+static struct arena_chunk* new_chunk(size_t size)
+{
+	struct arena_chunk* chunk = (struct arena_chunk*)malloc(CHUNK_HEADER + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->offset = 0;
+	return chunk;
+}
+
+struct arena* arena_create()
+{
+	struct arena* a = (struct arena*)malloc(sizeof(*a));
+	a->chunk = new_chunk(ARENA_CHUNK_SIZE);
+	a->size = 0;
+	return a;
+}
+
+void* arena_alloc(struct arena* a, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	struct arena_chunk* chunk = a->chunk;
+	if (chunk->offset + size > chunk->size)
+	{
+		//大块单独分配并挂在当前块之后，不浪费当前块的剩余空间
+		if (size > ARENA_CHUNK_SIZE / 4)
+		{
+			struct arena_chunk* big = new_chunk(size);
+			big->next = chunk->next;
+			chunk->next = big;
+			big->offset = size;
+			a->size += size;
+			return CHUNK_DATA(big);
+		}
+		chunk = new_chunk(ARENA_CHUNK_SIZE);
+		chunk->next = a->chunk;
+		a->chunk = chunk;
+	}
+	void* ptr = CHUNK_DATA(chunk) + chunk->offset;
+	chunk->offset += size;
+	a->size += size;
+	return ptr;
+}
+
+char* arena_strdup(struct arena* a, const char* str)
+{
+	size_t len = strlen(str);
+	char* ptr = (char*)arena_alloc(a, len + 1);
+	memcpy(ptr, str, len + 1);
+	return ptr;
+}
+
+//把from的所有块转移给to并释放from，to的当前块保持不变
+void arena_merge(struct arena* to, struct arena* from)
+{
+	struct arena_chunk* tail = from->chunk;
+	while (tail->next)
+		tail = tail->next;
+	tail->next = to->chunk->next;
+	to->chunk->next = from->chunk;
+	to->size += from->size;
+	free(from);
+}
+
+void arena_release(struct arena* a)
+{
+	struct arena_chunk* chunk = a->chunk;
+	while (chunk)
+	{
+		struct arena_chunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(a);
+}
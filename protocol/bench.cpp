@@ -0,0 +1,628 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+extern "C" {
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+}
+
+#include "protocol.h"
+#include "wire.h"
+#include "reload.h"
+#include "encoder.h"
+#include "view.h"
+#include "offset.h"
+#include "utf8.h"
+
+extern "C" int luaopen_protocol(lua_State* L);
+
+//协议名只用字母，避免与数字规则耦合
+static void bench_name(char* buffer, const char* prefix, int index)
+{
+	int len = sprintf(buffer, "%s", prefix);
+	do
+	{
+		buffer[len++] = 'a' + index % 26;
+		index /= 26;
+	} while (index > 0);
+	buffer[len] = '\0';
+}
+
+//生成count个协议的描述文本：标量、数组、引用之前协议的字段、内嵌协议和注释混合
+static void gen_schema(struct write_buffer* buffer, int count)
+{
+	static const char* types[] = { "int", "int[]", "float", "float[]", "double", "double[]", "string", "string[]" };
+	char name[64];
+	char line[256];
+	for (int i = 0; i < count; i++)
+	{
+		bench_name(name, "Proto", i);
+		sprintf(line, "#generated protocol %d\nprotocol %s {\n", i, name);
+		buffer_addstring(buffer, line);
+		if (i % 8 == 0)
+			buffer_addstring(buffer, "\tprotocol Inner {\n\t\tint x\n\t\tstring y\n\t}\n\tInner[] inner\n");
+		for (int j = 0; j < 6; j++)
+		{
+			sprintf(line, "\t%s field_%c\n", types[(i + j) % 8], 'a' + j);
+			buffer_addstring(buffer, line);
+		}
+		if (i > 0)
+		{
+			bench_name(name, "Proto", i / 2);
+			sprintf(line, "\t%s ref\n\t%s[] refs\n", name, name);
+			buffer_addstring(buffer, line);
+		}
+		buffer_addstring(buffer, "}\n\n");
+	}
+	buffer_addchar(buffer, '\0');
+}
+
+int bench_lexer(int count, int rounds)
+{
+	struct write_buffer buffer;
+	buffer_init(&buffer);
+	gen_schema(&buffer, count);
+	double size = (double)(buffer.offset - 1);
+
+	double best = 0;
+	for (int i = 0; i < rounds; i++)
+	{
+		struct lexer l;
+		lexer_init(&l, NULL, protobol_begin, protobol_over, field_begin, field_over);
+		l.main = &l;
+
+		std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+		int ret = lexer_parse_buffer(&l, "bench.protocol", buffer.ptr);
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - begin;
+		release_protocol(l.root);
+		if (ret < 0)
+		{
+			buffer_release(&buffer);
+			return -1;
+		}
+		if (best == 0 || elapsed.count() < best)
+			best = elapsed.count();
+	}
+
+	printf("lexer: %d protocols, %.2f MB, best of %d: %.3f ms, %.2f MB/s\n", count, size / (1024 * 1024), rounds, best * 1000, size / (1024 * 1024) / best);
+	buffer_release(&buffer);
+	return 0;
+}
+
+//编解码基准：几种典型形状的消息分别用二进制协议和serialize的文本格式(return{...}，
+//luaL_loadbuffer加载)编解码，统计每秒消息数、每条字节数和每条的lua内存分配次数
+
+#define BENCH_SCHEMA "bench_codec.protocol"
+
+static const char* bench_schema =
+	"protocol BenchFlat {\n\tint a\n\tint b\n\tint c\n\tint d\n\tfloat e\n\tdouble f\n\tint g\n\tint h\n}\n\n"
+	"protocol BenchInts {\n\tint id\n\tint[] values\n\tint[] deltas\n}\n\n"
+	"protocol BenchNested {\n"
+	"\tprotocol Inner {\n\t\tprotocol Leaf {\n\t\t\tint v\n\t\t\tfloat w\n\t\t}\n\t\tint ts_et\n\t\tfloat ddd\n\t\tLeaf[] leaves\n\t}\n"
+	"\tdouble A_B\n\tstring B\n\tInner[] inner\n}\n\n"
+	"protocol BenchStrings {\n\tstring name\n\tstring title\n\tstring desc\n\tstring[] tags\n}\n";
+
+struct bench_case {
+	const char* name;
+	const char* protocol;
+	const char* message;
+};
+
+static struct bench_case bench_cases[] = {
+	{ "flat", "BenchFlat",
+		"return { a = 1, b = -300, c = 70000, d = 12, e = 1.5, f = 3.25, g = 0, h = 99 }" },
+	{ "int[]", "BenchInts",
+		"local t = { id = 7, values = {}, deltas = {} }\n"
+		"for i = 1, 64 do t.values[i] = i * 1000; t.deltas[i] = (i % 7) - 3 end\n"
+		"return t" },
+	{ "nested", "BenchNested",
+		"local t = { A_B = 1.5, B = 'nested', inner = {} }\n"
+		"for i = 1, 8 do\n"
+		"\tlocal leaves = {}\n"
+		"\tfor j = 1, 4 do leaves[j] = { v = i * j, w = j * 0.5 } end\n"
+		"\tt.inner[i] = { ts_et = i, ddd = i * 0.25, leaves = leaves }\n"
+		"end\n"
+		"return t" },
+	{ "string", "BenchStrings",
+		"local t = { name = 'player_name_0001', title = 'the quick brown fox jumps over the lazy dog', desc = string.rep('description ', 16), tags = {} }\n"
+		"for i = 1, 16 do t.tags[i] = 'tag_' .. i end\n"
+		"return t" },
+};
+
+struct bench_alloc {
+	size_t count;
+};
+
+//只统计新分配和扩大，释放和缩小不计
+static void* bench_realloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	struct bench_alloc* a = (struct bench_alloc*)ud;
+	if (nsize == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+	if (ptr == NULL || nsize > osize)
+		a->count++;
+	return realloc(ptr, nsize);
+}
+
+//与serialize工程输出的文本格式一致
+static void pack_text(lua_State* L, struct write_buffer* buffer, int index, int depth);
+
+static void pack_text_value(lua_State* L, struct write_buffer* buffer, int index, int depth)
+{
+	char number[64];
+	switch (lua_type(L, index))
+	{
+	case LUA_TNUMBER:
+	{
+		lua_Number n = lua_tonumber(L, index);
+		int x = (int)n;
+		if ((lua_Number)x == n)
+			sprintf(number, "%d", x);
+		else
+			sprintf(number, "%.17g", n);
+		buffer_addstring(buffer, number);
+		break;
+	}
+	case LUA_TSTRING:
+	{
+		size_t len;
+		const char* str = lua_tolstring(L, index, &len);
+		buffer_addchar(buffer, '"');
+		buffer_addlstring(buffer, str, len);
+		buffer_addchar(buffer, '"');
+		break;
+	}
+	case LUA_TTABLE:
+		pack_text(L, buffer, lua_absindex(L, index), depth + 1);
+		break;
+	default:
+		buffer_addstring(buffer, "nil");
+		break;
+	}
+}
+
+static void pack_text(lua_State* L, struct write_buffer* buffer, int index, int depth)
+{
+	buffer_addstring(buffer, "{\n");
+	int size = (int)lua_rawlen(L, index);
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		for (int j = 0; j < depth; j++)
+			buffer_addchar(buffer, '\t');
+		pack_text_value(L, buffer, -1, depth);
+		buffer_addstring(buffer, ",\n");
+		lua_pop(L, 1);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0)
+	{
+		if (lua_type(L, -2) == LUA_TNUMBER)
+		{
+			lua_Number n = lua_tonumber(L, -2);
+			if (n >= 1 && n <= size && (lua_Number)(int)n == n)
+			{
+				lua_pop(L, 1);
+				continue;
+			}
+		}
+		for (int j = 0; j < depth; j++)
+			buffer_addchar(buffer, '\t');
+		buffer_addchar(buffer, '[');
+		pack_text_value(L, buffer, -2, depth);
+		buffer_addstring(buffer, "] = ");
+		pack_text_value(L, buffer, -1, depth);
+		buffer_addstring(buffer, ",\n");
+		lua_pop(L, 1);
+	}
+	for (int j = 0; j < depth - 1; j++)
+		buffer_addchar(buffer, '\t');
+	buffer_addchar(buffer, '}');
+}
+
+static int lpack_text(lua_State* L)
+{
+	struct write_buffer buffer;
+	buffer_init(&buffer);
+	buffer_addstring(&buffer, "return");
+	pack_text(L, &buffer, 1, 1);
+	lua_pushlstring(L, buffer.ptr, buffer.offset);
+	buffer_release(&buffer);
+	return 1;
+}
+
+static int lunpack_text(lua_State* L)
+{
+	size_t len;
+	const char* str = luaL_checklstring(L, 1, &len);
+	if (luaL_loadbuffer(L, str, len, "=text") != LUA_OK)
+		return lua_error(L);
+	lua_call(L, 0, 1);
+	return 1;
+}
+
+struct bench_result {
+	double encode;
+	double decode;
+	size_t bytes;
+	double encode_alloc;
+	double decode_alloc;
+};
+
+//栈上依次为encode函数、decode函数、协议名(或nil)、消息table
+static int bench_run(lua_State* L, struct bench_alloc* alloc, int count, struct bench_result* result)
+{
+	int base = lua_gettop(L) - 3;
+	int named = !lua_isnil(L, base + 2);
+
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	size_t allocs = alloc->count;
+	std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		lua_pushvalue(L, base);
+		if (named)
+			lua_pushvalue(L, base + 2);
+		lua_pushvalue(L, base + 3);
+		if (lua_pcall(L, named ? 2 : 1, 1, 0) != LUA_OK)
+			return -1;
+		if (i + 1 < count)
+			lua_pop(L, 1);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - begin;
+	result->encode = count / elapsed.count();
+	result->encode_alloc = (double)(alloc->count - allocs) / count;
+	result->bytes = lua_rawlen(L, -1);
+
+	int data = lua_gettop(L);
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	allocs = alloc->count;
+	begin = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		lua_pushvalue(L, base + 1);
+		if (named)
+			lua_pushvalue(L, base + 2);
+		lua_pushvalue(L, data);
+		if (lua_pcall(L, named ? 2 : 1, 1, 0) != LUA_OK)
+			return -1;
+		lua_pop(L, 1);
+	}
+	elapsed = std::chrono::high_resolution_clock::now() - begin;
+	result->decode = count / elapsed.count();
+	result->decode_alloc = (double)(alloc->count - allocs) / count;
+	lua_pop(L, 1);
+	return 0;
+}
+
+static void bench_report(const char* name, const char* format, struct bench_result* r)
+{
+	printf("%-8s %-6s encode %10.0f msg/s  decode %10.0f msg/s  %6d bytes/msg  allocs/msg %5.1f encode %6.1f decode\n",
+		name, format, r->encode, r->decode, (int)r->bytes, r->encode_alloc, r->decode_alloc);
+}
+
+int bench_codec(int count)
+{
+	FILE* file = fopen(BENCH_SCHEMA, "w");
+	if (file == NULL)
+	{
+		fprintf(stderr, "can not open %s\n", BENCH_SCHEMA);
+		return -1;
+	}
+	fwrite(bench_schema, 1, strlen(bench_schema), file);
+	fclose(file);
+
+	struct bench_alloc alloc;
+	alloc.count = 0;
+	lua_State* L = lua_newstate(bench_realloc, &alloc);
+	luaL_openlibs(L);
+	luaL_requiref(L, "protocol", luaopen_protocol, 0);
+	lua_getfield(L, -1, "load");
+	lua_pushstring(L, BENCH_SCHEMA);
+	int ret = lua_pcall(L, 1, 0, 0);
+	remove(BENCH_SCHEMA);
+
+	for (int i = 0; ret == LUA_OK && i < (int)(sizeof(bench_cases) / sizeof(bench_cases[0])); i++)
+	{
+		struct bench_case* c = &bench_cases[i];
+		struct bench_result wire;
+		struct bench_result text;
+		int top = lua_gettop(L);
+		if (luaL_dostring(L, c->message) != LUA_OK)
+		{
+			ret = -1;
+			break;
+		}
+		int message = lua_gettop(L);
+
+		lua_getfield(L, top, "encode");
+		lua_getfield(L, top, "decode");
+		lua_pushstring(L, c->protocol);
+		lua_pushvalue(L, message);
+		ret = bench_run(L, &alloc, count, &wire);
+		lua_settop(L, message);
+
+		lua_pushcfunction(L, lpack_text);
+		lua_pushcfunction(L, lunpack_text);
+		lua_pushnil(L);
+		lua_pushvalue(L, message);
+		if (ret == 0)
+			ret = bench_run(L, &alloc, count, &text);
+		lua_settop(L, top);
+
+		if (ret == 0)
+		{
+			bench_report(c->name, "wire", &wire);
+			bench_report(c->name, "text", &text);
+		}
+	}
+
+	if (ret != LUA_OK)
+		fprintf(stderr, "bench codec failed:%s\n", lua_isstring(L, -1) ? lua_tostring(L, -1) : "");
+	lua_close(L);
+	return ret == LUA_OK ? 0 : -1;
+}
+
+//编码服务基准：生产者线程提交BenchInts快照并取回结果，保持window条在途。
+//分别统计整体吞吐和生产者线程上每条消息的耗时(提交+取回，不含等待)
+static int bench_encoder_run(struct encoder_service* s, struct protocol_dispatch* d, int count, int workers)
+{
+	const int window = 256;
+	int values[64];
+	int deltas[64];
+	for (int i = 0; i < 64; i++)
+	{
+		values[i] = (i + 1) * 1000;
+		deltas[i] = (i + 1) % 7 - 3;
+	}
+	struct protocol* ptl = NULL;
+	for (int i = 0; ptl == NULL && i < d->size; i++)
+	{
+		struct protocol* p = d->slots[i].protocol;
+		if (strcmp(p->name, "BenchInts") == 0)
+			ptl = p;
+	}
+	if (ptl == NULL)
+		return -1;
+
+	struct snapshot_value fields[3];
+	memset(fields, 0, sizeof(fields));
+	fields[0].u.i = 7;
+	fields[1].count = 64;
+	fields[1].u.ints = values;
+	fields[2].count = 64;
+	fields[2].u.ints = deltas;
+	struct snapshot_value message;
+	memset(&message, 0, sizeof(message));
+	message.u.values = fields;
+
+	struct encoder_producer* p = encoder_producer_create(s, window);
+	struct encode_job* jobs = new encode_job[window];
+	struct encode_job** idle = (struct encode_job**)malloc(sizeof(struct encode_job*) * window);
+	for (int i = 0; i < window; i++)
+	{
+		encoder_job_init(&jobs[i]);
+		idle[i] = &jobs[i];
+	}
+
+	int free_jobs = window;
+	int submitted = 0;
+	int done = 0;
+	int failed = 0;
+	size_t bytes = 0;
+	double busy = 0;
+	std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+	while (done < count)
+	{
+		std::chrono::high_resolution_clock::time_point t = std::chrono::high_resolution_clock::now();
+		int progress = 0;
+		while (submitted < count && free_jobs > 0)
+		{
+			encoder_submit(p, idle[--free_jobs], ptl->id, encode_snapshot, &message);
+			submitted++;
+			progress++;
+		}
+		struct encode_job* job;
+		while ((job = encoder_poll(p)) != NULL)
+		{
+			if (job->status != 0)
+				failed++;
+			bytes = job->size;
+			idle[free_jobs++] = job;
+			done++;
+			progress++;
+		}
+		if (progress > 0)
+			busy += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t).count();
+		else
+			std::this_thread::yield();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - begin;
+
+	//校验最后一帧：协议id和消息数据都要与描述一致
+	struct read_buffer reader;
+	int id;
+	const char* data;
+	size_t size;
+	reader_init(&reader, jobs[0].data, jobs[0].size);
+	if (batch_next(&reader, &id, &data, &size) < 0 || id != ptl->id || reader.offset != jobs[0].size)
+		failed++;
+
+	for (int i = 0; i < window; i++)
+		encoder_job_release(&jobs[i]);
+	delete[] jobs;
+	free(idle);
+	encoder_producer_release(p);
+
+	if (failed > 0)
+		return -1;
+	printf("encoder  %d workers  %10.0f msg/s  producer %6.0f ns/msg  %6d bytes/frame\n",
+		workers, count / elapsed.count(), busy * 1e9 / count, (int)bytes);
+	return 0;
+}
+
+int bench_encoder(int count)
+{
+	FILE* file = fopen(BENCH_SCHEMA, "w");
+	if (file == NULL)
+	{
+		fprintf(stderr, "can not open %s\n", BENCH_SCHEMA);
+		return -1;
+	}
+	fwrite(bench_schema, 1, strlen(bench_schema), file);
+	fclose(file);
+	struct schema_registry* r = schema_create(BENCH_SCHEMA, NULL, 1);
+	remove(BENCH_SCHEMA);
+	if (r == NULL)
+		return -1;
+
+	struct protocol_dispatch* d = r->current.load()->dispatch;
+	int ret = 0;
+	for (int workers = 1; ret == 0 && workers <= 4; workers *= 2)
+	{
+		struct encoder_service* s = encoder_create(d, workers);
+		ret = bench_encoder_run(s, d, count, workers);
+		encoder_release(s);
+	}
+	if (ret < 0)
+		fprintf(stderr, "bench encoder failed\n");
+	schema_release(r);
+	return ret;
+}
+
+//UTF-8校验基准：中英文混合的文本，分别用CPU支持的各个实现校验，统计每秒字节数
+int bench_utf8(int rounds)
+{
+	static const char* pieces[] = { "player_name ", "\xe7\x8e\xa9\xe5\xae\xb6", "the quick brown fox ", "\xe5\x85\xac\xe4\xbc\x9a\xe9\xa2\x91\xe9\x81\x93 ", "42 " };
+	static const char* names[] = { "scalar", "sse4", "avx2" };
+	struct write_buffer text;
+	buffer_init(&text);
+	for (int i = 0; text.offset < 64 * 1024; i++)
+		buffer_addstring(&text, pieces[i * 7 % 5]);
+
+	int detected = utf8_impl(-1);
+	int ret = 0;
+	for (int impl = UTF8_SCALAR; impl <= detected; impl++)
+	{
+		utf8_impl(impl);
+		int valid = 1;
+		std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < rounds; i++)
+			valid &= utf8_valid(text.ptr, text.offset);
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - begin;
+		if (!valid)
+			ret = -1;
+		printf("utf8     %-6s %8.0f MB/s\n", names[impl], (double)text.offset * rounds / (1024 * 1024) / elapsed.count());
+	}
+	utf8_impl(detected);
+	buffer_release(&text);
+	if (ret < 0)
+		fprintf(stderr, "bench utf8 failed\n");
+	return ret;
+}
+
+//随机访问基准：count个Inner的大BenchNested消息，随机读取inner[k].leaves[2].v，
+//紧凑格式(message_view)需要跳过k之前的元素，偏移表格式(offset_view)直接定位
+static struct protocol* bench_protocol(struct protocol_dispatch* d, const char* name)
+{
+	for (int i = 0; i < d->size; i++)
+	{
+		struct protocol* p = d->slots[i].protocol;
+		if (strcmp(p->name, name) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+int bench_offset(int count)
+{
+	const int reads = 1000;
+	FILE* file = fopen(BENCH_SCHEMA, "w");
+	if (file == NULL)
+	{
+		fprintf(stderr, "can not open %s\n", BENCH_SCHEMA);
+		return -1;
+	}
+	fwrite(bench_schema, 1, strlen(bench_schema), file);
+	fclose(file);
+	struct schema_registry* r = schema_create(BENCH_SCHEMA, NULL, 1);
+	lua_State* L = luaL_newstate();
+	luaL_openlibs(L);
+	luaL_requiref(L, "protocol", luaopen_protocol, 1);
+	lua_pop(L, 1);
+	lua_pushinteger(L, count);
+	lua_setglobal(L, "count");
+	int ret = luaL_dostring(L,
+		"protocol.load('" BENCH_SCHEMA "')\n"
+		"local t = { A_B = 1.5, B = 'snapshot', inner = {} }\n"
+		"for i = 1, count do\n"
+		"\tlocal leaves = {}\n"
+		"\tfor j = 1, 4 do leaves[j] = { v = i * j, w = j * 0.5 } end\n"
+		"\tt.inner[i] = { ts_et = i, ddd = i * 0.25, leaves = leaves }\n"
+		"end\n"
+		"return protocol.encode('BenchNested', t), protocol.encode_offset('BenchNested', t)") != LUA_OK;
+	remove(BENCH_SCHEMA);
+	struct protocol* ptl = r ? bench_protocol(r->current.load()->dispatch, "BenchNested") : NULL;
+	if (ret || ptl == NULL)
+	{
+		fprintf(stderr, "bench offset failed:%s\n", lua_isstring(L, -1) ? lua_tostring(L, -1) : "");
+		lua_close(L);
+		if (r)
+			schema_release(r);
+		return -1;
+	}
+
+	size_t compact_size;
+	size_t offset_size;
+	const char* compact = lua_tolstring(L, -2, &compact_size);
+	const char* offset = lua_tolstring(L, -1, &offset_size);
+	message_view m = decode_view(ptl, compact, compact_size);
+	offset_view o = decode_offset_view(ptl, offset, offset_size);
+	int inner = m.field_index("inner");
+	long long sum[2] = { 0, 0 };
+	double elapsed[2];
+	for (int format = 0; format < 2; format++)
+	{
+		unsigned int seed = 1;
+		std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < reads; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			size_t k = (seed >> 8) % count;
+			if (format == 0)
+			{
+				message_array_view::iterator it = m.get_message_array(inner).begin();
+				for (size_t j = 0; j < k; j++)
+					++it;
+				message_view item = *it;
+				message_array_view::iterator leaf = item.get_message_array(2).begin();
+				++leaf;
+				++leaf;
+				sum[format] += (*leaf).get_int(0);
+			}
+			else
+			{
+				sum[format] += o.get_message_array(inner)[k].get_message_array(2)[2].get_int(0);
+			}
+		}
+		elapsed[format] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+	}
+	ret = sum[0] == sum[1] && m.valid() && o.valid() ? 0 : -1;
+	if (ret == 0)
+	{
+		printf("compact  %10d bytes  %10.0f ns/read\n", (int)compact_size, elapsed[0] * 1e9 / reads);
+		printf("offset   %10d bytes  %10.0f ns/read\n", (int)offset_size, elapsed[1] * 1e9 / reads);
+	}
+	else
+	{
+		fprintf(stderr, "bench offset failed\n");
+	}
+	lua_close(L);
+	schema_release(r);
+	return ret;
+}
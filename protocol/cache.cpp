@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+//.protocolc缓存文件：解析完成后的协议树按内存布局原样写出，指针字段保存为相对文件头的偏移，
+//并附带需要修正的指针位置表。加载时只需一次读取，再按位置表把偏移加上基址即可使用，
+//不再需要词法分析。每个源文件记录内容hash，任一源文件变化则缓存失效；
+//同时记录入口文件，换了入口文件的缓存同样失效。
+//加载的缓存整块分配在新建的arena中，root与解析得到的一样由release_protocol释放；
+//import关系也一并保存，热更新可以从缓存加载的版本开始。
+
+#define CACHE_MAGIC "PTLC"
+#define CACHE_VERSION 6
+#define CACHE_ALIGN 8
+
+struct cache_header {
+	char magic[4];
+	unsigned int version;
+	unsigned int pointer_size;
+	unsigned int size;
+	unsigned int root;
+	unsigned int source;
+	unsigned int source_count;
+	unsigned int reloc;
+	unsigned int reloc_count;
+	//入口文件名的偏移，不在位置表中
+	unsigned int entry;
+	//import关系：offset[source_count+1]之后为dep[graph_deps]，下标与source一致；0表示没有
+	unsigned int graph;
+	unsigned int graph_deps;
+};
+
+struct cache_source {
+	char* file;
+	unsigned long long hash;
+};
+
+struct cache_ref {
+	const void* ptr;
+	size_t offset;
+};
+
+struct cache_builder {
+	char* data;
+	size_t size;
+	size_t offset;
+
+	//需要修正的指针位置
+	unsigned int* reloc;
+	int reloc_size;
+	int reloc_cap;
+
+	//已写出的协议，用于解析字段类型的前向引用
+	struct cache_ref* refs;
+	int ref_size;
+	int ref_cap;
+
+	//已写出的文件名，用于去重
+	struct cache_ref* files;
+	int file_size;
+	int file_cap;
+
+	struct cache_ref* pending;
+	int pending_size;
+	int pending_cap;
+};
+
+#define CACHE_ROOT_OFFSET ((sizeof(struct cache_header) + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1))
+
+static unsigned long long hash_file(const char* file)
+{
+	FILE* handle = fopen(file, "rb");
+	if (handle == NULL)
+		return 0;
+
+	unsigned long long hash = 14695981039346656037ULL;
+	unsigned char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), handle)) > 0)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			hash ^= buffer[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	fclose(handle);
+	return hash;
+}
+
+static size_t emit(struct cache_builder* b, const void* ptr, size_t size)
+{
+	size_t offset = (b->offset + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+	if (offset + size > b->size)
+	{
+		size_t nsize = b->size * 2;
+		while (nsize < offset + size)
+			nsize *= 2;
+		b->data = (char*)realloc(b->data, nsize);
+		b->size = nsize;
+	}
+	memset(b->data + b->offset, 0, offset - b->offset);
+	if (ptr)
+		memcpy(b->data + offset, ptr, size);
+	else
+		memset(b->data + offset, 0, size);
+	b->offset = offset + size;
+	return offset;
+}
+
+static void push_ref(struct cache_ref** refs, int* size, int* cap, const void* ptr, size_t offset)
+{
+	if (*size == *cap)
+	{
+		*cap = *cap == 0 ? 64 : *cap * 2;
+		*refs = (struct cache_ref*)realloc(*refs, sizeof(**refs) * (*cap));
+	}
+	(*refs)[*size].ptr = ptr;
+	(*refs)[*size].offset = offset;
+	(*size)++;
+}
+
+static int compare_ref(const void* a, const void* b)
+{
+	const void* pa = ((const struct cache_ref*)a)->ptr;
+	const void* pb = ((const struct cache_ref*)b)->ptr;
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+static size_t find_ref(struct cache_builder* b, const void* ptr)
+{
+	struct cache_ref key;
+	key.ptr = ptr;
+	struct cache_ref* ref = (struct cache_ref*)bsearch(&key, b->refs, b->ref_size, sizeof(key), compare_ref);
+	return ref ? ref->offset : 0;
+}
+
+//在at处写入指向target的偏移，target为0表示NULL
+static void patch(struct cache_builder* b, size_t at, size_t target)
+{
+	uintptr_t value = target;
+	memcpy(b->data + at, &value, sizeof(value));
+	if (target == 0)
+		return;
+
+	if (b->reloc_size == b->reloc_cap)
+	{
+		b->reloc_cap = b->reloc_cap == 0 ? 256 : b->reloc_cap * 2;
+		b->reloc = (unsigned int*)realloc(b->reloc, sizeof(*b->reloc) * b->reloc_cap);
+	}
+	b->reloc[b->reloc_size++] = (unsigned int)at;
+}
+
+static size_t emit_string(struct cache_builder* b, const char* str)
+{
+	return emit(b, str, strlen(str) + 1);
+}
+
+//同一文件的所有协议共享一份文件名
+static size_t emit_file(struct cache_builder* b, const char* file)
+{
+	for (int i = 0; i < b->file_size; i++)
+	{
+		if (strcmp(b->data + b->files[i].offset, file) == 0)
+			return b->files[i].offset;
+	}
+	size_t offset = emit_string(b, file);
+	push_ref(&b->files, &b->file_size, &b->file_cap, NULL, offset);
+	return offset;
+}
+
+static size_t emit_protocol(struct cache_builder* b, struct protocol* ptl, size_t parent);
+
+static size_t emit_table(struct cache_builder* b, struct protocol_table* table, size_t parent)
+{
+	size_t at = emit(b, NULL, sizeof(*table));
+	size_t slots = emit(b, NULL, sizeof(*table->slots) * table->size);
+	((struct protocol_table*)(b->data + at))->size = table->size;
+	patch(b, at + offsetof(struct protocol_table, slots), slots);
+
+	for (int i = 0; i < table->size; i++)
+	{
+		size_t prev = slots + i * sizeof(*table->slots);
+		struct protocol* ptl = table->slots[i];
+		while (ptl)
+		{
+			size_t offset = emit_protocol(b, ptl, parent);
+			patch(b, prev, offset);
+			prev = offset + offsetof(struct protocol, next);
+			ptl = ptl->next;
+		}
+	}
+	return at;
+}
+
+static size_t emit_protocol(struct cache_builder* b, struct protocol* ptl, size_t parent)
+{
+	size_t at = emit(b, NULL, sizeof(*ptl));
+	push_ref(&b->refs, &b->ref_size, &b->ref_cap, ptl, at);
+	((struct protocol*)(b->data + at))->id = ptl->id;
+	((struct protocol*)(b->data + at))->size = ptl->size;
+	((struct protocol*)(b->data + at))->cap = ptl->size;
+	((struct protocol*)(b->data + at))->isenum = ptl->isenum;
+
+	patch(b, at + offsetof(struct protocol, parent), parent);
+	patch(b, at + offsetof(struct protocol, name), emit_string(b, ptl->name));
+	patch(b, at + offsetof(struct protocol, file), emit_file(b, ptl->file));
+
+	size_t fields = emit(b, NULL, sizeof(*ptl->field) * (ptl->size > 0 ? ptl->size : 1));
+	patch(b, at + offsetof(struct protocol, field), fields);
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		size_t offset = emit(b, NULL, sizeof(*f));
+		struct field* copy = (struct field*)(b->data + offset);
+		copy->tag = f->tag;
+		copy->field_type.type = f->field_type.type;
+		copy->field_type.isarray = f->field_type.isarray;
+		copy->field_type.size = f->field_type.size;
+		copy->field_type.key = f->field_type.key;
+		copy->field_type.value = f->field_type.value;
+		patch(b, offset + offsetof(struct field, name), emit_string(b, f->name));
+		if (f->field_type.protocol)
+			push_ref(&b->pending, &b->pending_size, &b->pending_cap, f->field_type.protocol, offset + offsetof(struct field, field_type.protocol));
+		patch(b, fields + i * sizeof(*ptl->field), offset);
+	}
+
+	size_t children = emit_table(b, ptl->children, at);
+	patch(b, at + offsetof(struct protocol, children), children);
+	return at;
+}
+
+int protocol_cache_save(struct lexer* l, const char* entry, const char* output)
+{
+	struct cache_builder b;
+	memset(&b, 0, sizeof(b));
+	b.size = 64 * 1024;
+	b.data = (char*)malloc(b.size);
+
+	emit(&b, NULL, sizeof(struct cache_header));
+	size_t root = emit_protocol(&b, l->root, 0);
+
+	//字段引用的协议可能在其后才写出，统一在最后修正
+	qsort(b.refs, b.ref_size, sizeof(*b.refs), compare_ref);
+	for (int i = 0; i < b.pending_size; i++)
+		patch(&b, b.pending[i].offset, find_ref(&b, b.pending[i].ptr));
+
+	struct file_hash* files = &l->file_hash;
+	size_t source = emit(&b, NULL, sizeof(struct cache_source) * (files->offset > 0 ? files->offset : 1));
+	for (int i = 0; i < files->offset; i++)
+	{
+		size_t at = source + i * sizeof(struct cache_source);
+		((struct cache_source*)(b.data + at))->hash = hash_file(files->name[i]);
+		patch(&b, at + offsetof(struct cache_source, file), emit_string(&b, files->name[i]));
+	}
+
+	size_t entry_at = emit_string(&b, entry);
+	size_t graph = 0;
+	int graph_deps = 0;
+	struct import_graph* g = l->imports;
+	if (g && g->size == files->offset)
+	{
+		graph_deps = g->offset[g->size];
+		graph = emit(&b, g->offset, sizeof(int) * (g->size + 1));
+		emit(&b, g->dep, sizeof(int) * graph_deps);
+	}
+	size_t reloc = emit(&b, b.reloc, sizeof(*b.reloc) * b.reloc_size);
+
+	struct cache_header* header = (struct cache_header*)b.data;
+	memcpy(header->magic, CACHE_MAGIC, 4);
+	header->version = CACHE_VERSION;
+	header->pointer_size = sizeof(void*);
+	header->size = (unsigned int)b.offset;
+	header->root = (unsigned int)root;
+	header->source = (unsigned int)source;
+	header->source_count = files->offset;
+	header->reloc = (unsigned int)reloc;
+	header->reloc_count = b.reloc_size;
+	header->entry = (unsigned int)entry_at;
+	header->graph = (unsigned int)graph;
+	header->graph_deps = graph_deps;
+
+	int ret = 0;
+	FILE* handle = fopen(output, "wb");
+	if (handle == NULL || fwrite(b.data, 1, b.offset, handle) != b.offset)
+	{
+		fprintf(stderr, "can not write %s\n", output);
+		ret = -1;
+	}
+	if (handle)
+		fclose(handle);
+
+	free(b.data);
+	free(b.reloc);
+	free(b.refs);
+	free(b.files);
+	free(b.pending);
+	return ret;
+}
+
+//读出缓存中的import关系，分配在arena中；数据不合法返回NULL
+static struct import_graph* load_graph(struct arena* arena, const char* data, size_t len, struct cache_header* header)
+{
+	int size = (int)header->source_count;
+	if (header->graph % CACHE_ALIGN || header->graph + (size + 1 + (size_t)header->graph_deps) * sizeof(int) > len)
+		return NULL;
+	const int* offset = (const int*)(data + header->graph);
+	const int* dep = offset + size + 1;
+	if (offset[0] != 0 || offset[size] != (int)header->graph_deps)
+		return NULL;
+	for (int i = 0; i < size; i++)
+	{
+		if (offset[i + 1] < offset[i])
+			return NULL;
+	}
+	for (unsigned int i = 0; i < header->graph_deps; i++)
+	{
+		if (dep[i] < 0 || dep[i] >= size)
+			return NULL;
+	}
+
+	struct import_graph* g = (struct import_graph*)arena_alloc(arena, sizeof(*g));
+	struct cache_source* source = (struct cache_source*)(data + header->source);
+	g->size = size;
+	g->file = (char**)arena_alloc(arena, sizeof(char*) * (size > 0 ? size : 1));
+	for (int i = 0; i < size; i++)
+		g->file[i] = source[i].file;
+	g->offset = (int*)offset;
+	g->dep = (int*)dep;
+	return g;
+}
+
+//缓存不存在、格式不符、入口文件不同或源文件已变化时返回NULL，调用者应回退到解析源文件。
+//imports不为NULL时返回保存的import关系，没有保存时为NULL
+struct protocol* protocol_cache_load(const char* input, const char* entry, int check, struct import_graph** imports)
+{
+	FILE* handle = fopen(input, "rb");
+	if (handle == NULL)
+		return NULL;
+	fseek(handle, 0, SEEK_END);
+	long len = ftell(handle);
+	rewind(handle);
+	if (len < (long)sizeof(struct cache_header))
+	{
+		fclose(handle);
+		return NULL;
+	}
+
+	struct arena* arena = arena_create();
+	char* data = (char*)arena_alloc(arena, len);
+	size_t n = fread(data, 1, len, handle);
+	fclose(handle);
+
+	//偏移都要落在文件之内并按CACHE_ALIGN对齐，入口文件名以'\0'结尾
+	struct cache_header* header = (struct cache_header*)data;
+	if (n != (size_t)len || memcmp(header->magic, CACHE_MAGIC, 4) != 0 || header->version != CACHE_VERSION ||
+		header->pointer_size != sizeof(void*) || header->size != (unsigned int)len || header->root != CACHE_ROOT_OFFSET ||
+		header->root + sizeof(struct protocol) > (size_t)len || header->source % CACHE_ALIGN || header->reloc % CACHE_ALIGN ||
+		header->source + (size_t)header->source_count * sizeof(struct cache_source) > (size_t)len ||
+		header->reloc + (size_t)header->reloc_count * sizeof(unsigned int) > (size_t)len ||
+		header->entry >= (size_t)len || memchr(data + header->entry, '\0', len - header->entry) == NULL ||
+		strcmp(data + header->entry, entry) != 0)
+	{
+		arena_release(arena);
+		return NULL;
+	}
+
+	unsigned int* reloc = (unsigned int*)(data + header->reloc);
+	for (unsigned int i = 0; i < header->reloc_count; i++)
+	{
+		//位置和其中的偏移都要在文件之内，位置按指针对齐
+		if (reloc[i] % sizeof(uintptr_t) || reloc[i] + sizeof(uintptr_t) > (size_t)len || *(uintptr_t*)(data + reloc[i]) >= (uintptr_t)len)
+		{
+			arena_release(arena);
+			return NULL;
+		}
+		uintptr_t* slot = (uintptr_t*)(data + reloc[i]);
+		*slot += (uintptr_t)data;
+	}
+
+	//文件名必须是缓存之内以'\0'结尾的字符串
+	struct cache_source* source = (struct cache_source*)(data + header->source);
+	for (unsigned int i = 0; i < header->source_count; i++)
+	{
+		const char* file = source[i].file;
+		if (file < data || file >= data + len || memchr(file, '\0', data + len - file) == NULL ||
+			(check && hash_file(file) != source[i].hash))
+		{
+			arena_release(arena);
+			return NULL;
+		}
+	}
+
+	struct import_graph* graph = NULL;
+	if (imports && header->graph)
+	{
+		graph = load_graph(arena, data, len, header);
+		if (graph == NULL)
+		{
+			arena_release(arena);
+			return NULL;
+		}
+	}
+	if (imports)
+		*imports = graph;
+
+	//缓存中的协议树只读，只有root记录arena，供编解码器等附加数据分配
+	struct protocol* root = (struct protocol*)(data + header->root);
+	root->arena = arena;
+	return root;
+}
+
+struct protocol* protocol_load(const char* file, const char* cache, int threads, struct import_graph** imports)
+{
+	if (cache)
+	{
+		struct protocol* root = protocol_cache_load(cache, file, 1, imports);
+		if (root)
+			return root;
+	}
+
+	struct lexer l;
+	lexer_init(&l, NULL, protobol_begin, protobol_over, field_begin, field_over);
+	l.main = &l;
+	int ret = lexer_parse_files(&l, file, threads);
+	lexer_unload(&l);
+	if (ret < 0 || (cache && protocol_cache_save(&l, file, cache) < 0))
+	{
+		release_protocol(l.root);
+		return NULL;
+	}
+	if (imports)
+		*imports = l.imports;
+	return l.root;
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+
+//协议id：
+//定义时可以显式指定，protocol Login 1001 { ... }
+//未指定的由完整名字(如test2.InnerProtocol)的hash得到，与文件和定义顺序无关，
+//hash冲突时顺延到下一个空闲id。按完整名字排序后依次分配，结果是确定的，
+//但新增协议可能占用别的协议顺延的位置，需要跨版本严格不变的协议应显式指定id
+
+struct id_entry {
+	struct protocol* protocol;
+	char fullname[256];
+};
+
+struct id_list {
+	struct id_entry* entry;
+	int size;
+	int cap;
+};
+
+static void collect(struct id_list* list, struct protocol* ptl)
+{
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		struct protocol* child = table->slots[i];
+		while (child)
+		{
+			//枚举不参与id分配
+			if (child->isenum)
+			{
+				child = child->next;
+				continue;
+			}
+			if (list->size == list->cap)
+			{
+				list->cap = list->cap == 0 ? 64 : list->cap * 2;
+				list->entry = (struct id_entry*)realloc(list->entry, sizeof(*list->entry) * list->cap);
+			}
+			struct id_entry* e = &list->entry[list->size++];
+			e->protocol = child;
+			protocol_fullname(child, e->fullname, sizeof(e->fullname));
+			collect(list, child);
+			child = child->next;
+		}
+	}
+}
+
+static int compare_entry(const void* a, const void* b)
+{
+	return strcmp(((const struct id_entry*)a)->fullname, ((const struct id_entry*)b)->fullname);
+}
+
+static unsigned int hash_name(const char* name)
+{
+	unsigned int hash = 2166136261u;
+	for (; *name; name++)
+	{
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int assign_protocol_id(struct protocol* root)
+{
+	struct id_list list;
+	memset(&list, 0, sizeof(list));
+	collect(&list, root);
+	//没有协议时entry为NULL，不能传给qsort
+	if (list.size > 0)
+		qsort(list.entry, list.size, sizeof(*list.entry), compare_entry);
+
+	if (list.size > PROTOCOL_ID_MAX)
+	{
+		fprintf(stderr, "too many protocols:%d, id exhausted\n", list.size);
+		free(list.entry);
+		return -1;
+	}
+
+	int ret = 0;
+	struct protocol** owner = (struct protocol**)malloc(sizeof(struct protocol*) * (PROTOCOL_ID_MAX + 1));
+	memset(owner, 0, sizeof(struct protocol*) * (PROTOCOL_ID_MAX + 1));
+
+	//先登记显式指定的id，自动分配时避开
+	for (int i = 0; i < list.size; i++)
+	{
+		struct protocol* ptl = list.entry[i].protocol;
+		if (ptl->id == 0)
+			continue;
+		if (owner[ptl->id])
+		{
+			fprintf(stderr, "%s:protocol:%s id:%d already used by %s\n", ptl->file, list.entry[i].fullname, ptl->id, owner[ptl->id]->name);
+			ret = -1;
+			continue;
+		}
+		owner[ptl->id] = ptl;
+	}
+
+	for (int i = 0; i < list.size && ret == 0; i++)
+	{
+		struct protocol* ptl = list.entry[i].protocol;
+		if (ptl->id != 0)
+			continue;
+		int id = hash_name(list.entry[i].fullname) % PROTOCOL_ID_MAX + 1;
+		while (owner[id])
+			id = id == PROTOCOL_ID_MAX ? 1 : id + 1;
+		ptl->id = id;
+		owner[id] = ptl;
+	}
+
+	free(owner);
+	free(list.entry);
+	return ret;
+}
+
+static int count_id(struct protocol* ptl)
+{
+	int count = 0;
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* child = table->slots[i]; child; child = child->next)
+			count += (child->id > 0 ? 1 : 0) + count_id(child);
+	}
+	return count;
+}
+
+static void fill_dispatch(struct protocol_dispatch* d, struct protocol* ptl)
+{
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		struct protocol* child = table->slots[i];
+		while (child)
+		{
+			if (child->id > 0)
+			{
+				//id由assign_protocol_id保证唯一，线性探测找空位
+				int h = child->id & d->mask;
+				while (d->index[h])
+					h = (h + 1) & d->mask;
+				d->slots[d->size].protocol = child;
+				d->index[h] = ++d->size;
+			}
+			fill_dispatch(d, child);
+			child = child->next;
+		}
+	}
+}
+
+//index容量取不小于协议数2倍的2的幂，装载率不超过一半，探测很短
+struct protocol_dispatch* create_dispatch(struct protocol* root)
+{
+	struct protocol_dispatch* d = (struct protocol_dispatch*)malloc(sizeof(*d));
+	int count = count_id(root);
+	int cap = 16;
+	while (cap < count * 2)
+		cap *= 2;
+	d->size = 0;
+	d->mask = cap - 1;
+	d->slots = (struct dispatch_slot*)malloc(sizeof(*d->slots) * (count > 0 ? count : 1));
+	memset(d->slots, 0, sizeof(*d->slots) * (count > 0 ? count : 1));
+	d->index = (int*)malloc(sizeof(int) * cap);
+	memset(d->index, 0, sizeof(int) * cap);
+	fill_dispatch(d, root);
+	return d;
+}
+
+void release_dispatch(struct protocol_dispatch* d)
+{
+	free(d->index);
+	free(d->slots);
+	free(d);
+}
+
+//未知id返回NULL
+struct dispatch_slot* dispatch_find(struct protocol_dispatch* d, int id)
+{
+	if (id <= 0)
+		return NULL;
+	for (int h = id & d->mask; d->index[h]; h = (h + 1) & d->mask)
+	{
+		struct dispatch_slot* slot = &d->slots[d->index[h] - 1];
+		if (slot->protocol->id == id)
+			return slot;
+	}
+	return NULL;
+}
+
+struct protocol* dispatch_protocol(struct protocol_dispatch* d, int id)
+{
+	struct dispatch_slot* slot = dispatch_find(d, id);
+	return slot ? slot->protocol : NULL;
+}
+
+int dispatch_register(struct protocol_dispatch* d, int id, dispatch_func func, void* ud)
+{
+	struct dispatch_slot* slot = dispatch_find(d, id);
+	if (slot == NULL)
+		return -1;
+	slot->func = func;
+	slot->ud = ud;
+	return 0;
+}
+
+//未知id或未注册处理函数返回-1，否则返回处理函数的结果
+int dispatch_message(struct protocol_dispatch* d, int id, const char* data, size_t size)
+{
+	struct dispatch_slot* slot = dispatch_find(d, id);
+	if (slot == NULL || slot->func == NULL)
+		return -1;
+	return slot->func(slot->ud, slot->protocol, data, size);
+}
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <thread>
+#include <atomic>
+
+#include "protocol.h"
+
+//多文件并行解析：
+//1.先扫描所有文件的import语句，得到文件依赖图(所有文件预先登记到main->file_hash，解析时不再递归import)
+//2.按依赖深度分层，同层文件互不依赖，在线程池中并行解析到各自的私有root
+//3.每层完成后把私有root下的协议合并进main->root，下一层解析时可见
+//调用前已经登记在main->file_hash中的文件视为已解析(增量重新加载时由调用者提供)，import它们时不再加载
+
+struct parse_unit {
+	char* buffer;
+	int* deps;
+	int dep_size;
+	int dep_cap;
+	int level;
+	int state;
+	int result;
+	struct lexer lexer;
+};
+
+struct parse_driver {
+	struct lexer* main;
+	struct parse_unit* units;
+	int size;
+	int cap;
+	int base;
+};
+
+static struct parse_unit* unit_at(struct parse_driver* d, int index)
+{
+	while (index >= d->cap)
+	{
+		int ncap = d->cap * 2;
+		d->units = (struct parse_unit*)realloc(d->units, sizeof(*d->units) * ncap);
+		memset(d->units + d->cap, 0, sizeof(*d->units) * (ncap - d->cap));
+		d->cap = ncap;
+	}
+	if (index >= d->size)
+		d->size = index + 1;
+	return &d->units[index];
+}
+
+static void add_dep(struct parse_unit* unit, int dep)
+{
+	if (unit->dep_size == unit->dep_cap)
+	{
+		unit->dep_cap = unit->dep_cap == 0 ? 4 : unit->dep_cap * 2;
+		unit->deps = (int*)realloc(unit->deps, sizeof(int) * unit->dep_cap);
+	}
+	unit->deps[unit->dep_size++] = dep;
+}
+
+//只扫描最外层的import "name"，协议体只跟踪括号深度
+static int scan_imports(struct parse_driver* d, int index)
+{
+	struct lexer scan;
+	scan.c = d->units[index].buffer;
+	//与lexer_parse_buffer一样跳过utf8 bom
+	if (scan.c[0] == '\xef' && scan.c[1] == '\xbb' && scan.c[2] == '\xbf')
+		scan.c += 3;
+	scan.line = 1;
+	scan.file = d->main->file_hash.name[index];
+
+	TRY(&scan) {
+		int depth = 0;
+		struct token t;
+		for (;;)
+		{
+			lexer_scan(&scan, &t);
+			if (t.type == TOKEN_EOF)
+				return 0;
+			if (t.type == TOKEN_LBRACE)
+				depth++;
+			else if (t.type == TOKEN_RBRACE)
+				depth--;
+			else if (depth == 0 && t.type == TOKEN_NAME && t.len == 6 && memcmp(t.ptr, "import", 6) == 0)
+			{
+				lexer_scan(&scan, &t);
+				if (t.type != TOKEN_STRING || t.len > 64)
+				{
+					fprintf(stderr, "%s@line:%d syntax error:bad import\n", scan.file, t.line);
+					return -1;
+				}
+
+				char import_file[80];
+				memcpy(import_file, t.ptr, t.len);
+				memcpy(import_file + t.len, ".protocol", 10);
+				int dep = find_file(d->main, import_file);
+				if (dep < 0 || dep >= d->base)
+				{
+					char* buffer = lexer_load(d->main, import_file, &dep);
+					if (buffer == NULL)
+						return -1;
+					unit_at(d, dep)->buffer = buffer;
+				}
+				add_dep(&d->units[index], dep);
+			}
+		}
+	}
+	return -1;
+}
+
+static int compute_level(struct parse_driver* d, int index)
+{
+	struct parse_unit* unit = &d->units[index];
+	if (unit->state == 2)
+		return unit->level;
+	if (unit->state == 1)
+	{
+		fprintf(stderr, "%s import cycle\n", d->main->file_hash.name[index]);
+		return -1;
+	}
+
+	unit->state = 1;
+	int level = 0;
+	for (int i = 0; i < unit->dep_size; i++)
+	{
+		if (unit->deps[i] < d->base)
+			continue;
+		int dep = compute_level(d, unit->deps[i]);
+		if (dep < 0)
+			return -1;
+		if (dep + 1 > level)
+			level = dep + 1;
+	}
+	unit->state = 2;
+	unit->level = level;
+	return level;
+}
+
+static void parse_unit(struct parse_driver* d, int index)
+{
+	struct lexer* main = d->main;
+	struct parse_unit* unit = &d->units[index];
+
+	//私有root挂在main->root下，类型查找沿parent链可以看到之前各层已合并的协议
+	//各线程从私有root的arena分配，互不加锁，合并时再转移给main->root
+	struct protocol* root = create_root();
+	root->parent = main->root;
+	lexer_init(&unit->lexer, root, main->cb.protocol_begin, main->cb.protocol_over, main->cb.field_begin, main->cb.field_over);
+	unit->lexer.main = main;
+	unit->result = lexer_parse_buffer(&unit->lexer, main->file_hash.name[index], unit->buffer);
+}
+
+static void set_arena(struct protocol* ptl, struct arena* arena)
+{
+	ptl->arena = arena;
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* child = table->slots[i]; child; child = child->next)
+			set_arena(child, arena);
+	}
+}
+
+static int merge_unit(struct parse_driver* d, int index)
+{
+	struct protocol* root = d->main->root;
+	struct protocol_table* table = d->units[index].lexer.root->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		struct protocol* ptl = table->slots[i];
+		while (ptl)
+		{
+			struct protocol* next = ptl->next;
+			struct protocol* optl = query_protocol(root->children, ptl->name);
+			if (optl)
+			{
+				fprintf(stderr, "%s syntax error:protocol name:%s already define in file:%s\n", ptl->file, ptl->name, optl->file);
+				return -1;
+			}
+			ptl->next = NULL;
+			ptl->parent = root;
+			set_arena(ptl, root->arena);
+			add_protocol(root->children, ptl);
+			ptl = next;
+		}
+	}
+	return 0;
+}
+
+static int prepare(struct parse_driver* d, const char** files, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		int index;
+		char* buffer = lexer_load(d->main, files[i], &index);
+		if (buffer == NULL)
+			return -1;
+		if (index < d->base)
+		{
+			fprintf(stderr, "%s already parsed\n", files[i]);
+			return -1;
+		}
+		unit_at(d, index)->buffer = buffer;
+	}
+
+	//新登记的文件追加在末尾，顺序扫描即可覆盖全部依赖
+	for (int i = d->base; i < d->size; i++)
+	{
+		if (scan_imports(d, i) < 0)
+			return -1;
+	}
+
+	int max_level = 0;
+	for (int i = d->base; i < d->size; i++)
+	{
+		int level = compute_level(d, i);
+		if (level < 0)
+			return -1;
+		if (level > max_level)
+			max_level = level;
+	}
+	return max_level;
+}
+
+//本次解析的文件依赖沿用scan_imports得到的结果，之前登记的文件沿用调用者给出的l->imports
+static struct import_graph* save_imports(struct parse_driver* d)
+{
+	struct lexer* l = d->main;
+	struct arena* arena = l->root->arena;
+	struct import_graph* old = l->imports;
+	int size = l->file_hash.offset;
+	struct import_graph* g = (struct import_graph*)arena_alloc(arena, sizeof(*g));
+	g->size = size;
+	g->file = (char**)arena_alloc(arena, sizeof(char*) * (size > 0 ? size : 1));
+	g->offset = (int*)arena_alloc(arena, sizeof(int) * (size + 1));
+
+	int total = 0;
+	for (int i = 0; i < size; i++)
+	{
+		if (i >= d->base)
+			total += i < d->size ? d->units[i].dep_size : 0;
+		else if (old && i < old->size)
+			total += old->offset[i + 1] - old->offset[i];
+	}
+	g->dep = (int*)arena_alloc(arena, sizeof(int) * (total > 0 ? total : 1));
+
+	int n = 0;
+	for (int i = 0; i < size; i++)
+	{
+		g->file[i] = l->file_hash.name[i];
+		g->offset[i] = n;
+		if (i >= d->base)
+		{
+			for (int j = 0; i < d->size && j < d->units[i].dep_size; j++)
+				g->dep[n++] = d->units[i].deps[j];
+		}
+		else if (old && i < old->size)
+		{
+			for (int j = old->offset[i]; j < old->offset[i + 1]; j++)
+				g->dep[n++] = old->dep[j];
+		}
+	}
+	g->offset[size] = n;
+	return g;
+}
+
+int lexer_parse_files(struct lexer* l, const char* file, int threads)
+{
+	return lexer_parse_list(l, &file, 1, threads);
+}
+
+int lexer_parse_list(struct lexer* l, const char** files, int count, int threads)
+{
+	struct parse_driver d;
+	d.main = l;
+	d.base = l->file_hash.offset;
+	d.size = 0;
+	d.cap = 16;
+	d.units = (struct parse_unit*)malloc(sizeof(*d.units) * d.cap);
+	memset(d.units, 0, sizeof(*d.units) * d.cap);
+
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	if (threads <= 0)
+		threads = 1;
+
+	int max_level = prepare(&d, files, count);
+	int ret = max_level < 0 ? -1 : 0;
+	int* batch = (int*)malloc(sizeof(int) * d.size);
+	for (int level = 0; level <= max_level && ret == 0; level++)
+	{
+		int size = 0;
+		for (int i = d.base; i < d.size; i++)
+		{
+			if (d.units[i].level == level)
+				batch[size++] = i;
+		}
+
+		int workers = threads < size ? threads : size;
+		if (workers <= 1)
+		{
+			for (int i = 0; i < size; i++)
+				parse_unit(&d, batch[i]);
+		}
+		else
+		{
+			std::atomic<int> next(0);
+			std::thread* pool = new std::thread[workers];
+			for (int i = 0; i < workers; i++)
+			{
+				pool[i] = std::thread([&]() {
+					int n;
+					while ((n = next++) < size)
+						parse_unit(&d, batch[n]);
+				});
+			}
+			for (int i = 0; i < workers; i++)
+				pool[i].join();
+			delete[] pool;
+		}
+
+		for (int i = 0; i < size; i++)
+		{
+			struct protocol* root = d.units[batch[i]].lexer.root;
+			if (ret == 0 && (d.units[batch[i]].result < 0 || merge_unit(&d, batch[i]) < 0))
+				ret = -1;
+			//解析失败的私有root同样归入main->root，随其一起释放
+			arena_merge(l->root->arena, root->arena);
+		}
+	}
+	free(batch);
+
+	//所有文件合并完成后统一分配协议id
+	if (ret == 0)
+		ret = assign_protocol_id(l->root);
+	if (ret == 0)
+		ret = check_nested(l->root);
+	if (ret == 0)
+		l->imports = save_imports(&d);
+
+	for (int i = 0; i < d.size; i++)
+		free(d.units[i].deps);
+	free(d.units);
+	return ret;
+}
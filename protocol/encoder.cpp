@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "encoder.h"
+
+#define SNAPSHOT_MAX_DEPTH 64
+
+static int put_snapshot(struct write_buffer* buffer, struct protocol* ptl, const struct snapshot_value* values, int depth);
+
+//与Lua编码相同：位置字段取默认值时不写入，嵌套协议和定长数组总是写入
+int snapshot_present(struct field* f, const struct snapshot_value* v)
+{
+	if (f->field_type.size)
+		return 1;
+	switch (f->field_type.type)
+	{
+	case TYPE_INT:
+		return v->u.i != 0;
+	case TYPE_FLOAT:
+		return !wire_is_zero(v->u.f);
+	case TYPE_DOUBLE:
+		return !wire_is_zero(v->u.d);
+	case TYPE_BOOL:
+		return v->u.b;
+	case TYPE_PROTOCOL:
+		if (!f->field_type.isarray)
+			return 1;
+		break;
+	}
+	if (type_integer(f->field_type.type) && (f->field_type.type & 1) == 0)
+		return snapshot_integer(f->field_type.type, v) != 0;
+	return v->count > 0;
+}
+
+//扩展整数超出类型的范围时编码失败
+static int put_integer(struct write_buffer* buffer, int type, const struct snapshot_value* v)
+{
+	if ((type & 1) == 0)
+	{
+		unsigned long long value = snapshot_integer(type, v);
+		if (!wire_integer_fits(type, value))
+			return -1;
+		wire_write_integer(buffer, type, value);
+		return 0;
+	}
+	const unsigned long long* values = snapshot_integers(type, v);
+	for (size_t i = 0; i < v->count; i++)
+	{
+		if (!wire_integer_fits(type - 1, values[i]))
+			return -1;
+	}
+	wire_write_integer_array(buffer, type - 1, values, v->count);
+	return 0;
+}
+
+static int put_value(struct write_buffer* buffer, struct field* f, const struct snapshot_value* v, int depth)
+{
+	//定长数组的元素个数必须与定义一致
+	if (f->field_type.size && v->count != (size_t)f->field_type.size)
+		return -1;
+	switch (f->field_type.type)
+	{
+	case TYPE_INT:
+		wire_write_int(buffer, v->u.i);
+		break;
+	case TYPE_FLOAT:
+		wire_write_float(buffer, v->u.f);
+		break;
+	case TYPE_DOUBLE:
+		wire_write_double(buffer, v->u.d);
+		break;
+	case TYPE_STRING:
+		wire_write_string(buffer, v->count ? v->u.str : "", v->count);
+		break;
+	case TYPE_INT_ARRAY:
+		wire_write_int_array(buffer, v->u.ints, v->count);
+		break;
+	case TYPE_FLOAT_ARRAY:
+		wire_write_float_array(buffer, v->u.floats, v->count);
+		break;
+	case TYPE_DOUBLE_ARRAY:
+		wire_write_double_array(buffer, v->u.doubles, v->count);
+		break;
+	case TYPE_STRING_ARRAY:
+		wire_write_count(buffer, v->count);
+		for (size_t i = 0; i < v->count; i++)
+		{
+			const struct snapshot_value* item = &v->u.values[i];
+			wire_write_string(buffer, item->count ? item->u.str : "", item->count);
+		}
+		break;
+	case TYPE_PROTOCOL:
+		if (!f->field_type.isarray)
+			return put_snapshot(buffer, f->field_type.protocol, v->u.values, depth + 1);
+		wire_write_count(buffer, v->count);
+		for (size_t i = 0; i < v->count; i++)
+		{
+			if (put_snapshot(buffer, f->field_type.protocol, v->u.values[i].u.values, depth + 1) < 0)
+				return -1;
+		}
+		break;
+	case TYPE_BOOL:
+		wire_write_integer(buffer, TYPE_BOOL, v->u.b);
+		break;
+	case TYPE_BOOL_ARRAY:
+		wire_write_bool_array(buffer, v->u.bools, v->count);
+		break;
+	case TYPE_MAP:
+	{
+		struct field key;
+		struct field value;
+		map_entry(f, &key, &value);
+		wire_write_count(buffer, v->count);
+		for (size_t i = 0; i < v->count; i++)
+		{
+			if (put_value(buffer, &key, &v->u.values[i * 2], depth) < 0 || put_value(buffer, &value, &v->u.values[i * 2 + 1], depth) < 0)
+				return -1;
+		}
+		break;
+	}
+	default:
+		if (!type_integer(f->field_type.type))
+			return -1;
+		return put_integer(buffer, f->field_type.type, v);
+	}
+	return 0;
+}
+
+static int put_snapshot(struct write_buffer* buffer, struct protocol* ptl, const struct snapshot_value* values, int depth)
+{
+	if (depth > SNAPSHOT_MAX_DEPTH || values == NULL)
+		return -1;
+	size_t bitmap = wire_begin_bitmap(buffer, WIRE_BITMAP_SIZE(protocol_positional(ptl)));
+	int bit = 0;
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag != 0)
+			continue;
+		if (snapshot_present(f, &values[i]))
+		{
+			//bool的值就是这一位
+			wire_set_bit(buffer, bitmap, bit);
+			if (f->field_type.type != TYPE_BOOL && put_value(buffer, f, &values[i], depth) < 0)
+				return -1;
+		}
+		bit++;
+	}
+
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag == 0 || !values[i].present)
+			continue;
+		int type = wire_tag_type(f->field_type.type);
+		wire_write_uvarint(buffer, WIRE_KEY(f->tag, type));
+		if (f->field_type.type == TYPE_STRING || type != WIRE_BYTES)
+		{
+			if (put_value(buffer, f, &values[i], depth) < 0)
+				return -1;
+		}
+		else
+		{
+			size_t mark = wire_begin_block(buffer);
+			if (put_value(buffer, f, &values[i], depth) < 0)
+				return -1;
+			wire_end_block(buffer, mark);
+		}
+	}
+	wire_write_uvarint(buffer, 0);
+	return 0;
+}
+
+int encode_snapshot(void* ud, struct protocol* ptl, struct write_buffer* buffer)
+{
+	const struct snapshot_value* v = (const struct snapshot_value*)ud;
+	return put_snapshot(buffer, ptl, v ? v->u.values : NULL, 0);
+}
+
+static void queue_init(struct encoder_queue* q)
+{
+	q->stub.next.store(NULL, std::memory_order_relaxed);
+	q->head.store(&q->stub);
+	q->tail = &q->stub;
+}
+
+static void queue_push(struct encoder_queue* q, struct encode_job* job)
+{
+	job->next.store(NULL, std::memory_order_relaxed);
+	struct encode_job* prev = q->head.exchange(job);
+	prev->next.store(job, std::memory_order_release);
+}
+
+//只由所属工作线程调用。生产者交换了head但还没有链接next时暂时取不出，返回NULL
+static struct encode_job* queue_pop(struct encoder_queue* q)
+{
+	struct encode_job* tail = q->tail;
+	struct encode_job* next = tail->next.load(std::memory_order_acquire);
+	if (tail == &q->stub)
+	{
+		if (next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	if (next)
+	{
+		q->tail = next;
+		return tail;
+	}
+	if (tail != q->head.load())
+		return NULL;
+	//tail是最后一个任务，放回stub后才能把它取出
+	queue_push(q, &q->stub);
+	next = tail->next.load(std::memory_order_acquire);
+	if (next)
+	{
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static bool queue_empty(struct encoder_queue* q)
+{
+	return q->tail == &q->stub && q->head.load() == &q->stub;
+}
+
+static void complete(struct encode_job* job)
+{
+	struct encoder_producer* p = job->producer;
+	size_t pos = p->tail.fetch_add(1);
+	p->ring[pos & p->mask].store(job, std::memory_order_release);
+}
+
+static void run_job(struct encoder_worker* w, struct encode_job* job)
+{
+	struct wire_batch* batch = &w->batch;
+	struct protocol* ptl = dispatch_protocol(w->service->dispatch, job->id);
+	job->status = -1;
+	if (ptl)
+	{
+		batch_reset(batch);
+		batch_begin(batch, job->id);
+		if (job->func(job->ud, ptl, &batch->buffer) == 0)
+		{
+			batch_end(batch);
+			size_t size = batch->buffer.offset;
+			if (job->cap < size)
+			{
+				job->cap = size > job->cap * 2 ? size : job->cap * 2;
+				free(job->data);
+				job->data = (char*)malloc(job->cap);
+			}
+			memcpy(job->data, batch->buffer.ptr, size);
+			job->size = size;
+			job->status = 0;
+		}
+		else
+		{
+			batch_cancel(batch);
+		}
+	}
+	complete(job);
+}
+
+//停止时先把队列中剩余的任务做完
+static void worker_main(struct encoder_worker* w)
+{
+	struct encoder_queue* q = &w->queue;
+	for (;;)
+	{
+		struct encode_job* job = queue_pop(q);
+		if (job)
+		{
+			run_job(w, job);
+			continue;
+		}
+		if (!queue_empty(q))
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		if (w->service->stop.load())
+			break;
+
+		//先标记sleeping再检查队列：提交者要么看到sleeping，要么它的任务在这里被看到
+		std::unique_lock<std::mutex> guard(w->lock);
+		w->sleeping.store(1);
+		while (queue_empty(q) && !w->service->stop.load())
+			w->wakeup.wait(guard);
+		w->sleeping.store(0);
+	}
+}
+
+struct encoder_service* encoder_create(struct protocol_dispatch* dispatch, int workers)
+{
+	if (workers < 1)
+		workers = 1;
+	if (workers > ENCODER_MAX_WORKER)
+		workers = ENCODER_MAX_WORKER;
+	struct encoder_service* s = new encoder_service();
+	s->dispatch = dispatch;
+	s->workers = workers;
+	s->stop.store(0);
+	for (int i = 0; i < workers; i++)
+	{
+		struct encoder_worker* w = new encoder_worker();
+		w->service = s;
+		queue_init(&w->queue);
+		batch_init(&w->batch);
+		w->sleeping.store(0);
+		s->worker[i] = w;
+	}
+	for (int i = 0; i < workers; i++)
+		s->worker[i]->thread = std::thread(worker_main, s->worker[i]);
+	return s;
+}
+
+void encoder_release(struct encoder_service* s)
+{
+	s->stop.store(1);
+	for (int i = 0; i < s->workers; i++)
+	{
+		struct encoder_worker* w = s->worker[i];
+		{
+			std::lock_guard<std::mutex> guard(w->lock);
+			w->wakeup.notify_one();
+		}
+		w->thread.join();
+		batch_release(&w->batch);
+		delete w;
+	}
+	delete s;
+}
+
+struct encoder_producer* encoder_producer_create(struct encoder_service* s, size_t capacity)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size *= 2;
+	struct encoder_producer* p = new encoder_producer();
+	p->service = s;
+	p->ring = new std::atomic<struct encode_job*>[size];
+	for (size_t i = 0; i < size; i++)
+		p->ring[i].store(NULL, std::memory_order_relaxed);
+	p->mask = size - 1;
+	p->tail.store(0);
+	p->head = 0;
+	p->inflight = 0;
+	p->next = 0;
+	return p;
+}
+
+void encoder_producer_release(struct encoder_producer* p)
+{
+	delete[] p->ring;
+	delete p;
+}
+
+void encoder_job_init(struct encode_job* job)
+{
+	job->next.store(NULL, std::memory_order_relaxed);
+	job->producer = NULL;
+	job->id = 0;
+	job->func = NULL;
+	job->ud = NULL;
+	job->status = -1;
+	job->data = NULL;
+	job->size = 0;
+	job->cap = 0;
+}
+
+void encoder_job_release(struct encode_job* job)
+{
+	free(job->data);
+	encoder_job_init(job);
+}
+
+int encoder_submit(struct encoder_producer* p, struct encode_job* job, int id, encode_func func, void* ud)
+{
+	if (p->inflight > p->mask)
+		return -1;
+	struct encoder_service* s = p->service;
+	struct encoder_worker* w = s->worker[p->next++ % s->workers];
+	job->producer = p;
+	job->id = id;
+	job->func = func;
+	job->ud = ud;
+	job->status = -1;
+	p->inflight++;
+	queue_push(&w->queue, job);
+	if (w->sleeping.load())
+	{
+		std::lock_guard<std::mutex> guard(w->lock);
+		w->wakeup.notify_one();
+	}
+	return 0;
+}
+
+struct encode_job* encoder_poll(struct encoder_producer* p)
+{
+	std::atomic<struct encode_job*>* slot = &p->ring[p->head & p->mask];
+	struct encode_job* job = slot->load(std::memory_order_acquire);
+	if (job == NULL)
+		return NULL;
+	slot->store(NULL, std::memory_order_relaxed);
+	p->head++;
+	p->inflight--;
+	return job;
+}
@@ -0,0 +1,141 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "protocol.h"
+#include "wire.h"
+
+//多线程编码服务：生产者(如游戏逻辑线程)提交(协议id, 数据)后立即返回，编码在工作线程中完成。
+//每个工作线程有自己的无锁提交队列(多生产者单消费者)，生产者轮流投递；
+//工作线程在自己的缓冲中编码，结果拷贝到任务自带的输出缓冲，通过生产者各自的完成环形队列返回。
+//协议描述(protocol_dispatch)在服务运行期间不能修改或释放
+
+#define ENCODER_MAX_WORKER 64
+
+//在buffer中写入ptl的消息数据(不含帧头)，失败返回-1
+typedef int(*encode_func)(void* ud, struct protocol* ptl, struct write_buffer* buffer);
+
+//快照：提交前把消息的值复制成一棵值树，完成返回之前不能修改。
+//协议的values为字段个数个值(按定义顺序)，协议数组的values为count个协议，string[]的values为count个字符串。
+//扩展整数：有符号类型用l/longs，无符号类型和枚举用ul/ulongs；bool用b/bools
+//map的values为count对键和值，共2*count个值，键在前。定长数组的count必须等于定义的长度
+struct snapshot_value {
+	//可选字段为0时不写入，位置字段忽略此项
+	int present;
+	//数组的元素个数，string的长度
+	size_t count;
+	union {
+		int i;
+		float f;
+		double d;
+		const char* str;
+		const int* ints;
+		const float* floats;
+		const double* doubles;
+		const struct snapshot_value* values;
+		long long l;
+		unsigned long long ul;
+		bool b;
+		const long long* longs;
+		const unsigned long long* ulongs;
+		const bool* bools;
+	} u;
+};
+
+//扩展整数的值，有符号类型按补码
+inline unsigned long long snapshot_integer(int type, const struct snapshot_value* v)
+{
+	return type_signed(type) ? (unsigned long long)v->u.l : v->u.ul;
+}
+
+inline const unsigned long long* snapshot_integers(int type, const struct snapshot_value* v)
+{
+	return type_signed(type) ? (const unsigned long long*)v->u.longs : v->u.ulongs;
+}
+
+//位置字段的值是否需要写入(不是默认值)
+int snapshot_present(struct field* f, const struct snapshot_value* v);
+//按快照编码，ud为协议的snapshot_value
+int encode_snapshot(void* ud, struct protocol* ptl, struct write_buffer* buffer);
+
+struct encoder_producer;
+
+//任务由生产者分配并反复使用，提交后到取回之前归服务所有
+struct encode_job {
+	std::atomic<struct encode_job*> next;
+	struct encoder_producer* producer;
+
+	int id;
+	encode_func func;
+	void* ud;
+
+	//status为0时data/size为一帧：varint长度+varint协议id+消息数据，与wire_batch相同。
+	//协议id未知或编码失败时status为-1
+	int status;
+	char* data;
+	size_t size;
+	size_t cap;
+};
+
+//提交队列：侵入式链表，生产者原子交换head，工作线程从tail取出
+struct encoder_queue {
+	std::atomic<struct encode_job*> head;
+	struct encode_job* tail;
+	struct encode_job stub;
+};
+
+struct encoder_worker {
+	struct encoder_service* service;
+	struct encoder_queue queue;
+	struct wire_batch batch;
+	std::thread thread;
+
+	//队列为空时睡眠，生产者看到sleeping才加锁唤醒
+	std::atomic<int> sleeping;
+	std::mutex lock;
+	std::condition_variable wakeup;
+};
+
+struct encoder_service {
+	struct protocol_dispatch* dispatch;
+	struct encoder_worker* worker[ENCODER_MAX_WORKER];
+	int workers;
+	std::atomic<int> stop;
+};
+
+//完成队列：多个工作线程写入，只有所属生产者读取。
+//生产者保证未取回的任务不超过容量，写入不会追上读取
+struct encoder_producer {
+	struct encoder_service* service;
+	std::atomic<struct encode_job*>* ring;
+	size_t mask;
+	std::atomic<size_t> tail;
+
+	//以下只由生产者线程访问
+	size_t head;
+	size_t inflight;
+	unsigned int next;
+};
+
+struct encoder_service* encoder_create(struct protocol_dispatch* dispatch, int workers);
+//剩余的任务全部完成后停止工作线程；之后生产者仍可取回结果
+void encoder_release(struct encoder_service* s);
+
+//capacity为同时在途的任务上限，向上取整为2的幂
+struct encoder_producer* encoder_producer_create(struct encoder_service* s, size_t capacity);
+void encoder_producer_release(struct encoder_producer* p);
+
+void encoder_job_init(struct encode_job* job);
+void encoder_job_release(struct encode_job* job);
+
+//在途任务已满返回-1，此时应先取回结果
+int encoder_submit(struct encoder_producer* p, struct encode_job* job, int id, encode_func func, void* ud);
+//取回一个完成的任务，没有时返回NULL，不阻塞。完成顺序与提交顺序无关
+struct encode_job* encoder_poll(struct encoder_producer* p);
+
+#endif
@@ -0,0 +1,660 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+#include "wire.h"
+
+//生成的lua模块为每个协议输出一对展开后的encode/decode函数，
+//字段以常量key访问，嵌套协议直接调用对应函数，不需要运行时解释协议描述
+
+#define LUA_MAX_FIELD_LOCALS 128
+//引用了其他协议的协议由工厂函数生成，被引用协议的函数是工厂内的局部变量encode_<n>/decode_<n>，
+//全部协议生成后以参数传入绑定，调用时为upvalue。局部变量在各自的工厂内，与协议总数无关；
+//单个协议引用超过这么多个协议时，其余的经encode/decode表调用
+#define LUA_MAX_PROTOCOL_DEPS 64
+
+//当前生成的协议引用的协议，下标+1即局部函数的编号
+struct lua_deps
+{
+	struct protocol* ptl[LUA_MAX_PROTOCOL_DEPS];
+	int size;
+};
+
+static struct lua_deps deps;
+
+static const char* lua_keyword[] = {
+	"and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if",
+	"in", "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while",
+};
+
+//按类型编号排列，协议和map没有对应的函数
+static const char* write_func[TYPE_MAX] = {
+	"write_int", "write_int_array", "write_float", "write_float_array",
+	"write_double", "write_double_array", "write_string", "write_string_array",
+	NULL, NULL, "write_bool", "write_bool_array",
+	"write_int8", "write_int8_array", "write_int16", "write_int16_array",
+	"write_int64", "write_int64_array", "write_uint8", "write_uint8_array",
+	"write_uint16", "write_uint16_array", "write_uint32", "write_uint32_array",
+	"write_uint64", "write_uint64_array", "write_enum", "write_enum_array",
+};
+
+static const char* read_func[TYPE_MAX] = {
+	"read_int", "read_int_array", "read_float", "read_float_array",
+	"read_double", "read_double_array", "read_string", "read_string_array",
+	NULL, NULL, "read_bool", "read_bool_array",
+	"read_int8", "read_int8_array", "read_int16", "read_int16_array",
+	"read_int64", "read_int64_array", "read_uint8", "read_uint8_array",
+	"read_uint16", "read_uint16_array", "read_uint32", "read_uint32_array",
+	"read_uint64", "read_uint64_array", "read_enum", "read_enum_array",
+};
+
+static bool is_keyword(const char* name)
+{
+	for (int i = 0; i < (int)(sizeof(lua_keyword) / sizeof(void*)); i++)
+	{
+		if (strcmp(name, lua_keyword[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+//t.name，关键字则用t["name"]，两者都编译为常量key的GETTABLE
+static void gen_index(FILE* file, const char* table, const char* name)
+{
+	if (is_keyword(name))
+		fprintf(file, "%s[\"%s\"]", table, name);
+	else
+		fprintf(file, "%s.%s", table, name);
+}
+
+static void gen_key(FILE* file, const char* name)
+{
+	if (is_keyword(name))
+		fprintf(file, "[\"%s\"]", name);
+	else
+		fprintf(file, "%s", name);
+}
+
+//协议的encode/decode函数：在工厂的局部变量中时为encode_<n>，否则为encode["名字"]，buffer至少256字节
+static void protocol_func(char* buffer, const char* table, struct protocol* ptl)
+{
+	char name[240];
+	for (int i = 0; i < deps.size; i++)
+	{
+		if (deps.ptl[i] == ptl)
+		{
+			sprintf(buffer, "%s_%d", table, i + 1);
+			return;
+		}
+	}
+	protocol_fullname(ptl, name, sizeof(name));
+	sprintf(buffer, "%s[\"%s\"]", table, name);
+}
+
+//按字段顺序收集协议字段和map的值引用的协议，自身也可能在内
+static void collect_deps(struct protocol* ptl)
+{
+	deps.size = 0;
+	for (int i = 0; i < ptl->size && deps.size < LUA_MAX_PROTOCOL_DEPS; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->field_type.type != TYPE_PROTOCOL && (f->field_type.type != TYPE_MAP || f->field_type.value != TYPE_PROTOCOL))
+			continue;
+		int j = 0;
+		while (j < deps.size && deps.ptl[j] != f->field_type.protocol)
+			j++;
+		if (j == deps.size)
+			deps.ptl[deps.size++] = f->field_type.protocol;
+	}
+}
+
+static unsigned int field_key(struct field* f)
+{
+	return WIRE_KEY(f->tag, wire_tag_type(f->field_type.type));
+}
+
+//数组和协议作为可选字段时外面包一层长度，不认识的一方可以整体跳过
+static bool is_block(struct field* f)
+{
+	return f->field_type.type != TYPE_STRING && wire_tag_type(f->field_type.type) == WIRE_BYTES;
+}
+
+//枚举字段的读写函数多一个枚举表参数：, enums["名字"]，buffer至少256字节
+static void enum_arg(char* buffer, struct field* f)
+{
+	char name[240];
+	buffer[0] = '\0';
+	if ((f->field_type.type & ~1) != TYPE_ENUM)
+		return;
+	protocol_fullname(f->field_type.protocol, name, sizeof(name));
+	sprintf(buffer, ", enums[\"%s\"]", name);
+}
+
+//map的值为枚举或协议时多一个参数：枚举表或对应的encode/decode函数，其他值类型为nil
+static void map_arg(char* buffer, struct field* f, const char* table)
+{
+	char name[240];
+	if (f->field_type.value == TYPE_PROTOCOL)
+	{
+		protocol_func(buffer, table, f->field_type.protocol);
+		return;
+	}
+	if (f->field_type.value != TYPE_ENUM)
+	{
+		strcpy(buffer, "nil");
+		return;
+	}
+	protocol_fullname(f->field_type.protocol, name, sizeof(name));
+	sprintf(buffer, "enums[\"%s\"]", name);
+}
+
+//写入字段的值，value为lua表达式，nil按默认值编码。
+//bit为位置字段在存在位图中的位号，默认值由写入函数省略；可选字段为-1
+static void gen_encode_value(FILE* file, struct field* f, const char* value, int bit, const char* indent)
+{
+	char name[256];
+	if (f->field_type.type == TYPE_MAP)
+	{
+		map_arg(name, f, "encode");
+		fprintf(file, "%swrite_map(w, %s, %d, %d, %s", indent, value, f->field_type.key, f->field_type.value, name);
+		if (bit >= 0)
+			fprintf(file, ", m, %d", bit);
+		fprintf(file, ")\n");
+		return;
+	}
+	//定长数组总是写入，不足的元素按默认值补齐
+	if (f->field_type.size && f->field_type.type != TYPE_PROTOCOL)
+	{
+		enum_arg(name, f);
+		if (bit >= 0)
+			fprintf(file, "%sset_bit(w, m, %d)\n", indent, bit);
+		fprintf(file, "%swrite_fixed(w, %s, %d, %d%s)\n", indent, value, f->field_type.size, f->field_type.type, name);
+		return;
+	}
+	if (f->field_type.type != TYPE_PROTOCOL)
+	{
+		enum_arg(name, f);
+		if (bit < 0)
+			fprintf(file, "%s%s(w, %s%s)\n", indent, write_func[f->field_type.type], value, name);
+		else
+			fprintf(file, "%s%s(w, %s%s, m, %d)\n", indent, write_func[f->field_type.type], value, name, bit);
+		return;
+	}
+
+	protocol_func(name, "encode", f->field_type.protocol);
+	if (f->field_type.size)
+	{
+		int size = f->field_type.size;
+		fprintf(file, "%sdo\n", indent);
+		fprintf(file, "%s\tlocal a = %s or empty\n", indent, value);
+		fprintf(file, "%s\tif #a > %d then\n", indent, size);
+		fprintf(file, "%s\t\terror(\"protocol array expect at most %d elements\")\n", indent, size);
+		fprintf(file, "%s\tend\n", indent);
+		if (bit >= 0)
+			fprintf(file, "%s\tset_bit(w, m, %d)\n", indent, bit);
+		fprintf(file, "%s\twrite_count(w, %d)\n", indent, size);
+		fprintf(file, "%s\tlocal f = %s\n", indent, name);
+		fprintf(file, "%s\tfor i = 1, %d do\n", indent, size);
+		fprintf(file, "%s\t\tf(w, a[i] or empty)\n", indent);
+		fprintf(file, "%s\tend\n", indent);
+		fprintf(file, "%send\n", indent);
+	}
+	else if (f->field_type.isarray)
+	{
+		fprintf(file, "%sdo\n", indent);
+		fprintf(file, "%s\tlocal a = %s or empty\n", indent, value);
+		fprintf(file, "%s\tlocal n = #a\n", indent);
+		if (bit >= 0)
+		{
+			fprintf(file, "%s\tif n > 0 then\n", indent);
+			fprintf(file, "%s\t\tset_bit(w, m, %d)\n", indent, bit);
+			fprintf(file, "%s\t\twrite_count(w, n)\n", indent);
+			fprintf(file, "%s\tend\n", indent);
+		}
+		else
+		{
+			fprintf(file, "%s\twrite_count(w, n)\n", indent);
+		}
+		fprintf(file, "%s\tlocal f = %s\n", indent, name);
+		fprintf(file, "%s\tfor i = 1, n do\n", indent);
+		fprintf(file, "%s\t\tf(w, a[i])\n", indent);
+		fprintf(file, "%s\tend\n", indent);
+		fprintf(file, "%send\n", indent);
+	}
+	else
+	{
+		if (bit >= 0)
+			fprintf(file, "%sset_bit(w, m, %d)\n", indent, bit);
+		fprintf(file, "%s%s(w, %s or empty)\n", indent, name, value);
+	}
+}
+
+static void format_index(char* buffer, const char* table, const char* name)
+{
+	if (is_keyword(name))
+		sprintf(buffer, "%s[\"%s\"]", table, name);
+	else
+		sprintf(buffer, "%s.%s", table, name);
+}
+
+static void gen_encode(FILE* file, struct protocol* ptl, const char* fullname)
+{
+	char value[256];
+	fprintf(file, "encode[\"%s\"] = function(w, t)\n", fullname);
+	int positional = protocol_positional(ptl);
+	if (positional > 0)
+		fprintf(file, "\tlocal m = begin_bitmap(w, %d)\n", WIRE_BITMAP_SIZE(positional));
+	int bit = 0;
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag != 0)
+			continue;
+		format_index(value, "t", f->name);
+		gen_encode_value(file, f, value, bit++, "\t");
+	}
+
+	//可选字段为nil时不写入
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag == 0)
+			continue;
+		fprintf(file, "\tdo\n");
+		fprintf(file, "\t\tlocal v = ");
+		gen_index(file, "t", f->name);
+		fprintf(file, "\n");
+		fprintf(file, "\t\tif v ~= nil then\n");
+		fprintf(file, "\t\t\twrite_key(w, %u)\n", field_key(f));
+		if (is_block(f))
+		{
+			fprintf(file, "\t\t\tlocal e = begin_block(w)\n");
+			gen_encode_value(file, f, "v", -1, "\t\t\t");
+			fprintf(file, "\t\t\tend_block(w, e)\n");
+		}
+		else
+		{
+			gen_encode_value(file, f, "v", -1, "\t\t\t");
+		}
+		fprintf(file, "\t\tend\n");
+		fprintf(file, "\tend\n");
+	}
+	fprintf(file, "\twrite_key(w, 0)\n");
+	fprintf(file, "end\n\n");
+}
+
+//bit为位置字段的位号，位为0时读取函数返回默认值；可选字段为-1
+static void gen_decode_field(FILE* file, struct field* f, const char* target, int bit, const char* indent)
+{
+	char name[256];
+	if (f->field_type.type == TYPE_MAP)
+	{
+		map_arg(name, f, "decode");
+		fprintf(file, "read_map(r, %d, %d, %s", f->field_type.key, f->field_type.value, name);
+		if (bit >= 0)
+			fprintf(file, ", m, %d", bit);
+		fprintf(file, ")\n");
+		return;
+	}
+	//定长数组的个数必须与定义一致，位置字段的位为0时报错
+	if (f->field_type.size && f->field_type.type != TYPE_PROTOCOL)
+	{
+		enum_arg(name, f);
+		fprintf(file, "read_fixed(r, %d, %d%s", f->field_type.size, f->field_type.type, name[0] ? name : ", nil");
+		if (bit >= 0)
+			fprintf(file, ", m, %d", bit);
+		fprintf(file, ")\n");
+		return;
+	}
+	if (f->field_type.type != TYPE_PROTOCOL)
+	{
+		//数组的第二个参数为原来的table，枚举表在它之后
+		enum_arg(name, f);
+		if (bit < 0 && (f->field_type.type & 1) && name[0])
+			fprintf(file, "%s(r, nil%s)\n", read_func[f->field_type.type], name);
+		else if (bit < 0)
+			fprintf(file, "%s(r%s)\n", read_func[f->field_type.type], name);
+		else if (f->field_type.type & 1)
+			fprintf(file, "%s(r, nil%s, m, %d)\n", read_func[f->field_type.type], name, bit);
+		else
+			fprintf(file, "%s(r%s, m, %d)\n", read_func[f->field_type.type], name, bit);
+		return;
+	}
+
+	protocol_func(name, "decode", f->field_type.protocol);
+	if (!f->field_type.isarray)
+	{
+		fprintf(file, "%s(r)\n", name);
+		return;
+	}
+
+	if (f->field_type.size)
+	{
+		if (bit < 0)
+			fprintf(file, "begin_fixed(r, %d)\n", f->field_type.size);
+		else
+			fprintf(file, "begin_fixed(r, %d, m, %d)\n", f->field_type.size, bit);
+		fprintf(file, "%sdo\n", indent);
+		fprintf(file, "%s\tlocal f = %s\n", indent, name);
+		fprintf(file, "%s\tfor i = 1, %d do\n", indent, f->field_type.size);
+		fprintf(file, "%s\t\t%s[i] = f(r)\n", indent, target);
+		fprintf(file, "%s\tend\n", indent);
+		fprintf(file, "%send\n", indent);
+		return;
+	}
+
+	fprintf(file, "{}\n");
+	if (bit < 0)
+		fprintf(file, "%sdo\n", indent);
+	else
+		fprintf(file, "%sif has_bit(r, m, %d) then\n", indent, bit);
+	fprintf(file, "%s\tlocal f = %s\n", indent, name);
+	fprintf(file, "%s\tfor i = 1, read_count(r) do\n", indent);
+	fprintf(file, "%s\t\t%s[i] = f(r)\n", indent, target);
+	fprintf(file, "%s\tend\n", indent);
+	fprintf(file, "%send\n", indent);
+}
+
+//可选字段按key分派，不认识的key按类型跳过
+static void gen_decode_tagged(FILE* file, struct protocol* ptl, bool locals)
+{
+	char target[64];
+	int count = 0;
+	for (int i = 0; i < ptl->size; i++)
+	{
+		if (ptl->field[i]->tag != 0)
+			count++;
+	}
+	if (count == 0)
+	{
+		fprintf(file, "\tskip_tagged(r)\n");
+		return;
+	}
+
+	fprintf(file, "\tlocal k = read_key(r)\n");
+	fprintf(file, "\twhile k ~= 0 do\n");
+	count = 0;
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag == 0)
+			continue;
+		fprintf(file, "\t\t%s k == %u then\n", count++ == 0 ? "if" : "elseif", field_key(f));
+		if (is_block(f))
+			fprintf(file, "\t\t\tlocal e = read_block(r)\n");
+		if (locals)
+		{
+			sprintf(target, "f%d", i + 1);
+			fprintf(file, "\t\t\t%s = ", target);
+		}
+		else
+		{
+			strcpy(target, "v");
+			fprintf(file, "\t\t\tlocal v = ");
+		}
+		gen_decode_field(file, f, target, -1, "\t\t\t");
+		if (is_block(f))
+			fprintf(file, "\t\t\tclose_block(r, e)\n");
+		if (!locals)
+		{
+			fprintf(file, "\t\t\t");
+			gen_index(file, "t", f->name);
+			fprintf(file, " = v\n");
+		}
+	}
+	fprintf(file, "\t\telse\n");
+	fprintf(file, "\t\t\tskip_value(r, k)\n");
+	fprintf(file, "\t\tend\n");
+	fprintf(file, "\t\tk = read_key(r)\n");
+	fprintf(file, "\tend\n");
+}
+
+static void gen_decode(FILE* file, struct protocol* ptl, const char* fullname)
+{
+	char target[64];
+	fprintf(file, "decode[\"%s\"] = function(r)\n", fullname);
+	int positional = protocol_positional(ptl);
+	if (positional > 0)
+		fprintf(file, "\tlocal m = read_bitmap(r, %d)\n", WIRE_BITMAP_SIZE(positional));
+	int bit = 0;
+
+	//字段先读入局部变量，再由一个构造表达式生成table，table的hash部分一次分配到位
+	if (ptl->size <= LUA_MAX_FIELD_LOCALS)
+	{
+		for (int i = 0; i < ptl->size; i++)
+		{
+			sprintf(target, "f%d", i + 1);
+			if (ptl->field[i]->tag != 0)
+			{
+				fprintf(file, "\tlocal %s\n", target);
+				continue;
+			}
+			fprintf(file, "\tlocal %s = ", target);
+			gen_decode_field(file, ptl->field[i], target, bit++, "\t");
+		}
+		gen_decode_tagged(file, ptl, true);
+		fprintf(file, "\treturn {");
+		for (int i = 0; i < ptl->size; i++)
+		{
+			fprintf(file, i == 0 ? " " : ", ");
+			gen_key(file, ptl->field[i]->name);
+			fprintf(file, " = f%d", i + 1);
+		}
+		fprintf(file, ptl->size > 0 ? " }\n" : "}\n");
+	}
+	else
+	{
+		//字段过多会超出lua局部变量上限，逐个赋值
+		fprintf(file, "\tlocal t = {}\n");
+		for (int i = 0; i < ptl->size; i++)
+		{
+			struct field* f = ptl->field[i];
+			if (f->tag != 0)
+				continue;
+			if (f->field_type.type == TYPE_PROTOCOL && f->field_type.isarray)
+			{
+				fprintf(file, "\tlocal v = ");
+				gen_decode_field(file, f, "v", bit++, "\t");
+				fprintf(file, "\t");
+				gen_index(file, "t", f->name);
+				fprintf(file, " = v\n");
+			}
+			else
+			{
+				fprintf(file, "\t");
+				gen_index(file, "t", f->name);
+				fprintf(file, " = ");
+				gen_decode_field(file, f, NULL, bit++, "\t");
+			}
+		}
+		gen_decode_tagged(file, ptl, false);
+		fprintf(file, "\treturn t\n");
+	}
+	fprintf(file, "end\n\n");
+}
+
+//枚举表：名字到值，值到名字
+static void gen_enum(FILE* file, struct protocol* e, const char* fullname)
+{
+	fprintf(file, "-- %s@%s\n", e->file, fullname);
+	fprintf(file, "enums[\"%s\"] = {", fullname);
+	for (int i = 0; i < e->size; i++)
+	{
+		fprintf(file, i == 0 ? " " : ", ");
+		gen_key(file, e->field[i]->name);
+		fprintf(file, " = %d, [%d] = \"%s\"", e->field[i]->tag, e->field[i]->tag, e->field[i]->name);
+	}
+	fprintf(file, e->size > 0 ? " }\n\n" : "}\n\n");
+}
+
+static void gen_protocol(FILE* file, struct protocol* ptl)
+{
+	char fullname[256];
+	protocol_fullname(ptl, fullname, sizeof(fullname));
+	if (ptl->isenum)
+	{
+		gen_enum(file, ptl, fullname);
+		return;
+	}
+
+	fprintf(file, "-- %s@%s\n", ptl->file, fullname);
+	collect_deps(ptl);
+	if (deps.size > 0)
+	{
+		fprintf(file, "link[\"%s\"] = (function()\n", fullname);
+		fprintf(file, "local ");
+		for (int i = 0; i < deps.size; i++)
+			fprintf(file, i == 0 ? "encode_%d, decode_%d" : ", encode_%d, decode_%d", i + 1, i + 1);
+		fprintf(file, "\n\n");
+	}
+	gen_encode(file, ptl, fullname);
+	gen_decode(file, ptl, fullname);
+	if (deps.size > 0)
+	{
+		fprintf(file, "return function(...)\n\t");
+		for (int i = 0; i < deps.size; i++)
+			fprintf(file, i == 0 ? "encode_%d, decode_%d" : ", encode_%d, decode_%d", i + 1, i + 1);
+		fprintf(file, " = ...\n");
+		fprintf(file, "end\n");
+		fprintf(file, "end)()\n\n");
+	}
+	fprintf(file, "protocol_id[\"%s\"] = %d\n", fullname, ptl->id);
+	fprintf(file, "protocol_name[%d] = \"%s\"\n", ptl->id, fullname);
+	fprintf(file, "decode_by_id[%d] = decode[\"%s\"]\n\n", ptl->id, fullname);
+
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		struct protocol* child = table->slots[i];
+		while (child)
+		{
+			gen_protocol(file, child);
+			child = child->next;
+		}
+	}
+}
+
+//所有协议的函数都生成后，把引用的协议函数传给各工厂绑定
+static void gen_link(FILE* file, struct protocol_table* table)
+{
+	char name[256];
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* ptl = table->slots[i]; ptl; ptl = ptl->next)
+		{
+			collect_deps(ptl);
+			if (deps.size > 0)
+			{
+				protocol_fullname(ptl, name, sizeof(name));
+				fprintf(file, "link[\"%s\"](", name);
+				for (int j = 0; j < deps.size; j++)
+				{
+					protocol_fullname(deps.ptl[j], name, sizeof(name));
+					fprintf(file, j == 0 ? "encode[\"%s\"]" : ", encode[\"%s\"]", name);
+					fprintf(file, ", decode[\"%s\"]", name);
+				}
+				fprintf(file, ")\n");
+			}
+			gen_link(file, ptl->children);
+		}
+	}
+}
+
+int gen_lua(struct protocol* root, const char* output)
+{
+	FILE* file = fopen(output, "w");
+	if (file == NULL)
+	{
+		fprintf(stderr, "can not open %s\n", output);
+		return -1;
+	}
+
+	fprintf(file, "-- generated by protocol, do not edit\n");
+	fprintf(file, "local wire = require \"protocol.wire\"\n\n");
+	for (int i = 0; i < TYPE_MAX; i++)
+	{
+		if (write_func[i])
+			fprintf(file, "local %s = wire.%s\n", write_func[i], write_func[i]);
+	}
+	fprintf(file, "local write_count = wire.write_count\n");
+	fprintf(file, "local write_fixed = wire.write_fixed\n");
+	fprintf(file, "local write_map = wire.write_map\n");
+	for (int i = 0; i < TYPE_MAX; i++)
+	{
+		if (read_func[i])
+			fprintf(file, "local %s = wire.%s\n", read_func[i], read_func[i]);
+	}
+	fprintf(file, "local read_count = wire.read_count\n");
+	fprintf(file, "local read_fixed = wire.read_fixed\n");
+	fprintf(file, "local begin_fixed = wire.begin_fixed\n");
+	fprintf(file, "local read_map = wire.read_map\n");
+	fprintf(file, "local begin_bitmap = wire.begin_bitmap\n");
+	fprintf(file, "local set_bit = wire.set_bit\n");
+	fprintf(file, "local read_bitmap = wire.read_bitmap\n");
+	fprintf(file, "local has_bit = wire.has_bit\n");
+	fprintf(file, "local write_key = wire.write_key\n");
+	fprintf(file, "local begin_block = wire.begin_block\n");
+	fprintf(file, "local end_block = wire.end_block\n");
+	fprintf(file, "local read_key = wire.read_key\n");
+	fprintf(file, "local skip_value = wire.skip_value\n");
+	fprintf(file, "local skip_tagged = wire.skip_tagged\n");
+	fprintf(file, "local read_block = wire.read_block\n");
+	fprintf(file, "local close_block = wire.close_block\n\n");
+
+	fprintf(file, "local empty = {}\n");
+	fprintf(file, "local encode = {}\n");
+	fprintf(file, "local decode = {}\n");
+	fprintf(file, "local enums = {}\n");
+	fprintf(file, "local protocol_id = {}\n");
+	fprintf(file, "local protocol_name = {}\n");
+	fprintf(file, "local decode_by_id = {}\n");
+	fprintf(file, "local link = {}\n\n");
+
+	struct protocol_table* table = root->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		struct protocol* ptl = table->slots[i];
+		while (ptl)
+		{
+			gen_protocol(file, ptl);
+			ptl = ptl->next;
+		}
+	}
+
+	gen_link(file, root->children);
+	deps.size = 0;
+	fprintf(file, "\n");
+
+	fprintf(file, "local writer = wire.writer()\n\n");
+	fprintf(file, "local M = { encoder = encode, decoder = decode, enums = enums, id = protocol_id, name = protocol_name }\n\n");
+	fprintf(file, "function M.encode(name, t)\n");
+	fprintf(file, "\tlocal f = encode[name] or error(\"unknown protocol \" .. tostring(name))\n");
+	fprintf(file, "\twire.reset(writer)\n");
+	fprintf(file, "\tf(writer, t)\n");
+	fprintf(file, "\treturn wire.finish(writer)\n");
+	fprintf(file, "end\n\n");
+	fprintf(file, "function M.decode(name, s)\n");
+	fprintf(file, "\tlocal f = decode[name] or error(\"unknown protocol \" .. tostring(name))\n");
+	fprintf(file, "\tlocal r = wire.reader(s)\n");
+	fprintf(file, "\tlocal t = f(r)\n");
+	fprintf(file, "\tif wire.remain(r) ~= 0 then\n");
+	fprintf(file, "\t\terror(\"protocol \" .. name .. \" has trailing data\")\n");
+	fprintf(file, "\tend\n");
+	fprintf(file, "\treturn t\n");
+	fprintf(file, "end\n\n");
+	//收包时按id直接定位解码函数
+	fprintf(file, "function M.decode_id(id, s)\n");
+	fprintf(file, "\tlocal f = decode_by_id[id] or error(\"unknown protocol id \" .. tostring(id))\n");
+	fprintf(file, "\tlocal r = wire.reader(s)\n");
+	fprintf(file, "\tlocal t = f(r)\n");
+	fprintf(file, "\tif wire.remain(r) ~= 0 then\n");
+	fprintf(file, "\t\terror(\"protocol \" .. protocol_name[id] .. \" has trailing data\")\n");
+	fprintf(file, "\tend\n");
+	fprintf(file, "\treturn t, protocol_name[id]\n");
+	fprintf(file, "end\n\n");
+	fprintf(file, "return M\n");
+
+	fclose(file);
+	return 0;
+}
@@ -0,0 +1,3132 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+extern "C" {
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+}
+
+#include "protocol.h"
+#include "wire.h"
+#include "utf8.h"
+#include "view.h"
+#include "offset.h"
+
+#define WRITER_META "protocol.writer"
+#define READER_META "protocol.reader"
+#define SCHEMA_META "protocol.schema"
+#define BATCH_META "protocol.batch"
+#define DICT_META "protocol.dictionary"
+#define LAZY_META "protocol.lazy"
+
+#define CODEC_MAX_DEPTH 64
+//每个协议最多缓存的空闲table
+#define CODEC_POOL_MAX 256
+
+#define check_writer(L) ((struct write_buffer*)luaL_checkudata(L, 1, WRITER_META))
+#define check_reader(L) ((struct read_buffer*)luaL_checkudata(L, 1, READER_META))
+
+static int truncated(lua_State* L)
+{
+	return luaL_error(L, "protocol data truncated");
+}
+
+static int lwriter(lua_State* L)
+{
+	struct write_buffer* buffer = (struct write_buffer*)lua_newuserdata(L, sizeof(*buffer));
+	buffer_init(buffer);
+	luaL_setmetatable(L, WRITER_META);
+	return 1;
+}
+
+static int lwriter_gc(lua_State* L)
+{
+	buffer_release(check_writer(L));
+	return 0;
+}
+
+static int lfinish(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	lua_pushlstring(L, buffer->ptr, buffer->offset);
+	buffer_reset(buffer);
+	return 1;
+}
+
+static int lreset(lua_State* L)
+{
+	buffer_reset(check_writer(L));
+	return 0;
+}
+
+//位置字段的写入在值之后传入位图位置和位号：值为默认值时不写入，否则置位后写入
+static int write_present(lua_State* L, struct write_buffer* buffer, int arg, int present)
+{
+	if (lua_isnoneornil(L, arg))
+		return 1;
+	if (!present)
+		return 0;
+	size_t mark = (size_t)luaL_checkinteger(L, arg);
+	int bit = (int)luaL_checkinteger(L, arg + 1);
+	if (bit < 0 || mark + (bit >> 3) >= buffer->offset)
+		luaL_error(L, "protocol bitmap out of range");
+	wire_set_bit(buffer, mark, bit);
+	return 1;
+}
+
+static bool to_integer(lua_State* L, int index, int type, unsigned long long* value);
+static unsigned long long integer_arg(lua_State* L, int arg, int type, int enums);
+
+static int lwrite_int(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int value = (int)integer_arg(L, 2, TYPE_INT, 0);
+	if (write_present(L, buffer, 3, value != 0))
+		wire_write_int(buffer, value);
+	return 0;
+}
+
+static int lwrite_float(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	double value = (double)luaL_optnumber(L, 2, 0);
+	if (write_present(L, buffer, 3, !wire_is_zero(value)))
+		wire_write_float(buffer, (float)value);
+	return 0;
+}
+
+static int lwrite_double(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	double value = (double)luaL_optnumber(L, 2, 0);
+	if (write_present(L, buffer, 3, !wire_is_zero(value)))
+		wire_write_double(buffer, value);
+	return 0;
+}
+
+static int lwrite_string(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	size_t len;
+	const char* str = luaL_optlstring(L, 2, "", &len);
+	if (write_present(L, buffer, 3, len > 0))
+		wire_write_string(buffer, str, len);
+	return 0;
+}
+
+static int lwrite_count(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	wire_write_count(buffer, (size_t)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+//数组字段为nil时按空数组处理，写入函数的size为要写入的元素个数，超过#t的部分按默认值补齐
+static int array_size(lua_State* L, int index)
+{
+	if (lua_isnoneornil(L, index))
+		return 0;
+	luaL_checktype(L, index, LUA_TTABLE);
+	return (int)lua_rawlen(L, index);
+}
+
+static void write_int_array(lua_State* L, struct write_buffer* buffer, int index, int size)
+{
+	size_t mark = wire_begin_int_array(buffer, size);
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		unsigned long long value;
+		if (!to_integer(L, -1, TYPE_INT, &value))
+			luaL_error(L, "protocol array element %d invalid value", i);
+		wire_write_int(buffer, (int)value);
+		lua_pop(L, 1);
+	}
+	wire_end_int_array(buffer, mark);
+}
+
+//定长数组先一次预留整块空间，再按元素直接写入
+static void write_float_array(lua_State* L, struct write_buffer* buffer, int index, int size)
+{
+	wire_write_count(buffer, size);
+	buffer_reserve(buffer, size * sizeof(float));
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		float value = (float)lua_tonumber(L, -1);
+		wire_write_float(buffer, value);
+		lua_pop(L, 1);
+	}
+}
+
+static void write_double_array(lua_State* L, struct write_buffer* buffer, int index, int size)
+{
+	wire_write_count(buffer, size);
+	buffer_reserve(buffer, size * sizeof(double));
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		wire_write_double(buffer, (double)lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+static void write_string_array(lua_State* L, struct write_buffer* buffer, int index, int size)
+{
+	wire_write_count(buffer, size);
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		size_t len = 0;
+		const char* str = lua_tolstring(L, -1, &len);
+		wire_write_string(buffer, str ? str : "", len);
+		lua_pop(L, 1);
+	}
+}
+
+static int lwrite_int_array(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int size = array_size(L, 2);
+	if (write_present(L, buffer, 3, size > 0))
+		write_int_array(L, buffer, 2, size);
+	return 0;
+}
+
+static int lwrite_float_array(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int size = array_size(L, 2);
+	if (write_present(L, buffer, 3, size > 0))
+		write_float_array(L, buffer, 2, size);
+	return 0;
+}
+
+static int lwrite_double_array(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int size = array_size(L, 2);
+	if (write_present(L, buffer, 3, size > 0))
+		write_double_array(L, buffer, 2, size);
+	return 0;
+}
+
+static int lwrite_string_array(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int size = array_size(L, 2);
+	if (write_present(L, buffer, 3, size > 0))
+		write_string_array(L, buffer, 2, size);
+	return 0;
+}
+
+//扩展整数类型：lua 5.2的数字为double，int64/uint64超过2^53时用十进制字符串表示精确值
+#define INTEGER_EXACT_MAX 9007199254740992LL
+
+static bool parse_integer(const char* str, int type, unsigned long long* value)
+{
+	char* end;
+	errno = 0;
+	if (type_signed(type))
+		*value = (unsigned long long)strtoll(str, &end, 10);
+	else if (*str == '-')
+		return false;
+	else
+		*value = strtoull(str, &end, 10);
+	return errno == 0 && end != str && *end == '\0';
+}
+
+//数字或十进制字符串转为type的64位值，nil为0；不是整数的数字截断，其他类型或超出类型的范围返回false
+static bool to_integer(lua_State* L, int index, int type, unsigned long long* value)
+{
+	*value = 0;
+	if (lua_type(L, index) == LUA_TSTRING)
+		return parse_integer(lua_tostring(L, index), type, value) && wire_integer_fits(type, *value);
+	if (lua_type(L, index) != LUA_TNUMBER)
+		return lua_isnoneornil(L, index);
+	lua_Number n = lua_tonumber(L, index);
+	if (type_signed(type))
+	{
+		if (!(n >= -9223372036854775808.0 && n < 9223372036854775808.0))
+			return false;
+		*value = (unsigned long long)(long long)n;
+	}
+	else
+	{
+		if (!(n > -1 && n < 18446744073709551616.0))
+			return false;
+		*value = (unsigned long long)n;
+	}
+	return wire_integer_fits(type, *value);
+}
+
+//枚举接受枚举项的名字或数值，enums为枚举表(名字到值、值到名字)的栈位置
+static bool to_enum(lua_State* L, int index, int enums, unsigned long long* value)
+{
+	if (lua_type(L, index) != LUA_TSTRING)
+		return to_integer(L, index, TYPE_ENUM, value);
+	lua_pushvalue(L, index);
+	lua_rawget(L, enums);
+	bool ok = lua_type(L, -1) == LUA_TNUMBER;
+	*value = ok ? (unsigned long long)lua_tonumber(L, -1) : 0;
+	lua_pop(L, 1);
+	return ok;
+}
+
+//enums为枚举表的栈位置，认识的枚举值解码为名字，不认识的(新版本增加的枚举项)保留数值
+static void push_integer(lua_State* L, int type, unsigned long long value, int enums)
+{
+	char str[32];
+	if ((type & ~1) == TYPE_ENUM)
+	{
+		lua_pushnumber(L, (lua_Number)value);
+		lua_rawget(L, enums);
+		if (lua_isnil(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_pushnumber(L, (lua_Number)value);
+		}
+		return;
+	}
+	if (type_signed(type))
+	{
+		long long s = (long long)value;
+		if (s >= -INTEGER_EXACT_MAX && s <= INTEGER_EXACT_MAX)
+		{
+			lua_pushnumber(L, (lua_Number)s);
+			return;
+		}
+		sprintf(str, "%lld", s);
+	}
+	else
+	{
+		if (value <= (unsigned long long)INTEGER_EXACT_MAX)
+		{
+			lua_pushnumber(L, (lua_Number)value);
+			return;
+		}
+		sprintf(str, "%llu", value);
+	}
+	lua_pushstring(L, str);
+}
+
+static unsigned long long integer_arg(lua_State* L, int arg, int type, int enums)
+{
+	unsigned long long value;
+	if (!((type & ~1) == TYPE_ENUM ? to_enum(L, arg, enums, &value) : to_integer(L, arg, type, &value)))
+		luaL_argerror(L, arg, "invalid value");
+	return value;
+}
+
+//int8~uint64共用一组读写函数，元素类型为upvalue
+#define upvalue_type(L) ((int)lua_tointeger(L, lua_upvalueindex(1)))
+
+static int lwrite_integer(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int type = upvalue_type(L);
+	unsigned long long value = integer_arg(L, 2, type, 0);
+	if (write_present(L, buffer, 3, value != 0))
+		wire_write_integer(buffer, type, value);
+	return 0;
+}
+
+//write_enum(w, v, e[, m, bit])，e为生成代码中的枚举表
+static int lwrite_enum(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	unsigned long long value = integer_arg(L, 2, TYPE_ENUM, 3);
+	if (write_present(L, buffer, 4, value != 0))
+		wire_write_integer(buffer, TYPE_ENUM, value);
+	return 0;
+}
+
+//位置字段的bool只置位，不写入值
+static int lwrite_bool(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int value = lua_toboolean(L, 2);
+	if (write_present(L, buffer, 3, value) && lua_isnoneornil(L, 3))
+		wire_write_integer(buffer, TYPE_BOOL, value);
+	return 0;
+}
+
+//type为数组类型，enums为枚举表的栈位置
+static void write_integer_array(lua_State* L, struct write_buffer* buffer, int index, int size, int type, int enums)
+{
+	size_t mark = wire_begin_int_array(buffer, size);
+	buffer_reserve(buffer, (size_t)size * WIRE_MAX_VARINT);
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		unsigned long long value;
+		if (!(type == TYPE_ENUM_ARRAY ? to_enum(L, -1, enums, &value) : to_integer(L, -1, type - 1, &value)))
+			luaL_error(L, "protocol array element %d invalid value", i);
+		wire_put_integer(buffer, type - 1, value);
+		lua_pop(L, 1);
+	}
+	wire_end_int_array(buffer, mark);
+}
+
+static void write_bool_array(lua_State* L, struct write_buffer* buffer, int index, int size)
+{
+	wire_write_count(buffer, size);
+	size_t mark = wire_begin_bitmap(buffer, WIRE_BITMAP_SIZE(size));
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		if (lua_toboolean(L, -1))
+			wire_set_bit(buffer, mark, i - 1);
+		lua_pop(L, 1);
+	}
+}
+
+static int lwrite_integer_array(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int size = array_size(L, 2);
+	if (write_present(L, buffer, 3, size > 0))
+		write_integer_array(L, buffer, 2, size, upvalue_type(L) + 1, 0);
+	return 0;
+}
+
+static int lwrite_enum_array(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int size = array_size(L, 2);
+	if (write_present(L, buffer, 4, size > 0))
+		write_integer_array(L, buffer, 2, size, TYPE_ENUM_ARRAY, 3);
+	return 0;
+}
+
+static int lwrite_bool_array(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int size = array_size(L, 2);
+	if (write_present(L, buffer, 3, size > 0))
+		write_bool_array(L, buffer, 2, size);
+	return 0;
+}
+
+//write_fixed(w, a, n, type[, e])：定长数组总是写入n个元素，不足的按默认值补齐，位置字段由生成代码先置位
+static int lwrite_fixed(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int size = (int)luaL_checkinteger(L, 3);
+	int type = (int)luaL_checkinteger(L, 4);
+	if (array_size(L, 2) > size)
+		return luaL_error(L, "protocol array expect at most %d elements", size);
+	lua_settop(L, 5);
+	if (lua_isnil(L, 2))
+	{
+		lua_newtable(L);
+		lua_replace(L, 2);
+	}
+	switch (type)
+	{
+	case TYPE_INT_ARRAY:
+		write_int_array(L, buffer, 2, size);
+		break;
+	case TYPE_FLOAT_ARRAY:
+		write_float_array(L, buffer, 2, size);
+		break;
+	case TYPE_DOUBLE_ARRAY:
+		write_double_array(L, buffer, 2, size);
+		break;
+	case TYPE_STRING_ARRAY:
+		write_string_array(L, buffer, 2, size);
+		break;
+	case TYPE_BOOL_ARRAY:
+		write_bool_array(L, buffer, 2, size);
+		break;
+	default:
+		if (!type_integer(type) || (type & 1) == 0)
+			return luaL_argerror(L, 4, "invalid type");
+		if (type == TYPE_ENUM_ARRAY)
+			luaL_checktype(L, 5, LUA_TTABLE);
+		write_integer_array(L, buffer, 2, size, type, 5);
+		break;
+	}
+	return 0;
+}
+
+//除了string，int64/uint64(十进制字符串)和枚举(枚举项的名字)也接受字符串
+static bool accept_string(int type)
+{
+	return type == TYPE_STRING || type == TYPE_INT64 || type == TYPE_UINT64 || type == TYPE_ENUM;
+}
+
+//map的键和值，enums为枚举表的栈位置
+static void write_scalar(lua_State* L, struct write_buffer* buffer, int type, int index, int enums)
+{
+	if (type == TYPE_BOOL)
+	{
+		wire_write_integer(buffer, TYPE_BOOL, lua_toboolean(L, index));
+		return;
+	}
+	int t = lua_type(L, index);
+	if (t != LUA_TNUMBER && (t != LUA_TSTRING || !accept_string(type)))
+		luaL_error(L, "protocol map expect %s, got %s", type == TYPE_STRING ? "string" : "number", luaL_typename(L, index));
+
+	unsigned long long value;
+	switch (type)
+	{
+	case TYPE_FLOAT:
+		wire_write_float(buffer, (float)lua_tonumber(L, index));
+		return;
+	case TYPE_DOUBLE:
+		wire_write_double(buffer, (double)lua_tonumber(L, index));
+		return;
+	case TYPE_STRING:
+	{
+		size_t len;
+		const char* str = lua_tolstring(L, index, &len);
+		wire_write_string(buffer, str, len);
+		return;
+	}
+	}
+	if (!type_integer(type) || (type & 1))
+		luaL_error(L, "protocol map invalid type %d", type);
+	if (!(type == TYPE_ENUM ? to_enum(L, index, enums, &value) : to_integer(L, index, type, &value)))
+		luaL_error(L, "protocol map invalid value %s", lua_tostring(L, index));
+	wire_write_integer(buffer, type, value);
+}
+
+static int map_size(lua_State* L, int index)
+{
+	int count = 0;
+	if (lua_isnoneornil(L, index))
+		return 0;
+	luaL_checktype(L, index, LUA_TTABLE);
+	lua_pushnil(L);
+	while (lua_next(L, index))
+	{
+		count++;
+		lua_pop(L, 1);
+	}
+	return count;
+}
+
+//write_map(w, t, ktype, vtype, x[, m, bit])，x为值的枚举表或协议的encode函数，其他值类型为nil
+static int lwrite_map(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	int ktype = (int)luaL_checkinteger(L, 3);
+	int vtype = (int)luaL_checkinteger(L, 4);
+	int count = map_size(L, 2);
+	if (vtype == TYPE_ENUM || vtype == TYPE_PROTOCOL)
+		luaL_checktype(L, 5, vtype == TYPE_ENUM ? LUA_TTABLE : LUA_TFUNCTION);
+	if (!write_present(L, buffer, 6, count > 0))
+		return 0;
+	wire_write_count(buffer, count);
+	lua_settop(L, 5);
+	for (lua_pushnil(L); count > 0 && lua_next(L, 2); lua_pop(L, 1))
+	{
+		//键复制一份再写入，lua_tolstring不能改变遍历中的键
+		lua_pushvalue(L, -2);
+		write_scalar(L, buffer, ktype, 8, 0);
+		lua_pop(L, 1);
+		if (vtype != TYPE_PROTOCOL)
+		{
+			write_scalar(L, buffer, vtype, 7, 5);
+			continue;
+		}
+		lua_pushvalue(L, 5);
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 7);
+		lua_call(L, 2, 0);
+	}
+	return 0;
+}
+
+static int lreader(lua_State* L)
+{
+	size_t size;
+	const char* str = luaL_checklstring(L, 1, &size);
+	struct read_buffer* reader = (struct read_buffer*)lua_newuserdata(L, sizeof(*reader));
+	reader_init(reader, str, size);
+	luaL_setmetatable(L, READER_META);
+	//读取期间引用源字符串，防止被回收
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+//位置字段的读取传入read_bitmap返回的位图位置和位号，位为0时返回默认值
+static int read_absent(lua_State* L, struct read_buffer* reader, int arg)
+{
+	if (lua_isnoneornil(L, arg))
+		return 0;
+	size_t mark = (size_t)luaL_checkinteger(L, arg);
+	int bit = (int)luaL_checkinteger(L, arg + 1);
+	if (bit < 0 || mark + (bit >> 3) >= reader->offset)
+		luaL_error(L, "protocol bitmap out of range");
+	return !WIRE_BIT(reader->ptr + mark, bit);
+}
+
+static int lread_int(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int value = 0;
+	if (!read_absent(L, reader, 2) && wire_read_int(reader, &value) < 0)
+		return truncated(L);
+	lua_pushinteger(L, value);
+	return 1;
+}
+
+static int lread_float(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	float value = 0;
+	if (!read_absent(L, reader, 2) && wire_read_float(reader, &value) < 0)
+		return truncated(L);
+	lua_pushnumber(L, value);
+	return 1;
+}
+
+static int lread_double(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	double value = 0;
+	if (!read_absent(L, reader, 2) && wire_read_double(reader, &value) < 0)
+		return truncated(L);
+	lua_pushnumber(L, value);
+	return 1;
+}
+
+static int lread_string(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	const char* str = "";
+	size_t len = 0;
+	if (!read_absent(L, reader, 2) && wire_read_string(reader, &str, &len) < 0)
+		return truncated(L);
+	lua_pushlstring(L, str, len);
+	return 1;
+}
+
+static int lread_count(lua_State* L)
+{
+	size_t count;
+	if (wire_read_count(check_reader(L), &count) < 0)
+		return truncated(L);
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+//数组读取时栈顶为字段原来的值：是table就在原table上覆盖并截断多余的元素，否则换成新table
+static void reuse_table(lua_State* L, int narr, int nrec)
+{
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, narr, nrec);
+	}
+}
+
+static void truncate_array(lua_State* L, size_t count)
+{
+	for (size_t i = lua_rawlen(L, -1); i > count; i--)
+	{
+		lua_pushnil(L);
+		lua_rawseti(L, -2, (int)i);
+	}
+}
+
+static void read_int_array(lua_State* L, struct read_buffer* reader)
+{
+	size_t count;
+	size_t bytes;
+	const char* data;
+	if (wire_read_array(reader, TYPE_INT_ARRAY, &count, &data, &bytes) < 0)
+		truncated(L);
+	const char* end = data + bytes;
+	reuse_table(L, (int)count, 0);
+	for (size_t i = 1; i <= count; i++)
+	{
+		int value;
+		if (wire_next_int(&data, end, &value) < 0)
+			truncated(L);
+		lua_pushinteger(L, value);
+		lua_rawseti(L, -2, i);
+	}
+	if (data != end)
+		truncated(L);
+	truncate_array(L, count);
+}
+
+static void read_float_array(lua_State* L, struct read_buffer* reader)
+{
+	size_t count;
+	size_t bytes;
+	const char* data;
+	if (wire_read_array(reader, TYPE_FLOAT_ARRAY, &count, &data, &bytes) < 0)
+		truncated(L);
+	reuse_table(L, (int)count, 0);
+	for (size_t i = 1; i <= count; i++)
+	{
+		float value;
+		wire_copy_float(&value, data + (i - 1) * sizeof(float), 1);
+		lua_pushnumber(L, value);
+		lua_rawseti(L, -2, i);
+	}
+	truncate_array(L, count);
+}
+
+static void read_double_array(lua_State* L, struct read_buffer* reader)
+{
+	size_t count;
+	size_t bytes;
+	const char* data;
+	if (wire_read_array(reader, TYPE_DOUBLE_ARRAY, &count, &data, &bytes) < 0)
+		truncated(L);
+	reuse_table(L, (int)count, 0);
+	for (size_t i = 1; i <= count; i++)
+	{
+		double value;
+		wire_copy_double(&value, data + (i - 1) * sizeof(double), 1);
+		lua_pushnumber(L, value);
+		lua_rawseti(L, -2, i);
+	}
+	truncate_array(L, count);
+}
+
+//type为数组类型，enums为枚举表的栈位置(只有枚举数组需要)
+static void read_integer_array(lua_State* L, struct read_buffer* reader, int type, int enums)
+{
+	size_t count;
+	size_t bytes;
+	const char* data;
+	if (wire_read_array(reader, type, &count, &data, &bytes) < 0)
+		truncated(L);
+	const char* end = data + bytes;
+	reuse_table(L, (int)count, 0);
+	for (size_t i = 1; i <= count; i++)
+	{
+		unsigned long long value;
+		if (wire_next_integer(&data, end, type - 1, &value) < 0)
+			truncated(L);
+		push_integer(L, type - 1, value, enums);
+		lua_rawseti(L, -2, i);
+	}
+	if (data != end)
+		truncated(L);
+	truncate_array(L, count);
+}
+
+static void read_bool_array(lua_State* L, struct read_buffer* reader)
+{
+	size_t count;
+	size_t bytes;
+	const char* data;
+	if (wire_read_array(reader, TYPE_BOOL_ARRAY, &count, &data, &bytes) < 0)
+		truncated(L);
+	reuse_table(L, (int)count, 0);
+	for (size_t i = 1; i <= count; i++)
+	{
+		lua_pushboolean(L, WIRE_BIT(data, i - 1));
+		lua_rawseti(L, -2, i);
+	}
+	truncate_array(L, count);
+}
+
+struct codec;
+struct codec_field;
+static void check_utf8(lua_State* L, struct codec* c, struct codec_field* f, const char* str, size_t len);
+
+//dict不为NULL时元素按字典格式读取，c不为NULL时按协议的设置校验UTF-8
+static void read_string_array(lua_State* L, struct read_buffer* reader, struct wire_dict* dict, struct codec* c, struct codec_field* f)
+{
+	size_t count;
+	if (wire_read_count(reader, &count) < 0)
+		truncated(L);
+	reuse_table(L, (int)count, 0);
+	for (size_t i = 1; i <= count; i++)
+	{
+		const char* str;
+		size_t len;
+		if ((dict ? dict_read_string(dict, reader, &str, &len) : wire_read_string(reader, &str, &len)) < 0)
+			truncated(L);
+		if (c)
+			check_utf8(L, c, f, str, len);
+		lua_pushlstring(L, str, len);
+		lua_rawseti(L, -2, i);
+	}
+	truncate_array(L, count);
+}
+
+//不存在的数组字段为空数组
+static void read_empty_array(lua_State* L)
+{
+	reuse_table(L, 0, 0);
+	truncate_array(L, 0);
+}
+
+static int lread_int_array(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int absent = read_absent(L, reader, 3);
+	lua_settop(L, 2);
+	if (absent)
+		read_empty_array(L);
+	else
+		read_int_array(L, reader);
+	return 1;
+}
+
+static int lread_float_array(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int absent = read_absent(L, reader, 3);
+	lua_settop(L, 2);
+	if (absent)
+		read_empty_array(L);
+	else
+		read_float_array(L, reader);
+	return 1;
+}
+
+static int lread_double_array(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int absent = read_absent(L, reader, 3);
+	lua_settop(L, 2);
+	if (absent)
+		read_empty_array(L);
+	else
+		read_double_array(L, reader);
+	return 1;
+}
+
+static int lread_string_array(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int absent = read_absent(L, reader, 3);
+	lua_settop(L, 2);
+	if (absent)
+		read_empty_array(L);
+	else
+		read_string_array(L, reader, NULL, NULL, NULL);
+	return 1;
+}
+
+static int lread_integer(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int type = upvalue_type(L);
+	unsigned long long value = 0;
+	if (!read_absent(L, reader, 2) && wire_read_integer(reader, type, &value) < 0)
+		return truncated(L);
+	push_integer(L, type, value, 0);
+	return 1;
+}
+
+//read_enum(r, e[, m, bit])
+static int lread_enum(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	unsigned long long value = 0;
+	if (!read_absent(L, reader, 3) && wire_read_integer(reader, TYPE_ENUM, &value) < 0)
+		return truncated(L);
+	push_integer(L, TYPE_ENUM, value, 2);
+	return 1;
+}
+
+//位置字段的bool就是位图中的位，可选字段才有值
+static int lread_bool(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	unsigned long long value = 0;
+	if (!lua_isnoneornil(L, 2))
+		value = !read_absent(L, reader, 2);
+	else if (wire_read_integer(reader, TYPE_BOOL, &value) < 0)
+		return truncated(L);
+	lua_pushboolean(L, value != 0);
+	return 1;
+}
+
+static int lread_integer_array(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int absent = read_absent(L, reader, 3);
+	lua_settop(L, 2);
+	if (absent)
+		read_empty_array(L);
+	else
+		read_integer_array(L, reader, upvalue_type(L) + 1, 0);
+	return 1;
+}
+
+//read_enum_array(r, t, e[, m, bit])
+static int lread_enum_array(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int absent = read_absent(L, reader, 4);
+	lua_settop(L, 3);
+	lua_pushvalue(L, 2);
+	if (absent)
+		read_empty_array(L);
+	else
+		read_integer_array(L, reader, TYPE_ENUM_ARRAY, 3);
+	return 1;
+}
+
+static int lread_bool_array(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int absent = read_absent(L, reader, 3);
+	lua_settop(L, 2);
+	if (absent)
+		read_empty_array(L);
+	else
+		read_bool_array(L, reader);
+	return 1;
+}
+
+//定长数组的个数必须与定义一致，只检查不读取
+static bool fixed_count(struct read_buffer* reader, int size)
+{
+	struct read_buffer peek = *reader;
+	size_t count;
+	return wire_read_count(&peek, &count) == 0 && count == (size_t)size;
+}
+
+//read_fixed(r, n, type, e[, m, bit])，e为枚举表，其他类型为nil。位置字段总是写入，位为0说明数据不合法
+static int lread_fixed(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int size = (int)luaL_checkinteger(L, 2);
+	int type = (int)luaL_checkinteger(L, 3);
+	if (read_absent(L, reader, 5))
+		return luaL_error(L, "protocol array missing");
+	lua_settop(L, 4);
+	if (!fixed_count(reader, size))
+		return luaL_error(L, "protocol array expect %d elements", size);
+	lua_pushnil(L);
+	switch (type)
+	{
+	case TYPE_INT_ARRAY:
+		read_int_array(L, reader);
+		break;
+	case TYPE_FLOAT_ARRAY:
+		read_float_array(L, reader);
+		break;
+	case TYPE_DOUBLE_ARRAY:
+		read_double_array(L, reader);
+		break;
+	case TYPE_STRING_ARRAY:
+		read_string_array(L, reader, NULL, NULL, NULL);
+		break;
+	case TYPE_BOOL_ARRAY:
+		read_bool_array(L, reader);
+		break;
+	default:
+		if (!type_integer(type) || (type & 1) == 0)
+			return luaL_argerror(L, 3, "invalid type");
+		if (type == TYPE_ENUM_ARRAY)
+			luaL_checktype(L, 4, LUA_TTABLE);
+		read_integer_array(L, reader, type, 4);
+		break;
+	}
+	return 1;
+}
+
+//begin_fixed(r, n[, m, bit])，协议的定长数组：检查并读出个数，返回预分配好数组部分的table，元素由生成代码逐个解码
+static int lbegin_fixed(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int size = (int)luaL_checkinteger(L, 2);
+	size_t count;
+	if (read_absent(L, reader, 3))
+		return luaL_error(L, "protocol array missing");
+	if (!fixed_count(reader, size))
+		return luaL_error(L, "protocol array expect %d elements", size);
+	wire_read_count(reader, &count);
+	lua_createtable(L, size, 0);
+	return 1;
+}
+
+static void read_scalar(lua_State* L, struct read_buffer* reader, int type, int enums)
+{
+	unsigned long long value;
+	switch (type)
+	{
+	case TYPE_INT:
+	{
+		int i;
+		if (wire_read_int(reader, &i) < 0)
+			truncated(L);
+		lua_pushinteger(L, i);
+		return;
+	}
+	case TYPE_FLOAT:
+	{
+		float f;
+		if (wire_read_float(reader, &f) < 0)
+			truncated(L);
+		lua_pushnumber(L, f);
+		return;
+	}
+	case TYPE_DOUBLE:
+	{
+		double d;
+		if (wire_read_double(reader, &d) < 0)
+			truncated(L);
+		lua_pushnumber(L, d);
+		return;
+	}
+	case TYPE_STRING:
+	{
+		const char* str;
+		size_t len;
+		if (wire_read_string(reader, &str, &len) < 0)
+			truncated(L);
+		lua_pushlstring(L, str, len);
+		return;
+	}
+	}
+	if (!type_integer(type) && type != TYPE_BOOL)
+		luaL_error(L, "protocol map invalid type %d", type);
+	if (wire_read_integer(reader, type, &value) < 0)
+		truncated(L);
+	if (type == TYPE_BOOL)
+		lua_pushboolean(L, value != 0);
+	else
+		push_integer(L, type, value, enums);
+}
+
+//read_map(r, ktype, vtype, x[, m, bit])，x为值的枚举表或协议的decode函数。
+//总是返回新table，hash部分按项数一次分配
+static int lread_map(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	int ktype = (int)luaL_checkinteger(L, 2);
+	int vtype = (int)luaL_checkinteger(L, 3);
+	if (vtype == TYPE_ENUM || vtype == TYPE_PROTOCOL)
+		luaL_checktype(L, 4, vtype == TYPE_ENUM ? LUA_TTABLE : LUA_TFUNCTION);
+	size_t count = 0;
+	if (!read_absent(L, reader, 5) && wire_read_count(reader, &count) < 0)
+		return truncated(L);
+	lua_settop(L, 4);
+	lua_createtable(L, 0, (int)count);
+	for (size_t i = 0; i < count; i++)
+	{
+		read_scalar(L, reader, ktype, 0);
+		if (vtype == TYPE_PROTOCOL)
+		{
+			lua_pushvalue(L, 4);
+			lua_pushvalue(L, 1);
+			lua_call(L, 1, 1);
+		}
+		else
+		{
+			read_scalar(L, reader, vtype, 4);
+		}
+		lua_rawset(L, 5);
+	}
+	return 1;
+}
+
+static int lremain(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	lua_pushinteger(L, reader->size - reader->offset);
+	return 1;
+}
+
+//存在位图：begin_bitmap/read_bitmap返回位图位置，交给各个位置字段的读写函数
+static int lbegin_bitmap(lua_State* L)
+{
+	lua_pushinteger(L, wire_begin_bitmap(check_writer(L), (size_t)luaL_checkinteger(L, 2)));
+	return 1;
+}
+
+static int lset_bit(lua_State* L)
+{
+	write_present(L, check_writer(L), 2, 1);
+	return 0;
+}
+
+static int lread_bitmap(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	size_t mark = reader->offset;
+	const char* bitmap;
+	if (wire_read_bitmap(reader, (size_t)luaL_checkinteger(L, 2), &bitmap) < 0)
+		return truncated(L);
+	lua_pushinteger(L, mark);
+	return 1;
+}
+
+static int lhas_bit(lua_State* L)
+{
+	lua_pushboolean(L, !read_absent(L, check_reader(L), 2));
+	return 1;
+}
+
+static int lwrite_key(lua_State* L)
+{
+	struct write_buffer* buffer = check_writer(L);
+	wire_write_uvarint(buffer, (unsigned int)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+static int lbegin_block(lua_State* L)
+{
+	lua_pushinteger(L, wire_begin_block(check_writer(L)));
+	return 1;
+}
+
+static int lend_block(lua_State* L)
+{
+	wire_end_block(check_writer(L), (size_t)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+static int lread_key(lua_State* L)
+{
+	unsigned int key;
+	if (wire_read_key(check_reader(L), &key) < 0)
+		return truncated(L);
+	lua_pushinteger(L, key);
+	return 1;
+}
+
+static int lskip_value(lua_State* L)
+{
+	if (wire_skip_value(check_reader(L), (unsigned int)luaL_checkinteger(L, 2)) < 0)
+		return truncated(L);
+	return 0;
+}
+
+static int lskip_tagged(lua_State* L)
+{
+	if (wire_skip_tagged(check_reader(L)) < 0)
+		return truncated(L);
+	return 0;
+}
+
+//读取可选字段外层的长度，返回值读完后应剩余的字节数，交给close_block校验
+static int lread_block(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	size_t n;
+	if (wire_read_count(reader, &n) < 0)
+		return truncated(L);
+	lua_pushinteger(L, reader->size - reader->offset - n);
+	return 1;
+}
+
+static int lclose_block(lua_State* L)
+{
+	struct read_buffer* reader = check_reader(L);
+	if (reader->size - reader->offset != (size_t)luaL_checkinteger(L, 2))
+		return luaL_error(L, "protocol tagged field length mismatch");
+	return 0;
+}
+
+//供gen_lua生成的代码使用的读写原语
+extern "C" int luaopen_protocol_wire(lua_State* L)
+{
+	luaL_newmetatable(L, WRITER_META);
+	lua_pushcfunction(L, lwriter_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, READER_META);
+	lua_pop(L, 1);
+
+	luaL_Reg l[] = {
+		{ "writer", lwriter },
+		{ "reset", lreset },
+		{ "finish", lfinish },
+		{ "write_int", lwrite_int },
+		{ "write_float", lwrite_float },
+		{ "write_double", lwrite_double },
+		{ "write_string", lwrite_string },
+		{ "write_count", lwrite_count },
+		{ "write_int_array", lwrite_int_array },
+		{ "write_float_array", lwrite_float_array },
+		{ "write_double_array", lwrite_double_array },
+		{ "write_string_array", lwrite_string_array },
+		{ "reader", lreader },
+		{ "read_int", lread_int },
+		{ "read_float", lread_float },
+		{ "read_double", lread_double },
+		{ "read_string", lread_string },
+		{ "read_count", lread_count },
+		{ "read_int_array", lread_int_array },
+		{ "read_float_array", lread_float_array },
+		{ "read_double_array", lread_double_array },
+		{ "read_string_array", lread_string_array },
+		{ "remain", lremain },
+		{ "begin_bitmap", lbegin_bitmap },
+		{ "set_bit", lset_bit },
+		{ "read_bitmap", lread_bitmap },
+		{ "has_bit", lhas_bit },
+		{ "write_key", lwrite_key },
+		{ "begin_block", lbegin_block },
+		{ "end_block", lend_block },
+		{ "read_key", lread_key },
+		{ "skip_value", lskip_value },
+		{ "skip_tagged", lskip_tagged },
+		{ "read_block", lread_block },
+		{ "close_block", lclose_block },
+		{ "write_bool", lwrite_bool },
+		{ "write_bool_array", lwrite_bool_array },
+		{ "write_enum", lwrite_enum },
+		{ "write_enum_array", lwrite_enum_array },
+		{ "read_bool", lread_bool },
+		{ "read_bool_array", lread_bool_array },
+		{ "read_enum", lread_enum },
+		{ "read_enum_array", lread_enum_array },
+		{ "write_fixed", lwrite_fixed },
+		{ "read_fixed", lread_fixed },
+		{ "begin_fixed", lbegin_fixed },
+		{ "write_map", lwrite_map },
+		{ "read_map", lread_map },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+
+	//write_int8、read_uint64_array等
+	static const struct { const char* name; int type; } integer[] = {
+		{ "int8", TYPE_INT8 }, { "int16", TYPE_INT16 }, { "int64", TYPE_INT64 },
+		{ "uint8", TYPE_UINT8 }, { "uint16", TYPE_UINT16 }, { "uint32", TYPE_UINT32 }, { "uint64", TYPE_UINT64 },
+	};
+	static const struct { const char* format; lua_CFunction func; } access[] = {
+		{ "write_%s", lwrite_integer }, { "write_%s_array", lwrite_integer_array },
+		{ "read_%s", lread_integer }, { "read_%s_array", lread_integer_array },
+	};
+	char name[32];
+	for (int i = 0; i < (int)(sizeof(integer) / sizeof(integer[0])); i++)
+	{
+		for (int j = 0; j < (int)(sizeof(access) / sizeof(access[0])); j++)
+		{
+			sprintf(name, access[j].format, integer[i].name);
+			lua_pushinteger(L, integer[i].type);
+			lua_pushcclosure(L, access[j].func, 1);
+			lua_setfield(L, -2, name);
+		}
+	}
+	return 1;
+}
+
+//运行时编解码：protocol.load解析协议文件后，把每个协议编译成字段数组，
+//字段名预先作为lua字符串放入registry，编码时lua_rawgeti取出key再lua_rawget，
+//不需要每个字段每条消息都lua_pushstring/lua_getfield重新hash字段名
+
+struct codec;
+
+struct codec_field {
+	const char* name;
+	int type;
+	int isarray;
+	int key;
+	//可选字段的wire key，位置字段为0
+	unsigned int tag;
+	struct codec* codec;
+	//枚举字段的枚举表(名字到值、值到名字)在registry中的引用，其他字段为LUA_NOREF
+	int enums;
+	//定长数组的长度，其他字段为0
+	int size;
+	//map的键和值，编解码时当作两个字段处理；其他字段为NULL
+	struct codec_field* entry;
+};
+
+struct codec {
+	const char* name;
+	struct protocol* protocol;
+	struct codec_field* field;
+	int size;
+	//编码长度上限中与table内容无关的部分，variable为0时就是整个上限
+	size_t fixed;
+	int variable;
+	//存在位图的字节数
+	int bitmap;
+	//回收的空闲table，LUA_NOREF表示还没有
+	int pool;
+	//解码时校验string字段是否为合法的UTF-8
+	int utf8;
+	//字段名到下标+1的table，延迟解码时按名字定位字段
+	int names;
+};
+
+//load返回的schema持有整个协议树，codec也分配在协议树的arena中
+struct schema {
+	struct protocol* root;
+	struct protocol_dispatch* dispatch;
+	struct codec** codec;
+	int size;
+};
+
+#define codec_of(s, ptl) ((struct codec*)dispatch_find((s)->dispatch, (ptl)->id)->ud)
+
+static void collect_codec(struct schema* s, struct protocol* ptl)
+{
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* child = table->slots[i]; child; child = child->next)
+		{
+			if (child->isenum)
+				continue;
+			struct codec* c = (struct codec*)arena_alloc(s->root->arena, sizeof(*c));
+			char name[256];
+			protocol_fullname(child, name, sizeof(name));
+			c->name = arena_strdup(s->root->arena, name);
+			c->protocol = child;
+			c->size = child->size;
+			c->pool = LUA_NOREF;
+			c->utf8 = 0;
+			c->names = LUA_NOREF;
+			c->field = (struct codec_field*)arena_alloc(s->root->arena, sizeof(*c->field) * (child->size > 0 ? child->size : 1));
+			dispatch_find(s->dispatch, child->id)->ud = c;
+			s->codec[s->size++] = c;
+			collect_codec(s, child);
+		}
+	}
+}
+
+static int count_protocol(struct protocol* ptl)
+{
+	int count = 0;
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* child = table->slots[i]; child; child = child->next)
+			count += child->isenum ? 0 : 1 + count_protocol(child);
+	}
+	return count;
+}
+
+//字段本身的长度上限：标量为值的上限，字符串和数组为个数或长度前缀，嵌套协议在编码时单独计算
+static size_t codec_field_fixed(struct codec_field* f)
+{
+	switch (f->type)
+	{
+	case TYPE_INT:
+	case TYPE_STRING:
+	case TYPE_FLOAT_ARRAY:
+	case TYPE_DOUBLE_ARRAY:
+	case TYPE_STRING_ARRAY:
+		return WIRE_MAX_INT;
+	case TYPE_INT_ARRAY:
+		return WIRE_MAX_INT * 2;
+	case TYPE_FLOAT:
+		return sizeof(float);
+	case TYPE_DOUBLE:
+		return sizeof(double);
+	case TYPE_BOOL:
+		return 1;
+	case TYPE_BOOL_ARRAY:
+	case TYPE_MAP:
+		return WIRE_MAX_INT;
+	}
+	if (type_integer(f->type))
+		return (f->type & 1) ? WIRE_MAX_INT * 2 : WIRE_MAX_VARINT;
+	return f->isarray ? WIRE_MAX_INT : 0;
+}
+
+//长度与值的内容有关的字段
+static bool codec_variable(struct codec_field* f)
+{
+	return f->type == TYPE_STRING || f->type == TYPE_PROTOCOL || f->type == TYPE_MAP || (f->type & 1);
+}
+
+static void compile_size(struct codec* c)
+{
+	//存在位图和结尾的key 0
+	int positional = 0;
+	c->fixed = 1;
+	c->variable = 0;
+	for (int i = 0; i < c->size; i++)
+	{
+		struct codec_field* f = &c->field[i];
+		if (f->tag == 0)
+		{
+			c->fixed += codec_field_fixed(f);
+			positional++;
+		}
+		if (f->tag || codec_variable(f))
+			c->variable = 1;
+	}
+	c->bitmap = WIRE_BITMAP_SIZE(positional);
+	c->fixed += c->bitmap;
+}
+
+//同一个枚举的字段共用一个枚举表，cache为以枚举定义为key的临时table
+static int compile_enum(lua_State* L, struct protocol* e, int cache)
+{
+	lua_pushlightuserdata(L, e);
+	lua_rawget(L, cache);
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, e->size, e->size);
+		for (int i = 0; i < e->size; i++)
+		{
+			lua_pushstring(L, e->field[i]->name);
+			lua_pushinteger(L, e->field[i]->tag);
+			lua_rawset(L, -3);
+			lua_pushstring(L, e->field[i]->name);
+			lua_rawseti(L, -2, e->field[i]->tag);
+		}
+		lua_pushlightuserdata(L, e);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, cache);
+	}
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static struct codec_field* compile_entry(lua_State* L, struct schema* s, struct field* f, int cache)
+{
+	struct field entry[2];
+	map_entry(f, &entry[0], &entry[1]);
+	struct codec_field* cf = (struct codec_field*)arena_alloc(s->root->arena, sizeof(*cf) * 2);
+	memset(cf, 0, sizeof(*cf) * 2);
+	for (int i = 0; i < 2; i++)
+	{
+		cf[i].name = f->name;
+		cf[i].type = entry[i].field_type.type;
+		cf[i].key = LUA_NOREF;
+		cf[i].codec = cf[i].type == TYPE_PROTOCOL ? codec_of(s, entry[i].field_type.protocol) : NULL;
+		cf[i].enums = cf[i].type == TYPE_ENUM ? compile_enum(L, entry[i].field_type.protocol, cache) : LUA_NOREF;
+	}
+	return cf;
+}
+
+static void compile_schema(lua_State* L, struct schema* s)
+{
+	s->dispatch = create_dispatch(s->root);
+	s->codec = (struct codec**)arena_alloc(s->root->arena, sizeof(struct codec*) * (count_protocol(s->root) + 1));
+	s->size = 0;
+	collect_codec(s, s->root);
+
+	lua_newtable(L);
+	int cache = lua_gettop(L);
+	for (int i = 0; i < s->size; i++)
+	{
+		struct codec* c = s->codec[i];
+		lua_createtable(L, 0, c->size);
+		for (int j = 0; j < c->size; j++)
+		{
+			struct field* f = c->protocol->field[j];
+			struct codec_field* cf = &c->field[j];
+			cf->name = f->name;
+			cf->type = f->field_type.type;
+			cf->isarray = f->field_type.isarray;
+			cf->tag = f->tag ? WIRE_KEY(f->tag, wire_tag_type(f->field_type.type)) : 0;
+			cf->codec = f->field_type.type == TYPE_PROTOCOL ? codec_of(s, f->field_type.protocol) : NULL;
+			cf->enums = (cf->type & ~1) == TYPE_ENUM ? compile_enum(L, f->field_type.protocol, cache) : LUA_NOREF;
+			cf->size = f->field_type.size;
+			cf->entry = cf->type == TYPE_MAP ? compile_entry(L, s, f, cache) : NULL;
+			lua_pushstring(L, f->name);
+			lua_pushinteger(L, j + 1);
+			lua_rawset(L, -3);
+			lua_pushstring(L, f->name);
+			cf->key = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+		c->names = luaL_ref(L, LUA_REGISTRYINDEX);
+		compile_size(c);
+	}
+	lua_pop(L, 1);
+}
+
+static int lschema_gc(lua_State* L)
+{
+	struct schema* s = (struct schema*)luaL_checkudata(L, 1, SCHEMA_META);
+	if (s->root == NULL)
+		return 0;
+	for (int i = 0; i < s->size; i++)
+	{
+		for (int j = 0; j < s->codec[i]->size; j++)
+		{
+			luaL_unref(L, LUA_REGISTRYINDEX, s->codec[i]->field[j].key);
+			luaL_unref(L, LUA_REGISTRYINDEX, s->codec[i]->field[j].enums);
+			if (s->codec[i]->field[j].entry)
+				luaL_unref(L, LUA_REGISTRYINDEX, s->codec[i]->field[j].entry[1].enums);
+		}
+		luaL_unref(L, LUA_REGISTRYINDEX, s->codec[i]->pool);
+		luaL_unref(L, LUA_REGISTRYINDEX, s->codec[i]->names);
+	}
+	release_dispatch(s->dispatch);
+	release_protocol(s->root);
+	s->root = NULL;
+	return 0;
+}
+
+static int field_error(lua_State* L, struct codec* c, struct codec_field* f, const char* expect)
+{
+	return luaL_error(L, "protocol %s field %s expect %s, got %s", c->name, f->name, expect, luaL_typename(L, -1));
+}
+
+//编码分两遍：先算出长度上限一次预留，再不检查容量直接写入。
+//标量、个数和长度前缀的上限编译时算好(codec.fixed)，第一遍只需要遍历字符串、数组、嵌套协议和可选字段
+
+//数字转为字符串的最大长度
+#define NUMBER_STRING_MAX LUAI_MAXNUMBER2STR
+
+static size_t measure_protocol(lua_State* L, struct codec* c, int index, int depth);
+//嵌套协议的值可以是decode_lazy返回的代理，编码前在栈上换成字段的table
+static void lazy_table(lua_State* L, int index);
+
+static size_t measure_string(lua_State* L, int index)
+{
+	int type = lua_type(L, index);
+	if (type == LUA_TSTRING)
+		return lua_rawlen(L, index);
+	return type == LUA_TNUMBER ? NUMBER_STRING_MAX : 0;
+}
+
+static size_t measure_field(lua_State* L, struct codec_field* f, int depth);
+
+//每一项为键和值的上限之和
+static size_t measure_map(lua_State* L, struct codec_field* f, int index, int depth)
+{
+	struct codec_field* key = &f->entry[0];
+	struct codec_field* value = &f->entry[1];
+	size_t size = 0;
+	luaL_checkstack(L, 4, NULL);
+	lua_pushnil(L);
+	while (lua_next(L, index))
+	{
+		size += codec_field_fixed(key) + codec_field_fixed(value) + measure_field(L, value, depth);
+		if (key->type == TYPE_STRING)
+			size += measure_string(L, -2);
+		lua_pop(L, 1);
+	}
+	return size;
+}
+
+//定长数组为nil时换成空table，之后与不足N个元素的数组一样按默认值补齐
+static void fixed_table(lua_State* L, int index)
+{
+	if (lua_isnil(L, index))
+	{
+		lua_newtable(L);
+		lua_replace(L, index);
+	}
+}
+
+//栈顶为字段值，返回不计入codec.fixed的部分
+static size_t measure_field(lua_State* L, struct codec_field* f, int depth)
+{
+	int top = lua_gettop(L);
+	if (f->type == TYPE_PROTOCOL && !f->isarray)
+	{
+		lazy_table(L, top);
+		return measure_protocol(L, f->codec, lua_istable(L, top) ? top : 0, depth + 1);
+	}
+	if (f->type == TYPE_STRING)
+		return measure_string(L, top);
+	if (f->size)
+		fixed_table(L, top);
+	if (!lua_istable(L, top))
+		return 0;
+	if (f->type == TYPE_MAP)
+		return measure_map(L, f, top, depth);
+
+	size_t size = 0;
+	int count = (int)lua_rawlen(L, top);
+	if (count < f->size)
+		count = f->size;
+	switch (f->type)
+	{
+	case TYPE_INT_ARRAY:
+		return (size_t)count * WIRE_MAX_INT;
+	case TYPE_FLOAT_ARRAY:
+		return (size_t)count * sizeof(float);
+	case TYPE_DOUBLE_ARRAY:
+		return (size_t)count * sizeof(double);
+	case TYPE_BOOL_ARRAY:
+		return WIRE_BITMAP_SIZE((size_t)count);
+	case TYPE_STRING_ARRAY:
+		for (int i = 1; i <= count; i++)
+		{
+			lua_rawgeti(L, top, i);
+			size += WIRE_MAX_INT + measure_string(L, -1);
+			lua_pop(L, 1);
+		}
+		return size;
+	}
+	if (type_integer(f->type))
+		return (size_t)count * WIRE_MAX_VARINT;
+	//标量字段给了table，由写入时报告类型错误
+	if (f->type != TYPE_PROTOCOL)
+		return 0;
+
+	for (int i = 1; i <= count; i++)
+	{
+		lua_rawgeti(L, top, i);
+		lazy_table(L, top + 1);
+		size += measure_protocol(L, f->codec, lua_istable(L, -1) ? top + 1 : 0, depth + 1);
+		lua_pop(L, 1);
+	}
+	return size;
+}
+
+static size_t measure_protocol(lua_State* L, struct codec* c, int index, int depth)
+{
+	if (depth > CODEC_MAX_DEPTH)
+		luaL_error(L, "protocol %s nested too deep", c->name);
+	luaL_checkstack(L, 4, NULL);
+	size_t size = c->fixed;
+	for (int i = 0; c->variable && i < c->size; i++)
+	{
+		struct codec_field* f = &c->field[i];
+		if (f->tag == 0 && !codec_variable(f))
+			continue;
+		if (index)
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, f->key);
+			lua_rawget(L, index);
+		}
+		else if (f->tag)
+		{
+			continue;
+		}
+		else
+		{
+			lua_pushnil(L);
+		}
+		//可选字段为nil时不写入，否则需要key和外层长度
+		if (f->tag && !lua_isnil(L, -1))
+			size += WIRE_MAX_INT * 2 + codec_field_fixed(f) + measure_field(L, f, depth);
+		else if (f->tag == 0)
+			size += measure_field(L, f, depth);
+		lua_pop(L, 1);
+	}
+	return size;
+}
+
+static void put_protocol(lua_State* L, struct codec* c, int index, struct write_buffer* buffer, int depth, struct wire_dict* dict);
+
+static int field_error(lua_State* L, struct codec* c, struct codec_field* f, const char* expect);
+
+//值在index，enums为枚举表的栈位置
+static unsigned long long check_integer(lua_State* L, struct codec* c, struct codec_field* f, int index, int type, int enums)
+{
+	unsigned long long value;
+	if (!((type & ~1) == TYPE_ENUM ? to_enum(L, index, enums, &value) : to_integer(L, index, type, &value)))
+		luaL_error(L, "protocol %s field %s invalid value %s", c->name, f->name, lua_tostring(L, index));
+	return value;
+}
+
+//定长数组补齐的元素为nil，按默认值写入
+static bool fixed_hole(lua_State* L, struct codec_field* f)
+{
+	return f->size && lua_isnil(L, -1);
+}
+
+//要写入的元素个数：定长数组为N，超过N个时报错；nil已经换成空table
+static int array_count(lua_State* L, struct codec* c, struct codec_field* f, int index)
+{
+	int size = lua_istable(L, index) ? (int)lua_rawlen(L, index) : 0;
+	if (f->size == 0)
+		return size;
+	if (size > f->size)
+		luaL_error(L, "protocol %s field %s expect at most %d elements", c->name, f->name, f->size);
+	return f->size;
+}
+
+//整数数组的元素逐个检查范围，bool[]按位打包
+static void put_integer_array(lua_State* L, struct codec* c, struct codec_field* f, struct write_buffer* buffer, int index, int size)
+{
+	if (f->type == TYPE_BOOL_ARRAY)
+	{
+		size_t mark = wire_put_bitmap(buffer, WIRE_BITMAP_SIZE(size));
+		for (int i = 1; i <= size; i++)
+		{
+			lua_rawgeti(L, index, i);
+			if (lua_toboolean(L, -1))
+				wire_set_bit(buffer, mark, i - 1);
+			lua_pop(L, 1);
+		}
+		return;
+	}
+
+	int enums = 0;
+	if (f->type == TYPE_ENUM_ARRAY)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, f->enums);
+		enums = lua_gettop(L);
+	}
+	size_t mark = wire_put_block(buffer);
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		if (!fixed_hole(L, f) && lua_type(L, -1) != LUA_TNUMBER && lua_type(L, -1) != LUA_TSTRING)
+			field_error(L, c, f, "number");
+		wire_put_integer(buffer, f->type - 1, check_integer(L, c, f, lua_gettop(L), f->type - 1, enums));
+		lua_pop(L, 1);
+	}
+	wire_end_block(buffer, mark);
+	if (enums)
+		lua_pop(L, 1);
+}
+
+//数组元素逐个写入，空间已经按上限预留
+static void put_array(lua_State* L, struct codec* c, struct codec_field* f, struct write_buffer* buffer, int index, struct wire_dict* dict)
+{
+	int type = f->type;
+	int size = array_count(L, c, f, index);
+	wire_put_uvarint(buffer, size);
+	if (type_integer(type) || type == TYPE_BOOL_ARRAY)
+	{
+		if (size > 0)
+			put_integer_array(L, c, f, buffer, index, size);
+		return;
+	}
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		switch (type)
+		{
+		case TYPE_FLOAT_ARRAY:
+			wire_put_float(buffer, (float)lua_tonumber(L, -1));
+			break;
+		case TYPE_DOUBLE_ARRAY:
+			wire_put_double(buffer, (double)lua_tonumber(L, -1));
+			break;
+		case TYPE_STRING_ARRAY:
+		{
+			size_t len = 0;
+			const char* str = lua_tolstring(L, -1, &len);
+			if (dict)
+				dict_put_string(dict, buffer, str ? str : "", len);
+			else
+				wire_put_string(buffer, str ? str : "", len);
+			break;
+		}
+		}
+		lua_pop(L, 1);
+	}
+}
+
+//栈顶为字段值，数组和嵌套协议只接受table或nil，string接受字符串或数字，bool只接受boolean或nil
+static void check_field(lua_State* L, struct codec* c, struct codec_field* f, int type)
+{
+	if (f->type == TYPE_PROTOCOL || f->type == TYPE_MAP || (f->type & 1))
+	{
+		if (type != LUA_TNIL && type != LUA_TTABLE)
+			field_error(L, c, f, "table");
+	}
+	else if (f->type == TYPE_BOOL)
+	{
+		if (type != LUA_TNIL && type != LUA_TBOOLEAN)
+			field_error(L, c, f, "boolean");
+	}
+	else if (type != LUA_TNIL && type != LUA_TNUMBER && (type != LUA_TSTRING || !accept_string(f->type)))
+	{
+		field_error(L, c, f, f->type == TYPE_STRING ? "string" : "number");
+	}
+}
+
+static void put_field(lua_State* L, struct codec* c, struct codec_field* f, struct write_buffer* buffer, int depth, struct wire_dict* dict);
+
+//键复制一份再写入，string的lua_tolstring不能改变遍历中的键。
+//键和值的字符串与其他位置字段一样经过字典，两端按线上的顺序处理，与遍历顺序无关
+static void put_map(lua_State* L, struct codec* c, struct codec_field* f, struct write_buffer* buffer, int index, int depth, struct wire_dict* dict)
+{
+	int count = 0;
+	luaL_checkstack(L, 4, NULL);
+	if (!lua_istable(L, index))
+	{
+		wire_put_uvarint(buffer, 0);
+		return;
+	}
+	lua_pushnil(L);
+	while (lua_next(L, index))
+	{
+		count++;
+		lua_pop(L, 1);
+	}
+	wire_put_uvarint(buffer, count);
+	lua_pushnil(L);
+	while (lua_next(L, index))
+	{
+		lua_pushvalue(L, -2);
+		put_field(L, c, &f->entry[0], buffer, depth, dict);
+		lua_pop(L, 1);
+		put_field(L, c, &f->entry[1], buffer, depth, dict);
+		lua_pop(L, 1);
+	}
+}
+
+static void put_field(lua_State* L, struct codec* c, struct codec_field* f, struct write_buffer* buffer, int depth, struct wire_dict* dict)
+{
+	int top = lua_gettop(L);
+	if (f->type == TYPE_PROTOCOL && !f->isarray)
+		lazy_table(L, top);
+	int type = lua_type(L, top);
+	check_field(L, c, f, type);
+	if (f->size)
+		fixed_table(L, top);
+	if (f->type == TYPE_PROTOCOL)
+	{
+		if (!f->isarray)
+		{
+			put_protocol(L, f->codec, type == LUA_TNIL ? 0 : top, buffer, depth + 1, dict);
+			return;
+		}
+		int size = array_count(L, c, f, top);
+		wire_put_uvarint(buffer, size);
+		for (int i = 1; i <= size; i++)
+		{
+			lua_rawgeti(L, top, i);
+			lazy_table(L, top + 1);
+			if (!lua_istable(L, -1) && !fixed_hole(L, f))
+				field_error(L, c, f, "table");
+			put_protocol(L, f->codec, lua_istable(L, -1) ? top + 1 : 0, buffer, depth + 1, dict);
+			lua_pop(L, 1);
+		}
+		return;
+	}
+
+	switch (f->type)
+	{
+	case TYPE_INT:
+		wire_put_int(buffer, (int)check_integer(L, c, f, top, TYPE_INT, 0));
+		break;
+	case TYPE_FLOAT:
+		wire_put_float(buffer, (float)lua_tonumber(L, top));
+		break;
+	case TYPE_DOUBLE:
+		wire_put_double(buffer, (double)lua_tonumber(L, top));
+		break;
+	case TYPE_STRING:
+	{
+		size_t len = 0;
+		const char* str = type == LUA_TNIL ? "" : lua_tolstring(L, top, &len);
+		if (dict)
+			dict_put_string(dict, buffer, str, len);
+		else
+			wire_put_string(buffer, str, len);
+		break;
+	}
+	case TYPE_BOOL:
+		wire_put_uvarint(buffer, lua_toboolean(L, top));
+		break;
+	case TYPE_ENUM:
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, f->enums);
+		wire_put_integer(buffer, f->type, check_integer(L, c, f, top, f->type, top + 1));
+		lua_pop(L, 1);
+		break;
+	}
+	case TYPE_MAP:
+		put_map(L, c, f, buffer, top, depth, dict);
+		break;
+	default:
+		if (f->type & 1)
+			put_array(L, c, f, buffer, top, dict);
+		else
+			wire_put_integer(buffer, f->type, check_integer(L, c, f, top, f->type, 0));
+		break;
+	}
+}
+
+//扩展整数按转换后的值判断，枚举项的名字先换成值；转换失败当作存在，交给put_field报错
+static int integer_present(lua_State* L, struct codec_field* f, int index, int type)
+{
+	unsigned long long value;
+	if (type != LUA_TNUMBER && type != LUA_TSTRING)
+		return 1;
+	if (f->type != TYPE_ENUM || type != LUA_TSTRING)
+		return !to_integer(L, index, f->type, &value) || value != 0;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, f->enums);
+	lua_pushvalue(L, index);
+	lua_rawget(L, -2);
+	int present = lua_type(L, -1) != LUA_TNUMBER || lua_tonumber(L, -1) != 0;
+	lua_pop(L, 2);
+	return present;
+}
+
+//位置字段取默认值(数值0、空字符串、空数组、空map)时只在位图中留0，不写入值。
+//嵌套协议和定长数组总是写入；类型不对的值当作存在，交给put_field报错
+static int field_present(lua_State* L, struct codec_field* f, int index)
+{
+	int type = lua_type(L, index);
+	if ((f->type == TYPE_PROTOCOL && !f->isarray) || f->size)
+		return 1;
+	if (type == LUA_TNIL)
+		return 0;
+	switch (f->type)
+	{
+	case TYPE_INT:
+		return type != LUA_TNUMBER || integer_present(L, f, index, type);
+	case TYPE_FLOAT:
+	case TYPE_DOUBLE:
+		return type != LUA_TNUMBER || !wire_is_zero(lua_tonumber(L, index));
+	case TYPE_STRING:
+		return type != LUA_TSTRING || lua_rawlen(L, index) > 0;
+	case TYPE_BOOL:
+		return type != LUA_TBOOLEAN || lua_toboolean(L, index);
+	case TYPE_MAP:
+	{
+		if (type != LUA_TTABLE)
+			return 1;
+		lua_pushnil(L);
+		int present = lua_next(L, index);
+		lua_pop(L, present ? 2 : 0);
+		return present;
+	}
+	}
+	if ((f->type & 1) == 0 && f->type != TYPE_PROTOCOL)
+		return integer_present(L, f, index, type);
+	return type != LUA_TTABLE || lua_rawlen(L, index) > 0;
+}
+
+//index为table在栈上的绝对位置，0表示nil，所有字段按默认值编码。
+//可选字段可能被接收端跳过，其中的字符串不经过字典
+static void put_protocol(lua_State* L, struct codec* c, int index, struct write_buffer* buffer, int depth, struct wire_dict* dict)
+{
+	luaL_checkstack(L, 4, NULL);
+	size_t bitmap = wire_put_bitmap(buffer, c->bitmap);
+	int bit = 0;
+	for (int i = 0; i < c->size; i++)
+	{
+		struct codec_field* f = &c->field[i];
+		if (f->tag)
+			continue;
+		if (index)
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, f->key);
+			lua_rawget(L, index);
+		}
+		else
+		{
+			lua_pushnil(L);
+		}
+		if (field_present(L, f, lua_gettop(L)))
+		{
+			wire_set_bit(buffer, bitmap, bit);
+			//bool的值就是这一位
+			if (f->type == TYPE_BOOL)
+				check_field(L, c, f, lua_type(L, -1));
+			else
+				put_field(L, c, f, buffer, depth, dict);
+		}
+		lua_pop(L, 1);
+		bit++;
+	}
+
+	//可选字段只写入非nil的值，最后以key 0结束
+	for (int i = 0; index && i < c->size; i++)
+	{
+		struct codec_field* f = &c->field[i];
+		if (f->tag == 0)
+			continue;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, f->key);
+		lua_rawget(L, index);
+		if (!lua_isnil(L, -1))
+		{
+			wire_put_uvarint(buffer, f->tag);
+			if (f->type == TYPE_STRING || WIRE_KEY_TYPE(f->tag) != WIRE_BYTES)
+			{
+				put_field(L, c, f, buffer, depth, NULL);
+			}
+			else
+			{
+				size_t mark = wire_put_block(buffer);
+				put_field(L, c, f, buffer, depth, NULL);
+				wire_end_block(buffer, mark);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	wire_put_uvarint(buffer, 0);
+}
+
+//偏移表格式(offset.h)：长度与字段值的类型无关，不预先计算上限，写入时逐项检查容量
+static void put_offset_protocol(lua_State* L, struct codec* c, int index, struct write_buffer* buffer, int depth);
+
+static void put_offset(lua_State* L, struct codec* c, struct write_buffer* buffer, size_t table, size_t i)
+{
+	if (offset_set(buffer, table, i) < 0)
+		luaL_error(L, "protocol %s too large", c->name);
+}
+
+static void put_offset_string(lua_State* L, struct write_buffer* buffer, int index)
+{
+	size_t len = 0;
+	const char* str = lua_isnil(L, index) ? "" : lua_tolstring(L, index, &len);
+	offset_write_uint32(buffer, (unsigned int)len);
+	buffer_addlstring(buffer, str ? str : "", len);
+}
+
+//扩展整数和bool的数组，元素为offset_width字节
+static void put_offset_integer_array(lua_State* L, struct codec* c, struct codec_field* f, struct write_buffer* buffer, int index, int size)
+{
+	int enums = 0;
+	if (f->type == TYPE_ENUM_ARRAY)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, f->enums);
+		enums = lua_gettop(L);
+	}
+	buffer_reserve(buffer, (size_t)size * offset_width(f->type));
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		if (f->type == TYPE_BOOL_ARRAY)
+		{
+			offset_write_integer(buffer, TYPE_BOOL, lua_toboolean(L, -1));
+		}
+		else
+		{
+			if (!fixed_hole(L, f) && lua_type(L, -1) != LUA_TNUMBER && lua_type(L, -1) != LUA_TSTRING)
+				field_error(L, c, f, "number");
+			offset_write_integer(buffer, f->type, check_integer(L, c, f, lua_gettop(L), f->type - 1, enums));
+		}
+		lua_pop(L, 1);
+	}
+	if (enums)
+		lua_pop(L, 1);
+}
+
+//定长元素的数组：个数之后直接是元素
+static void put_offset_array(lua_State* L, struct codec* c, struct codec_field* f, struct write_buffer* buffer, int index)
+{
+	int type = f->type;
+	int size = array_count(L, c, f, index);
+	offset_write_uint32(buffer, size);
+	if (type_integer(type) || type == TYPE_BOOL_ARRAY)
+	{
+		put_offset_integer_array(L, c, f, buffer, index, size);
+		return;
+	}
+	buffer_reserve(buffer, (size_t)size * (type == TYPE_DOUBLE_ARRAY ? sizeof(double) : 4));
+	for (int i = 1; i <= size; i++)
+	{
+		lua_rawgeti(L, index, i);
+		switch (type)
+		{
+		case TYPE_FLOAT_ARRAY:
+			wire_put_float(buffer, (float)lua_tonumber(L, -1));
+			break;
+		case TYPE_DOUBLE_ARRAY:
+			wire_put_double(buffer, (double)lua_tonumber(L, -1));
+			break;
+		}
+		lua_pop(L, 1);
+	}
+}
+
+static void put_offset_field(lua_State* L, struct codec* c, struct codec_field* f, struct write_buffer* buffer, int depth)
+{
+	int top = lua_gettop(L);
+	if (f->type == TYPE_PROTOCOL && !f->isarray)
+		lazy_table(L, top);
+	int type = lua_type(L, top);
+	check_field(L, c, f, type);
+	if (f->size)
+		fixed_table(L, top);
+	switch (f->type)
+	{
+	case TYPE_INT:
+		offset_write_uint32(buffer, (unsigned int)check_integer(L, c, f, top, TYPE_INT, 0));
+		break;
+	case TYPE_FLOAT:
+		wire_write_float(buffer, (float)lua_tonumber(L, top));
+		break;
+	case TYPE_DOUBLE:
+		wire_write_double(buffer, (double)lua_tonumber(L, top));
+		break;
+	case TYPE_STRING:
+		put_offset_string(L, buffer, top);
+		break;
+	case TYPE_STRING_ARRAY:
+	case TYPE_PROTOCOL:
+	{
+		if (f->type == TYPE_PROTOCOL && !f->isarray)
+		{
+			put_offset_protocol(L, f->codec, type == LUA_TNIL ? 0 : top, buffer, depth + 1);
+			break;
+		}
+		//元素按偏移表定位
+		int size = array_count(L, c, f, top);
+		size_t table = offset_begin(buffer, size);
+		for (int i = 1; i <= size; i++)
+		{
+			lua_rawgeti(L, top, i);
+			put_offset(L, c, buffer, table, i - 1);
+			if (f->type == TYPE_STRING_ARRAY)
+			{
+				put_offset_string(L, buffer, top + 1);
+			}
+			else
+			{
+				lazy_table(L, top + 1);
+				if (!lua_istable(L, -1) && !fixed_hole(L, f))
+					field_error(L, c, f, "table");
+				put_offset_protocol(L, f->codec, lua_istable(L, -1) ? top + 1 : 0, buffer, depth + 1);
+			}
+			lua_pop(L, 1);
+		}
+		break;
+	}
+	case TYPE_BOOL:
+		offset_write_integer(buffer, TYPE_BOOL, lua_toboolean(L, top));
+		break;
+	case TYPE_ENUM:
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, f->enums);
+		offset_write_integer(buffer, f->type, check_integer(L, c, f, top, f->type, top + 1));
+		lua_pop(L, 1);
+		break;
+	}
+	case TYPE_MAP:
+		luaL_error(L, "protocol %s field %s map is not supported by offset format", c->name, f->name);
+		break;
+	default:
+		if (f->type & 1)
+			put_offset_array(L, c, f, buffer, top);
+		else
+			offset_write_integer(buffer, f->type, check_integer(L, c, f, top, f->type, 0));
+		break;
+	}
+}
+
+//与紧凑格式一样，位置字段取默认值和nil的可选字段不写入(偏移为0)，嵌套协议总是写入
+static void put_offset_protocol(lua_State* L, struct codec* c, int index, struct write_buffer* buffer, int depth)
+{
+	if (depth > CODEC_MAX_DEPTH)
+		luaL_error(L, "protocol %s nested too deep", c->name);
+	luaL_checkstack(L, 4, NULL);
+	size_t table = offset_begin(buffer, c->size);
+	for (int i = 0; i < c->size; i++)
+	{
+		struct codec_field* f = &c->field[i];
+		if (index)
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, f->key);
+			lua_rawget(L, index);
+		}
+		else if (f->tag)
+		{
+			continue;
+		}
+		else
+		{
+			lua_pushnil(L);
+		}
+		if (f->tag ? !lua_isnil(L, -1) : field_present(L, f, lua_gettop(L)))
+		{
+			put_offset(L, c, buffer, table, i);
+			put_offset_field(L, c, f, buffer, depth);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+//index为table在栈上的绝对位置
+static void encode_protocol(lua_State* L, struct codec* c, int index, struct write_buffer* buffer)
+{
+	buffer_reserve(buffer, measure_protocol(L, c, index, 0));
+	put_protocol(L, c, index, buffer, 0, NULL);
+}
+
+//解码时栈顶为字段原来的值，解码后替换为新值。原来的值是table时就地覆盖：
+//数组截断多余的元素，嵌套协议沿用原来的table，不产生新的table
+static void decode_protocol(lua_State* L, struct codec* c, struct read_buffer* reader, int depth, struct wire_dict* dict);
+
+static void check_utf8(lua_State* L, struct codec* c, struct codec_field* f, const char* str, size_t len)
+{
+	if (c->utf8 && !utf8_valid(str, len))
+		luaL_error(L, "protocol %s field %s invalid utf8", c->name, f->name);
+}
+
+//扩展整数和枚举，栈顶为字段原来的值。枚举表放在原来的值下面，解码后移除
+static void decode_integer(lua_State* L, struct codec_field* f, struct read_buffer* reader)
+{
+	int enums = 0;
+	if (f->enums != LUA_NOREF)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, f->enums);
+		lua_insert(L, -2);
+		enums = lua_gettop(L) - 1;
+	}
+	if (f->type & 1)
+	{
+		read_integer_array(L, reader, f->type, enums);
+	}
+	else
+	{
+		unsigned long long value;
+		if (wire_read_integer(reader, f->type, &value) < 0)
+			truncated(L);
+		lua_pop(L, 1);
+		push_integer(L, f->type, value, enums);
+	}
+	if (enums)
+		lua_remove(L, enums);
+}
+
+static void decode_field(lua_State* L, struct codec* c, struct codec_field* f, struct read_buffer* reader, int depth, struct wire_dict* dict);
+
+//map总是新建table，hash部分按项数一次分配，不再逐项rehash。键和值都不使用字典
+//栈顶的table放回c的回收池，池满时丢弃，弹出栈顶
+static void codec_recycle(lua_State* L, struct codec* c)
+{
+	if (c->pool == LUA_NOREF)
+	{
+		lua_createtable(L, CODEC_POOL_MAX, 0);
+		c->pool = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->pool);
+	int size = (int)lua_rawlen(L, -1);
+	if (size < CODEC_POOL_MAX)
+	{
+		lua_pushvalue(L, -2);
+		lua_rawseti(L, -2, size + 1);
+	}
+	lua_pop(L, 2);
+}
+
+//压入c的回收池中的一个table，池空时新建
+static void codec_reuse(lua_State* L, struct codec* c)
+{
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->pool);
+	int size = lua_istable(L, -1) ? (int)lua_rawlen(L, -1) : 0;
+	if (size == 0)
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 0, c->size);
+		return;
+	}
+	lua_rawgeti(L, -1, size);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, size);
+	lua_remove(L, -2);
+}
+
+//map解码到原来的table：先清空再填入，键与上次相同时不重新分配。
+//值为协议时清出的table放回值协议的回收池，解码新的项时再取出来沿用
+static void reuse_map(lua_State* L, struct codec_field* f, int nrec)
+{
+	struct codec* value = f->entry[1].codec;
+	reuse_table(L, 0, nrec);
+	lua_pushnil(L);
+	while (lua_next(L, -2))
+	{
+		if (value && lua_istable(L, -1))
+			codec_recycle(L, value);
+		else
+			lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, -4);
+	}
+}
+
+static void decode_map(lua_State* L, struct codec* c, struct codec_field* f, struct read_buffer* reader, int depth, struct wire_dict* dict)
+{
+	size_t count;
+	if (wire_read_count(reader, &count) < 0)
+		truncated(L);
+	luaL_checkstack(L, 4, NULL);
+	reuse_map(L, f, (int)count);
+	for (size_t i = 0; i < count; i++)
+	{
+		lua_pushnil(L);
+		decode_field(L, c, &f->entry[0], reader, depth, dict);
+		if (f->entry[1].codec)
+			codec_reuse(L, f->entry[1].codec);
+		else
+			lua_pushnil(L);
+		decode_field(L, c, &f->entry[1], reader, depth, dict);
+		lua_rawset(L, -3);
+	}
+}
+
+static void decode_field(lua_State* L, struct codec* c, struct codec_field* f, struct read_buffer* reader, int depth, struct wire_dict* dict)
+{
+	//定长数组的个数必须与定义一致，之后与变长数组一样按个数预分配
+	if (f->size && !fixed_count(reader, f->size))
+		luaL_error(L, "protocol %s field %s expect %d elements", c->name, f->name, f->size);
+	switch (f->type)
+	{
+	case TYPE_INT:
+	{
+		int value;
+		if (wire_read_int(reader, &value) < 0)
+			truncated(L);
+		lua_pop(L, 1);
+		lua_pushinteger(L, value);
+		break;
+	}
+	case TYPE_FLOAT:
+	{
+		float value;
+		if (wire_read_float(reader, &value) < 0)
+			truncated(L);
+		lua_pop(L, 1);
+		lua_pushnumber(L, value);
+		break;
+	}
+	case TYPE_DOUBLE:
+	{
+		double value;
+		if (wire_read_double(reader, &value) < 0)
+			truncated(L);
+		lua_pop(L, 1);
+		lua_pushnumber(L, value);
+		break;
+	}
+	case TYPE_STRING:
+	{
+		const char* str;
+		size_t len;
+		if ((dict ? dict_read_string(dict, reader, &str, &len) : wire_read_string(reader, &str, &len)) < 0)
+			truncated(L);
+		check_utf8(L, c, f, str, len);
+		lua_pop(L, 1);
+		lua_pushlstring(L, str, len);
+		break;
+	}
+	case TYPE_INT_ARRAY:
+		read_int_array(L, reader);
+		break;
+	case TYPE_FLOAT_ARRAY:
+		read_float_array(L, reader);
+		break;
+	case TYPE_DOUBLE_ARRAY:
+		read_double_array(L, reader);
+		break;
+	case TYPE_STRING_ARRAY:
+		read_string_array(L, reader, dict, c, f);
+		break;
+	case TYPE_BOOL:
+	{
+		unsigned long long value;
+		if (wire_read_integer(reader, TYPE_BOOL, &value) < 0)
+			truncated(L);
+		lua_pop(L, 1);
+		lua_pushboolean(L, value != 0);
+		break;
+	}
+	case TYPE_BOOL_ARRAY:
+		read_bool_array(L, reader);
+		break;
+	case TYPE_MAP:
+		decode_map(L, c, f, reader, depth, dict);
+		break;
+	case TYPE_PROTOCOL:
+		if (!f->isarray)
+		{
+			decode_protocol(L, f->codec, reader, depth + 1, dict);
+		}
+		else
+		{
+			size_t count;
+			if (wire_read_count(reader, &count) < 0)
+				truncated(L);
+			reuse_table(L, (int)count, 0);
+			for (size_t j = 1; j <= count; j++)
+			{
+				lua_rawgeti(L, -1, j);
+				decode_protocol(L, f->codec, reader, depth + 1, dict);
+				lua_rawseti(L, -2, j);
+			}
+			truncate_array(L, count);
+		}
+		break;
+	default:
+		decode_integer(L, f, reader);
+		break;
+	}
+}
+
+//位图中不存在的位置字段取默认值
+static void default_field(lua_State* L, struct codec* c, struct codec_field* f)
+{
+	if (f->size)
+		luaL_error(L, "protocol %s field %s missing", c->name, f->name);
+	switch (f->type)
+	{
+	case TYPE_INT:
+		lua_pop(L, 1);
+		lua_pushinteger(L, 0);
+		break;
+	case TYPE_FLOAT:
+	case TYPE_DOUBLE:
+		lua_pop(L, 1);
+		lua_pushnumber(L, 0);
+		break;
+	case TYPE_STRING:
+		lua_pop(L, 1);
+		lua_pushliteral(L, "");
+		break;
+	case TYPE_BOOL:
+		lua_pop(L, 1);
+		lua_pushboolean(L, 0);
+		break;
+	case TYPE_MAP:
+		reuse_map(L, f, 0);
+		break;
+	default:
+		if (f->type == TYPE_PROTOCOL && !f->isarray)
+			luaL_error(L, "protocol %s field %s missing", c->name, f->name);
+		if ((f->type & 1) || f->type == TYPE_PROTOCOL)
+		{
+			read_empty_array(L);
+		}
+		else
+		{
+			//枚举的0可能有名字
+			lua_pop(L, 1);
+			if (f->enums != LUA_NOREF)
+				lua_rawgeti(L, LUA_REGISTRYINDEX, f->enums);
+			push_integer(L, f->type, 0, lua_gettop(L));
+			if (f->enums != LUA_NOREF)
+				lua_remove(L, -2);
+		}
+		break;
+	}
+}
+
+static void decode_protocol(lua_State* L, struct codec* c, struct read_buffer* reader, int depth, struct wire_dict* dict)
+{
+	if (depth > CODEC_MAX_DEPTH)
+		luaL_error(L, "protocol %s nested too deep", c->name);
+	luaL_checkstack(L, 6, NULL);
+	int reuse = lua_istable(L, -1);
+	if (!reuse)
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 0, c->size);
+	}
+	int index = lua_gettop(L);
+
+	const char* bitmap;
+	if (wire_read_bitmap(reader, c->bitmap, &bitmap) < 0)
+		truncated(L);
+	int bit = 0;
+	for (int i = 0; i < c->size; i++)
+	{
+		struct codec_field* f = &c->field[i];
+		if (f->tag)
+			continue;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, f->key);
+		if (reuse)
+		{
+			lua_pushvalue(L, -1);
+			lua_rawget(L, index);
+		}
+		else
+		{
+			lua_pushnil(L);
+		}
+		if (!WIRE_BIT(bitmap, bit))
+		{
+			default_field(L, c, f);
+		}
+		else if (f->type == TYPE_BOOL)
+		{
+			lua_pop(L, 1);
+			lua_pushboolean(L, 1);
+		}
+		else
+		{
+			decode_field(L, c, f, reader, depth, dict);
+		}
+		lua_rawset(L, index);
+		bit++;
+	}
+
+	//就地解码时记录出现过的可选字段，没出现的最后清为nil，不能留下上一条消息的值
+	unsigned int stack[8];
+	unsigned int* seen = NULL;
+	if (reuse)
+	{
+		size_t bytes = sizeof(unsigned int) * ((c->size + 31) / 32);
+		seen = bytes <= sizeof(stack) ? stack : (unsigned int*)lua_newuserdata(L, bytes);
+		memset(seen, 0, bytes);
+	}
+
+	//不认识的key(新版本增加的字段或类型变化的字段)按类型直接跳过
+	unsigned int key;
+	for (;;)
+	{
+		if (wire_read_key(reader, &key) < 0)
+			truncated(L);
+		if (key == 0)
+			break;
+		int i;
+		for (i = 0; i < c->size; i++)
+		{
+			if (c->field[i].tag == key)
+				break;
+		}
+		if (i == c->size)
+		{
+			if (wire_skip_value(reader, key) < 0)
+				truncated(L);
+			continue;
+		}
+
+		struct codec_field* f = &c->field[i];
+		lua_rawgeti(L, LUA_REGISTRYINDEX, f->key);
+		if (reuse)
+		{
+			seen[i / 32] |= 1u << (i % 32);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, index);
+		}
+		else
+		{
+			lua_pushnil(L);
+		}
+		if (f->type == TYPE_STRING || WIRE_KEY_TYPE(key) != WIRE_BYTES)
+		{
+			decode_field(L, c, f, reader, depth, NULL);
+		}
+		else
+		{
+			//值限制在外层长度之内解码，结束时必须恰好读完
+			size_t n;
+			if (wire_read_count(reader, &n) < 0)
+				truncated(L);
+			size_t size = reader->size;
+			reader->size = reader->offset + n;
+			decode_field(L, c, f, reader, depth, NULL);
+			if (reader->offset != reader->size)
+				luaL_error(L, "protocol %s field %s length mismatch", c->name, f->name);
+			reader->size = size;
+		}
+		lua_rawset(L, index);
+	}
+
+	if (reuse)
+	{
+		for (int i = 0; i < c->size; i++)
+		{
+			if (c->field[i].tag == 0 || (seen[i / 32] & (1u << (i % 32))))
+				continue;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, c->field[i].key);
+			lua_pushnil(L);
+			lua_rawset(L, index);
+		}
+		lua_settop(L, index);
+	}
+}
+
+//协议可以按完整名字(如test2.InnerProtocol)或协议id查找
+static struct codec* check_codec(lua_State* L, int arg)
+{
+	lua_pushvalue(L, arg);
+	lua_rawget(L, lua_upvalueindex(1));
+	struct codec* c = (struct codec*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (c == NULL)
+		luaL_error(L, "unknown protocol %s", luaL_tolstring(L, arg, NULL));
+	return c;
+}
+
+static struct codec* query_codec(lua_State* L, int id)
+{
+	lua_rawgeti(L, lua_upvalueindex(1), id);
+	struct codec* c = (struct codec*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (c == NULL)
+		luaL_error(L, "unknown protocol id %d", id);
+	return c;
+}
+
+//protocol.load(path [, cache [, threads]])：给出cache时缓存有效则直接加载，否则解析后写入缓存。
+//threads为解析import文件的线程数，默认1，不在调用者的进程里按核数开线程；0表示按核数
+static int lload(lua_State* L)
+{
+	const char* path = luaL_checkstring(L, 1);
+	const char* cache = luaL_optstring(L, 2, NULL);
+	int threads = (int)luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, threads >= 0, 3, "thread count must not be negative");
+	struct protocol* root = protocol_load(path, cache, threads, NULL);
+	if (root == NULL)
+		return luaL_error(L, "protocol load %s failed", path);
+
+	struct schema* s = (struct schema*)lua_newuserdata(L, sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->root = root;
+	luaL_setmetatable(L, SCHEMA_META);
+	compile_schema(L, s);
+
+	//schema由模块引用，重复加载同名协议时后加载的覆盖之前的
+	lua_rawseti(L, lua_upvalueindex(3), (int)lua_rawlen(L, lua_upvalueindex(3)) + 1);
+	for (int i = 0; i < s->size; i++)
+	{
+		struct codec* c = s->codec[i];
+		lua_pushstring(L, c->name);
+		lua_pushlightuserdata(L, c);
+		lua_rawset(L, lua_upvalueindex(1));
+		lua_pushlightuserdata(L, c);
+		lua_rawseti(L, lua_upvalueindex(1), c->protocol->id);
+	}
+	lua_pushinteger(L, s->size);
+	return 1;
+}
+
+#define check_dict(L, arg) (lua_isnoneornil(L, arg) ? NULL : (struct wire_dict*)luaL_checkudata(L, arg, DICT_META))
+
+//传入dict时字符串按连接的字典编码，接收端必须用对应的字典按相同顺序解码。
+//字典编码中途出错会让两端的字典错开，所以先不用字典完整编码一遍，类型错误在修改字典之前报出；
+//预留的空间是长度上限，对字典编码同样足够
+static int lencode(lua_State* L)
+{
+	struct codec* c = check_codec(L, 1);
+	lazy_table(L, 2);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	struct wire_dict* dict = check_dict(L, 3);
+	lua_settop(L, 2);
+	struct write_buffer* buffer = (struct write_buffer*)lua_touserdata(L, lua_upvalueindex(2));
+	buffer_reset(buffer);
+	encode_protocol(L, c, 2, buffer);
+	if (dict)
+	{
+		buffer_reset(buffer);
+		put_protocol(L, c, 2, buffer, 0, dict);
+	}
+	lua_pushlstring(L, buffer->ptr, buffer->offset);
+	return 1;
+}
+
+//偏移表格式编码，读取端用offset_view按字段下标和数组下标直接访问，适合很大的快照消息
+static int lencode_offset(lua_State* L)
+{
+	struct codec* c = check_codec(L, 1);
+	lazy_table(L, 2);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	struct write_buffer* buffer = (struct write_buffer*)lua_touserdata(L, lua_upvalueindex(2));
+	buffer_reset(buffer);
+	put_offset_protocol(L, c, 2, buffer, 0);
+	if (buffer->offset > 0xffffffffu)
+		return luaL_error(L, "protocol %s too large", c->name);
+	lua_pushlstring(L, buffer->ptr, buffer->offset);
+	return 1;
+}
+
+//传入target时解码到target中，返回target。
+//字典解码中途出错时字典已经与发送端不一致，应当断开连接或两端同时reset
+static int ldecode(lua_State* L)
+{
+	struct codec* c = check_codec(L, 1);
+	size_t size;
+	const char* data = luaL_checklstring(L, 2, &size);
+	if (!lua_isnoneornil(L, 3))
+		luaL_checktype(L, 3, LUA_TTABLE);
+	struct wire_dict* dict = check_dict(L, 4);
+	lua_settop(L, 3);
+	struct read_buffer reader;
+	reader_init(&reader, data, size);
+	decode_protocol(L, c, &reader, 0, dict);
+	if (reader.offset != size)
+		return luaL_error(L, "protocol %s has trailing data", c->name);
+	return 1;
+}
+
+//延迟解码：decode_lazy只校验一次消息结构，返回代理userdata。
+//字段在第一次访问时才从保留的数据中定位并解码，结果缓存在代理的uservalue中，
+//嵌套协议返回新的代理，协议数组返回代理的数组。uservalue[1]为数据字符串，保证数据一直有效。
+//pairs按字段定义的顺序遍历存在的字段；#与解码出的table一样为0；encode时代理先换成字段的table
+struct lazy_message {
+	struct codec* codec;
+	const char* data;
+	size_t size;
+};
+
+//缓存中表示字段值为nil(不存在的可选字段)
+static char lazy_nil;
+
+//栈顶为数据字符串，替换为代理
+static void push_lazy(lua_State* L, struct codec* c, const char* data, size_t size)
+{
+	struct lazy_message* m = (struct lazy_message*)lua_newuserdata(L, sizeof(*m));
+	m->codec = c;
+	m->data = data;
+	m->size = size;
+	luaL_setmetatable(L, LAZY_META);
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, -3);
+	lua_rawseti(L, -2, 1);
+	lua_setuservalue(L, -2);
+	lua_remove(L, -2);
+}
+
+//reader位于嵌套协议的开头，栈顶为数据字符串，替换为代理
+static void push_lazy_protocol(lua_State* L, struct codec* c, struct read_buffer* reader)
+{
+	size_t begin = reader->offset;
+	if (skip_protocol(reader, c->protocol, 0) < 0)
+		truncated(L);
+	push_lazy(L, c, reader->ptr + begin, reader->offset - begin);
+}
+
+static int ldecode_lazy(lua_State* L)
+{
+	struct codec* c = check_codec(L, 1);
+	size_t size;
+	const char* data = luaL_checklstring(L, 2, &size);
+	lua_settop(L, 2);
+	if (!decode_view(c->protocol, data, size).valid())
+		return luaL_error(L, "protocol %s invalid data", c->name);
+	push_lazy(L, c, data, size);
+	return 1;
+}
+
+//proxy为代理在栈上的绝对位置
+static void decode_lazy_field(lua_State* L, struct lazy_message* m, int proxy, int index)
+{
+	struct codec* c = m->codec;
+	struct codec_field* f = &c->field[index];
+	struct read_buffer reader;
+	lua_pushnil(L);
+	if (!message_view(c->protocol, m->data, m->size).locate(index, &reader))
+	{
+		if (f->tag == 0)
+			default_field(L, c, f);
+		return;
+	}
+	if (f->type == TYPE_BOOL && f->tag == 0)
+	{
+		lua_pop(L, 1);
+		lua_pushboolean(L, 1);
+		return;
+	}
+	if (f->type != TYPE_PROTOCOL)
+	{
+		decode_field(L, c, f, &reader, 0, NULL);
+		return;
+	}
+
+	lua_pop(L, 1);
+	luaL_checkstack(L, 4, NULL);
+	lua_getuservalue(L, proxy);
+	lua_rawgeti(L, -1, 1);
+	lua_remove(L, -2);
+	if (!f->isarray)
+	{
+		push_lazy_protocol(L, f->codec, &reader);
+		return;
+	}
+	size_t count;
+	if (wire_read_count(&reader, &count) < 0)
+		truncated(L);
+	lua_createtable(L, (int)count, 0);
+	for (size_t i = 1; i <= count; i++)
+	{
+		lua_pushvalue(L, -2);
+		push_lazy_protocol(L, f->codec, &reader);
+		lua_rawseti(L, -2, (int)i);
+	}
+	lua_remove(L, -2);
+}
+
+//压入第index个字段的值，不存在的可选字段为nil；先查缓存，未访问过的解码后缓存
+static void lazy_field(lua_State* L, int proxy, int index)
+{
+	struct lazy_message* m = (struct lazy_message*)lua_touserdata(L, proxy);
+	luaL_checkstack(L, 6, NULL);
+	lua_getuservalue(L, proxy);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->codec->field[index].key);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, -3);
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		decode_lazy_field(L, m, proxy, index);
+		lua_pushvalue(L, -2);
+		if (lua_isnil(L, -2))
+			lua_pushlightuserdata(L, &lazy_nil);
+		else
+			lua_pushvalue(L, -2);
+		lua_rawset(L, -5);
+	}
+	else if (lua_touserdata(L, -1) == &lazy_nil)
+	{
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+static void lazy_table(lua_State* L, int index)
+{
+	struct lazy_message* m = (struct lazy_message*)luaL_testudata(L, index, LAZY_META);
+	if (m == NULL)
+		return;
+	struct codec* c = m->codec;
+	lua_createtable(L, 0, c->size);
+	for (int i = 0; i < c->size; i++)
+	{
+		lazy_field(L, index, i);
+		if (lua_isnil(L, -1))
+		{
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->field[i].key);
+		lua_insert(L, -2);
+		lua_rawset(L, -3);
+	}
+	lua_replace(L, index);
+}
+
+static int llazy_index(lua_State* L)
+{
+	struct lazy_message* m = (struct lazy_message*)luaL_checkudata(L, 1, LAZY_META);
+	lua_settop(L, 2);
+	//字段名都是字符串，其他类型的key(包括uservalue中的数据下标1)返回nil
+	if (lua_type(L, 2) != LUA_TSTRING)
+		return 0;
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 3);
+	if (!lua_isnil(L, -1))
+	{
+		if (lua_touserdata(L, -1) == &lazy_nil)
+			lua_pushnil(L);
+		return 1;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->codec->names);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	int index = (int)lua_tointeger(L, -1) - 1;
+	lua_settop(L, 3);
+	if (index < 0)
+		return 0;
+	lazy_field(L, 1, index);
+	return 1;
+}
+
+//key为上一个字段名，nil从第一个字段开始；跳过值为nil的字段
+static int llazy_next(lua_State* L)
+{
+	struct lazy_message* m = (struct lazy_message*)luaL_checkudata(L, 1, LAZY_META);
+	lua_settop(L, 2);
+	int index = 0;
+	if (!lua_isnil(L, 2))
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m->codec->names);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		index = (int)lua_tointeger(L, -1);
+		if (index <= 0)
+			return luaL_error(L, "protocol %s invalid key to next", m->codec->name);
+		lua_settop(L, 2);
+	}
+	for (; index < m->codec->size; index++)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m->codec->field[index].key);
+		lazy_field(L, 1, index);
+		if (!lua_isnil(L, -1))
+			return 2;
+		lua_pop(L, 2);
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int llazy_pairs(lua_State* L)
+{
+	luaL_checkudata(L, 1, LAZY_META);
+	lua_pushcfunction(L, llazy_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+//消息只有按名字访问的字段，没有数组部分
+static int llazy_len(lua_State* L)
+{
+	luaL_checkudata(L, 1, LAZY_META);
+	lua_pushinteger(L, 0);
+	return 1;
+}
+
+//赋值只修改缓存，不影响数据；之后读到的是赋的值
+static int llazy_newindex(lua_State* L)
+{
+	struct lazy_message* m = (struct lazy_message*)luaL_checkudata(L, 1, LAZY_META);
+	lua_settop(L, 3);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->codec->names);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	if (lua_type(L, 2) != LUA_TSTRING || lua_isnil(L, -1))
+		return luaL_error(L, "protocol %s has no field %s", m->codec->name, luaL_tolstring(L, 2, NULL));
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	if (lua_isnil(L, 3))
+		lua_pushlightuserdata(L, &lazy_nil);
+	else
+		lua_pushvalue(L, 3);
+	lua_rawset(L, -3);
+	return 0;
+}
+
+static int llazy_tostring(lua_State* L)
+{
+	struct lazy_message* m = (struct lazy_message*)luaL_checkudata(L, 1, LAZY_META);
+	lua_pushfstring(L, "%s (lazy): %p", m->codec->name, m);
+	return 1;
+}
+
+//回收的table保留原来的内容，再次解码到其中时嵌套的table和数组都可以沿用
+static int lacquire(lua_State* L)
+{
+	struct codec* c = check_codec(L, 1);
+	codec_reuse(L, c);
+	return 1;
+}
+
+static int lrelease(lua_State* L)
+{
+	struct codec* c = check_codec(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	codec_recycle(L, c);
+	return 0;
+}
+
+//每个连接的每个方向一个字典，两端的容量必须相同
+static int ldictionary(lua_State* L)
+{
+	int capacity = (int)luaL_optinteger(L, 1, 1024);
+	luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+	struct wire_dict* dict = (struct wire_dict*)lua_newuserdata(L, sizeof(*dict));
+	dict_init(dict, capacity);
+	luaL_setmetatable(L, DICT_META);
+	return 1;
+}
+
+static int ldict_gc(lua_State* L)
+{
+	struct wire_dict* dict = (struct wire_dict*)luaL_checkudata(L, 1, DICT_META);
+	if (dict->entry)
+		dict_release(dict);
+	return 0;
+}
+
+static int ldict_reset(lua_State* L)
+{
+	dict_reset((struct wire_dict*)luaL_checkudata(L, 1, DICT_META));
+	return 0;
+}
+
+static int ldict_len(lua_State* L)
+{
+	lua_pushinteger(L, ((struct wire_dict*)luaL_checkudata(L, 1, DICT_META))->size);
+	return 1;
+}
+
+//按协议开关string字段的UTF-8校验，嵌套协议各自设置，返回原来的设置
+static int lvalidate_utf8(lua_State* L)
+{
+	struct codec* c = check_codec(L, 1);
+	int old = c->utf8;
+	if (!lua_isnone(L, 2))
+		c->utf8 = lua_toboolean(L, 2);
+	lua_pushboolean(L, old);
+	return 1;
+}
+
+#define check_batch(L) ((struct wire_batch*)luaL_checkudata(L, 1, BATCH_META))
+
+//C层可以用lua_touserdata取得struct wire_batch，再由batch_iovec取出各条消息
+static int lbatch(lua_State* L)
+{
+	struct wire_batch* batch = (struct wire_batch*)lua_newuserdata(L, sizeof(*batch));
+	batch_init(batch);
+	luaL_setmetatable(L, BATCH_META);
+	return 1;
+}
+
+static int lbatch_gc(lua_State* L)
+{
+	batch_release(check_batch(L));
+	return 0;
+}
+
+static void batch_add(lua_State* L, struct wire_batch* batch, int name, int index)
+{
+	struct codec* c = check_codec(L, name);
+	lazy_table(L, index);
+	luaL_checktype(L, index, LUA_TTABLE);
+	//上次编码出错时留下的半条消息先丢弃
+	batch_cancel(batch);
+	batch_begin(batch, c->protocol->id);
+	encode_protocol(L, c, index, &batch->buffer);
+	batch_end(batch);
+}
+
+static int lbatch_add(lua_State* L)
+{
+	struct wire_batch* batch = check_batch(L);
+	lua_settop(L, 3);
+	batch_add(L, batch, 2, 3);
+	lua_pushinteger(L, batch->size);
+	return 1;
+}
+
+static int lbatch_data(lua_State* L)
+{
+	struct wire_batch* batch = check_batch(L);
+	batch_cancel(batch);
+	lua_pushlstring(L, batch->buffer.ptr, batch->buffer.offset);
+	return 1;
+}
+
+static int lbatch_reset(lua_State* L)
+{
+	batch_reset(check_batch(L));
+	return 0;
+}
+
+static int lbatch_len(lua_State* L)
+{
+	lua_pushinteger(L, check_batch(L)->size);
+	return 1;
+}
+
+//list为{ name1, t1, name2, t2, ... }，返回整块数据
+static int lencode_batch(lua_State* L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	struct wire_batch* batch = (struct wire_batch*)lua_touserdata(L, lua_upvalueindex(4));
+	batch_reset(batch);
+	int size = (int)lua_rawlen(L, 1);
+	for (int i = 1; i <= size; i += 2)
+	{
+		lua_rawgeti(L, 1, i);
+		lua_rawgeti(L, 1, i + 1);
+		batch_add(L, batch, 2, 3);
+		lua_settop(L, 1);
+	}
+	lua_pushlstring(L, batch->buffer.ptr, batch->buffer.offset);
+	return 1;
+}
+
+static int ldecode_batch(lua_State* L)
+{
+	size_t size;
+	const char* data = luaL_checklstring(L, 1, &size);
+	struct read_buffer reader;
+	reader_init(&reader, data, size);
+	lua_newtable(L);
+	int n = 0;
+	while (reader.offset < size)
+	{
+		int id;
+		const char* ptr;
+		size_t len;
+		if (batch_next(&reader, &id, &ptr, &len) < 0)
+			truncated(L);
+		struct codec* c = query_codec(L, id);
+		struct read_buffer message;
+		reader_init(&message, ptr, len);
+		lua_pushstring(L, c->name);
+		lua_rawseti(L, -2, ++n);
+		lua_pushnil(L);
+		decode_protocol(L, c, &message, 0, NULL);
+		if (message.offset != len)
+			return luaL_error(L, "protocol %s has trailing data", c->name);
+		lua_rawseti(L, -2, ++n);
+	}
+	return 1;
+}
+
+extern "C" int luaopen_protocol(lua_State* L)
+{
+	luaL_newmetatable(L, SCHEMA_META);
+	lua_pushcfunction(L, lschema_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, WRITER_META);
+	lua_pushcfunction(L, lwriter_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, LAZY_META);
+	lua_pushcfunction(L, llazy_index);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, llazy_newindex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushcfunction(L, llazy_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, llazy_pairs);
+	lua_setfield(L, -2, "__pairs");
+	lua_pushcfunction(L, llazy_len);
+	lua_setfield(L, -2, "__len");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, DICT_META);
+	lua_pushcfunction(L, ldict_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, ldict_len);
+	lua_setfield(L, -2, "__len");
+	lua_newtable(L);
+	lua_pushcfunction(L, ldict_reset);
+	lua_setfield(L, -2, "reset");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, BATCH_META);
+	lua_pushcfunction(L, lbatch_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lbatch_len);
+	lua_setfield(L, -2, "__len");
+	lua_pop(L, 1);
+
+	//upvalue：名字/id到codec的映射，编码缓冲，已加载的schema，批量编码缓冲
+	lua_newtable(L);
+	lwriter(L);
+	lua_newtable(L);
+	lbatch(L);
+	int upvalue = lua_gettop(L) - 3;
+
+	luaL_Reg m[] = {
+		{ "add", lbatch_add },
+		{ "data", lbatch_data },
+		{ "reset", lbatch_reset },
+		{ NULL, NULL },
+	};
+	luaL_getmetatable(L, BATCH_META);
+	luaL_newlibtable(L, m);
+	for (int i = 0; i < 4; i++)
+		lua_pushvalue(L, upvalue + i);
+	luaL_setfuncs(L, m, 4);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_Reg l[] = {
+		{ "load", lload },
+		{ "encode", lencode },
+		{ "encode_offset", lencode_offset },
+		{ "decode", ldecode },
+		{ "decode_lazy", ldecode_lazy },
+		{ "acquire", lacquire },
+		{ "release", lrelease },
+		{ "batch", lbatch },
+		{ "dictionary", ldictionary },
+		{ "validate_utf8", lvalidate_utf8 },
+		{ "encode_batch", lencode_batch },
+		{ "decode_batch", ldecode_batch },
+		{ NULL, NULL },
+	};
+	luaL_newlibtable(L, l);
+	for (int i = 0; i < 4; i++)
+		lua_pushvalue(L, upvalue + i);
+	luaL_setfuncs(L, l, 4);
+	return 1;
+}
@@ -11,88 +11,12 @@ extern "C" {
 #include "lauxlib.h"
 }
 
-#define TRY(l) if (setjmp((l)->exception) == 0)
-#define THROW(l) longjmp((l)->exception, 1)
-
-#define TYPE_INT				0
-#define TYPE_INT_ARRAY			1
-#define TYPE_FLOAT				2
-#define TYPE_FLOAT_ARRAY		3
-#define TYPE_DOUBLE				4
-#define TYPE_DOUBLE_ARRAY		5
-#define TYPE_STRING				6
-#define TYPE_STRING_ARRAY		7
-#define TYPE_PROTOCOL			8
-
-
-static const char* builtin_type[] = { "int", "int[]", "float", "float[]", "double", "double[]", "string", "string[]"};
-
-struct field_type {
-	int type;
-	int isarray;
-	struct protocol* protocol;
-};
-
-struct field {
-	char* name;
-	struct field_type field_type;
-};
-
-struct protocol_table;
-
-struct protocol {
-	struct protocol* next;
-	struct protocol* parent;
-	struct protocol_table* children;
-
-	char* file;
-	char* name;
-	struct field** field;
-	int cap;
-	int size;
-
-	char* lastfield;
-};
-
-struct protocol_table {
-	struct protocol** slots;
-	int size;
-};
-
-typedef struct protocol* (*protocol_begin_func)(struct protocol_table* table,const char* file, const char* name);
-typedef void(*protocol_over_func)(struct protocol_table* table);
-typedef void(*field_begin_func)(struct protocol* ptl,const char* field_type);
-typedef void(*field_over_func)(struct protocol* ptl,int isarray, const char* field_name);
-
-
-struct file_hash {
-	char** name;
-	int offset;
-	int size;
-};
-
-struct lexer_cb {
-	protocol_begin_func protocol_begin;
-	protocol_over_func protocol_over;
-	field_begin_func field_begin;
-	field_over_func field_over;
-};
-
-struct lexer {
-	char* c;
-	int line;
-	char* file;
-
-	struct lexer* main;
-
-	jmp_buf exception;
-	struct protocol* root;
-
-	struct file_hash file_hash;
-
-	struct lexer_cb cb;
-};
+#include "protocol.h"
 
+//下标为类型编号，协议和枚举不在其中
+static const char* builtin_type[] = { "int", "int[]", "float", "float[]", "double", "double[]", "string", "string[]", NULL, NULL,
+	"bool", "bool[]", "int8", "int8[]", "int16", "int16[]", "int64", "int64[]",
+	"uint8", "uint8[]", "uint16", "uint16[]", "uint32", "uint32[]", "uint64", "uint64[]" };
 
 size_t strhash(const char *str)
 {
@@ -108,12 +32,12 @@ size_t strhash(const char *str)
 	return hash;
 }
 
-struct protocol_table* create_table(int size)
+struct protocol_table* create_table(struct arena* arena, int size)
 {
-	struct protocol_table* table = (struct protocol_table*)malloc(sizeof(*table));
+	struct protocol_table* table = (struct protocol_table*)arena_alloc(arena, sizeof(*table));
 	table->size = size;
 
-	table->slots = (struct protocol**)malloc(sizeof(*table->slots) * size);
+	table->slots = (struct protocol**)arena_alloc(arena, sizeof(*table->slots) * size);
 	memset(table->slots, 0, sizeof(*table->slots) * size);
 
 	return table;
@@ -128,7 +52,7 @@ struct protocol* query_protocol(struct protocol_table* table, const char* name)
 	{
 		while (slot)
 		{
-			if ((memcmp(slot->name, name,strlen(name)) == 0))
+			if (strcmp(slot->name, name) == 0)
 				return slot;
 			slot = slot->next;
 		}
@@ -136,9 +60,10 @@ struct protocol* query_protocol(struct protocol_table* table, const char* name)
 	return NULL;
 }
 
-void rehash_table(struct protocol_table* table, int nsize)
+//旧的slots留在arena中，随root一起释放
+void rehash_table(struct arena* arena, struct protocol_table* table, int nsize)
 {
-	struct protocol** nslots = (struct protocol**)malloc(sizeof(*nslots) * nsize);
+	struct protocol** nslots = (struct protocol**)arena_alloc(arena, sizeof(*nslots) * nsize);
 	memset(nslots, 0, sizeof(*nslots) * nsize);
 
 	for (int i = 0; i < table->size; i++) 
@@ -167,7 +92,6 @@ void rehash_table(struct protocol_table* table, int nsize)
 			
 		}
 	}
-	free(table->slots);
 	table->slots = nslots;
 	table->size = nsize;
 }
@@ -190,7 +114,7 @@ void add_protocol(struct protocol_table* table, struct protocol* protocol)
 			protocol = protocol->next;
 		}
 		if (size >= (table->size / 8))
-			rehash_table(table, table->size * 2);
+			rehash_table(table->slots[index]->arena, table, table->size * 2);
 	}
 }
 
@@ -199,7 +123,7 @@ struct field* query_field(struct protocol* protocol, const char* name)
 	for (int i = 0; i < protocol->size; i++)
 	{
 		struct field* f = protocol->field[i];
-		if (memcmp(f->name, name, strlen(name)) == 0)
+		if (strcmp(f->name, name) == 0)
 			return f;
 	}
 	return NULL;
@@ -210,84 +134,236 @@ void add_field(struct protocol* protocol, struct field* f)
 	if (protocol->size == protocol->cap)
 	{
 		int ncap = protocol->cap * 2;
-		struct field** nptr = (struct field**)malloc(sizeof(*nptr) * ncap);
+		struct field** nptr = (struct field**)arena_alloc(protocol->arena, sizeof(*nptr) * ncap);
 		memset(nptr, 0, sizeof(*nptr) * ncap);
 		memcpy(nptr, protocol->field, sizeof(*nptr) * protocol->cap);
-		free(protocol->field);
 		protocol->field = nptr;
 		protocol->cap = ncap;
 	}
 	protocol->field[protocol->size++] = f;
 }
 
-struct field* create_field(struct protocol* ptl,int isarray,char* field_type, char* field_name)
+static int builtin_index(const char* name)
 {
-	int ftype = TYPE_PROTOCOL;
-	for (int i = 0; i < sizeof(builtin_type) / sizeof(void*); i++)
+	for (int i = 0; i < (int)(sizeof(builtin_type) / sizeof(void*)); i++)
 	{
-		if (memcmp(field_type, builtin_type[i], strlen(field_type)) == 0)
-		{
-			ftype = i;
-			break;
-		}
+		if (builtin_type[i] && strcmp(name, builtin_type[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+//按作用域由内向外查找协议或枚举
+static struct protocol* scope_protocol(struct protocol* ptl, const char* name)
+{
+	for (struct protocol* cursor = ptl; cursor; cursor = cursor->parent)
+	{
+		struct protocol* tmp = query_protocol(cursor->children, name);
+		if (tmp)
+			return tmp;
+	}
+	return NULL;
+}
+
+//map<K,V>的键值类型已经由parse_map检查过
+static void create_map(struct protocol* ptl, struct field* f, char* field_type)
+{
+	char* comma = strchr(field_type, ',');
+	char* end = strchr(comma, '>');
+	*comma = '\0';
+	*end = '\0';
+	f->field_type.type = TYPE_MAP;
+	f->field_type.key = builtin_index(field_type + 4);
+	f->field_type.value = builtin_index(comma + 1);
+	if (f->field_type.value < 0)
+	{
+		f->field_type.protocol = scope_protocol(ptl, comma + 1);
+		assert(f->field_type.protocol != NULL);
+		f->field_type.value = f->field_type.protocol->isenum ? TYPE_ENUM : TYPE_PROTOCOL;
 	}
+	*comma = ',';
+	*end = '>';
+}
 
-	struct field* f = (struct field*)malloc(sizeof(*f));
+struct field* create_field(struct protocol* ptl,int isarray,char* field_type, char* field_name, int tag)
+{
+	struct field* f = (struct field*)arena_alloc(ptl->arena, sizeof(*f));
 	memset(f, 0, sizeof(*f));
 	f->name = field_name;
-	f->field_type.type = ftype;
+	f->tag = tag;
 	f->field_type.protocol = NULL;
 	f->field_type.isarray = isarray;
-	
-	if (ftype == TYPE_PROTOCOL)
-	{	
-		struct protocol* cursor = ptl;
-		while (cursor)
-		{
-			struct protocol* tmp = query_protocol(cursor->children,field_type);
-			if (tmp)
-			{
-				f->field_type.protocol = tmp;
-				break;
-			}
-			cursor = cursor->parent;
-		}
+	if (strncmp(field_type, "map<", 4) == 0)
+	{
+		create_map(ptl, f, field_type);
+		return f;
+	}
+
+	//定长数组int[4]按int[]查找，协议的Item[4]去掉后缀
+	char type[80];
+	const char* name = field_type;
+	char* bracket = strchr(field_type, '[');
+	if (bracket && bracket[1] != ']')
+	{
+		f->field_type.size = atoi(bracket + 1);
+		size_t len = bracket - field_type;
+		memcpy(type, field_type, len);
+		strcpy(type + len, "[]");
+		if (builtin_index(type) < 0)
+			type[len] = '\0';
+		name = type;
+	}
+
+	int ftype = builtin_index(name);
+	f->field_type.type = ftype < 0 ? TYPE_PROTOCOL : ftype;
+	if (ftype < 0)
+	{
+		f->field_type.protocol = scope_protocol(ptl, name);
 		assert(f->field_type.protocol != NULL);
+		if (f->field_type.protocol->isenum)
+			f->field_type.type = isarray ? TYPE_ENUM_ARRAY : TYPE_ENUM;
 	}
 
 	return f;
 }
 
-struct protocol* create_protocol(const char* file,const char* name)
+void map_entry(struct field* f, struct field* key, struct field* value)
 {
-	int len = strlen(name);
-	struct protocol* ctx = (struct protocol*)malloc(sizeof(*ctx));
-	ctx->next = NULL;
-	ctx->name = (char*)malloc(len + 1);
-	memcpy((void*)ctx->name, (void*)name, len);
-	ctx->name[len] = '\0';
+	memset(key, 0, sizeof(*key));
+	key->name = f->name;
+	key->field_type.type = f->field_type.key;
+	memset(value, 0, sizeof(*value));
+	value->name = f->name;
+	value->field_type.type = f->field_type.value;
+	value->field_type.protocol = f->field_type.protocol;
+}
 
-	len = strlen(file);
-	ctx->file = (char*)malloc(len + 1);
-	memcpy((void*)ctx->file, (void*)file, len);
-	ctx->file[len] = '\0';
+struct protocol* create_protocol(struct arena* arena, const char* file,const char* name)
+{
+	struct protocol* ctx = (struct protocol*)arena_alloc(arena, sizeof(*ctx));
+	ctx->next = NULL;
+	ctx->arena = arena;
+	ctx->name = arena_strdup(arena, name);
+	ctx->file = arena_strdup(arena, file);
 
 	ctx->parent = NULL;
-	ctx->children = create_table(4);
+	ctx->id = 0;
+	ctx->isenum = 0;
+	ctx->children = create_table(arena, 4);
 	ctx->cap = 4;
 	ctx->size = 0;
-	ctx->field = (struct field**)malloc(sizeof(struct field*) * ctx->cap);
+	ctx->field = (struct field**)arena_alloc(arena, sizeof(struct field*) * ctx->cap);
 	memset(ctx->field, 0, sizeof(struct field*) * ctx->cap);
 
 	return ctx;
 }
 
+//root拥有整个协议树的arena
+struct protocol* create_root()
+{
+	return create_protocol(arena_create(), "root", "root");
+}
+
+//只能对root调用，释放其下所有协议
+void release_protocol(struct protocol* root)
+{
+	arena_release(root->arena);
+}
+
+void protocol_fullname(struct protocol* ptl, char* buffer, size_t size)
+{
+	//root不参与命名，嵌套协议以.连接，如test2.InnerProtocol
+	size_t offset = 0;
+	if (ptl->parent != NULL && ptl->parent->parent != NULL)
+	{
+		protocol_fullname(ptl->parent, buffer, size);
+		offset = strlen(buffer);
+		if (offset + 1 < size)
+			buffer[offset++] = '.';
+	}
+	size_t len = strlen(ptl->name);
+	if (offset + len >= size)
+		len = size - offset - 1;
+	memcpy(buffer + offset, ptl->name, len);
+	buffer[offset + len] = '\0';
+}
+
+int protocol_positional(struct protocol* ptl)
+{
+	int count = 0;
+	for (int i = 0; i < ptl->size; i++)
+	{
+		if (ptl->field[i]->tag == 0)
+			count++;
+	}
+	return count;
+}
+
+//位置字段的嵌套协议和定长协议数组总是写入，nil按默认值展开；变长数组、map和可选字段可以为空
+static int nested_always(struct field* f)
+{
+	return f->tag == 0 && f->field_type.type == TYPE_PROTOCOL && (!f->field_type.isarray || f->field_type.size > 0);
+}
+
+//state按协议id记录：1为正在访问，2为已确认不在环上
+static int nested_visit(struct protocol* ptl, char* state)
+{
+	state[ptl->id] = 1;
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (!nested_always(f))
+			continue;
+		struct protocol* child = f->field_type.protocol;
+		if (state[child->id] == 1)
+		{
+			fprintf(stderr, "%s:protocol:%s field:%s nests %s recursively, use an array, map or optional field\n", ptl->file, ptl->name, f->name, child->name);
+			return -1;
+		}
+		if (state[child->id] == 0 && nested_visit(child, state) < 0)
+			return -1;
+	}
+	state[ptl->id] = 2;
+	return 0;
+}
+
+static int nested_walk(struct protocol* ptl, char* state)
+{
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* child = table->slots[i]; child; child = child->next)
+		{
+			if (child->isenum)
+				continue;
+			if (state[child->id] == 0 && nested_visit(child, state) < 0)
+				return -1;
+			if (nested_walk(child, state) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+//这样的环无论消息内容如何都会无限展开，编码时只能因为嵌套过深失败
+int check_nested(struct protocol* root)
+{
+	char* state = (char*)malloc(PROTOCOL_ID_MAX + 1);
+	memset(state, 0, PROTOCOL_ID_MAX + 1);
+	int ret = nested_walk(root, state);
+	free(state);
+	return ret;
+}
+
 void dump_protocol(struct protocol* root,int depth)
 {
 	for (int i = 0; i < depth; ++i)
 		printf("\t");
 
-	printf("%s@%s\n",root->file,root->name);
+	if (root->id)
+		printf("%s@%s#%d\n",root->file,root->name,root->id);
+	else
+		printf("%s@%s%s\n",root->file,root->name,root->isenum ? " enum" : "");
 	depth++;
 	struct protocol_table* table = root->children;
 	for (int i = 0; i < table->size; i++) 
@@ -306,13 +382,25 @@ void dump_protocol(struct protocol* root,int depth)
 		for (int i = 0; i < depth; ++i)
 			printf("\t");
 
+		if (root->isenum) {
+			printf("enum item:%s=%d\n",f->name,f->tag);
+			continue;
+		}
 		printf("field type:%d,array:%d,",f->field_type.type,f->field_type.isarray);
-		if (f->field_type.type == TYPE_PROTOCOL) {
+		if (f->field_type.size)
+			printf("size:%d,",f->field_type.size);
+		if (f->field_type.type == TYPE_MAP) {
+			printf("type name:map<%s,%s>,",builtin_type[f->field_type.key],
+				f->field_type.protocol ? f->field_type.protocol->name : builtin_type[f->field_type.value]);
+		} else if (f->field_type.protocol) {
 			printf("type name:%s,",f->field_type.protocol->name);
 		} else {
 			printf("type name:%s,",builtin_type[f->field_type.type]);
 		}
-		printf("field name:%s\n",f->name);
+		if (f->tag)
+			printf("field name:%s,tag:%d\n",f->name,f->tag);
+		else
+			printf("field name:%s\n",f->name);
 	}
 }
 
@@ -321,11 +409,18 @@ void lexer_init(struct lexer* l, struct protocol* root, protocol_begin_func ptl_
 	if (root)
 		l->root = root;
 	else
-		l->root = create_protocol("root","root");
+		l->root = create_root();
 	l->file_hash.offset = 0;
 	l->file_hash.size = 16;
-	l->file_hash.name = (char**)malloc(sizeof(char*)* l->file_hash.size);
+	l->file_hash.name = (char**)arena_alloc(l->root->arena, sizeof(char*)* l->file_hash.size);
 	memset(l->file_hash.name, 0, sizeof(char*)* l->file_hash.size);
+	l->source = NULL;
+	l->source_cap = 0;
+	l->copy_source = 0;
+	l->imports = NULL;
+	l->file_hash.slot_size = 32;
+	l->file_hash.slots = (int*)arena_alloc(l->root->arena, sizeof(int)* l->file_hash.slot_size);
+	memset(l->file_hash.slots, 0, sizeof(int)* l->file_hash.slot_size);
 
 	l->cb.protocol_begin = ptl_begin;
 	l->cb.protocol_over = ptl_over;
@@ -333,147 +428,251 @@ void lexer_init(struct lexer* l, struct protocol* root, protocol_begin_func ptl_
 	l->cb.field_over = field_over;
 }
 
-bool exist_file(struct lexer* l, char* file)
+//开放寻址，slots中保存name下标+1，0为空
+static int file_slot(struct file_hash* hash, const char* file)
 {
-	int i;
-	for (i = 0; i < l->file_hash.offset;i++)
+	int mask = hash->slot_size - 1;
+	int index = strhash(file) & mask;
+	while (hash->slots[index] != 0)
 	{
-		char* tmp = l->file_hash.name[i];
-		if (memcmp(tmp,file,strlen(file)) == 0)
-			return true;
+		if (strcmp(hash->name[hash->slots[index] - 1], file) == 0)
+			break;
+		index = (index + 1) & mask;
 	}
-	return false;
+	return index;
 }
 
-void parse_done(struct lexer* l, char* file)
+int find_file(struct lexer* l, const char* file)
 {
-	if (l->file_hash.offset == l->file_hash.size)
-	{
-		int nsize = l->file_hash.size;
-		char** nptr = (char**)malloc(sizeof(char*)*nsize);
-		memset(nptr, 0, sizeof(char*)*nsize);
-		memcpy(nptr, l->file_hash.name, l->file_hash.size*sizeof(char*));
-		free(l->file_hash.name);
-		l->file_hash.size = nsize;
-		l->file_hash.name = nptr;
-	}
-	char* tmp = (char*)malloc(strlen(file) + 1);
-	memcpy(tmp, file, strlen(file));
-	tmp[strlen(file)] = '\0';
-	l->file_hash.name[l->file_hash.offset++] = tmp;
+	return l->file_hash.slots[file_slot(&l->file_hash, file)] - 1;
 }
 
-static int eos(struct lexer *l, int n)
+bool exist_file(struct lexer* l, const char* file)
 {
-	if (*(l->c + n) == 0)
-		return 1;
-	else
-		return 0;
+	return find_file(l, file) >= 0;
 }
 
-static void skip_space(struct lexer *l);
-
-static void next_line(struct lexer *l)
+int parse_done(struct lexer* l, const char* file)
 {
-	char *n = l->c;
-	while (*n != '\n' && *n)
-		n++;
-	if (*n == '\n')
-		n++;
-	l->line++;
-	l->c = n;
-	skip_space(l);
-
-	return;
-}
+	struct file_hash* hash = &l->file_hash;
+	int index = find_file(l, file);
+	if (index >= 0)
+		return index;
 
-static void skip_space(struct lexer *l)
-{
-	char *n = l->c;
-	while (isspace(*n) && *n) {
-		if (*n == '\n')
-			l->line++;
-		n++;
+	if (hash->offset == hash->size)
+	{
+		int nsize = hash->size * 2;
+		char** nptr = (char**)arena_alloc(l->root->arena, sizeof(char*)*nsize);
+		memset(nptr, 0, sizeof(char*)*nsize);
+		memcpy(nptr, hash->name, hash->size*sizeof(char*));
+		hash->size = nsize;
+		hash->name = nptr;
 	}
+	char* tmp = arena_strdup(l->root->arena, file);
+	index = hash->offset++;
+	hash->name[index] = tmp;
 
-	l->c = n;
-	if (*n == '#' && *n)
-		next_line(l);
-
-	return;
+	if (hash->offset * 2 > hash->slot_size)
+	{
+		hash->slot_size *= 2;
+		hash->slots = (int*)arena_alloc(l->root->arena, sizeof(int)* hash->slot_size);
+		memset(hash->slots, 0, sizeof(int)* hash->slot_size);
+		for (int i = 0; i < hash->offset; i++)
+			hash->slots[file_slot(hash, hash->name[i])] = i + 1;
+	}
+	else
+	{
+		hash->slots[file_slot(hash, tmp)] = index + 1;
+	}
+	return index;
 }
 
-static void next_token(struct lexer *l)
-{
-	char *n;
-	skip_space(l);
-	n = l->c;
-	while (!isspace(*n) && *n)
-		n++;
-	l->c = n;
-	skip_space(l);
+#define C_OTHER		0
+#define C_END		1
+#define C_SPACE		2
+#define C_NEWLINE	3
+#define C_COMMENT	4
+#define C_LBRACE	5
+#define C_RBRACE	6
+#define C_LBRACKET	7
+#define C_QUOTE		8
+#define C_LANGLE	9
+#define C_RANGLE	10
+#define C_COMMA		11
+#define C_ALPHA		12
+#define C_DIGIT		13
+
+//字符分类表，单遍扫描时每个字符只查一次表
+static const unsigned char char_class[256] = {
+	/* 0x00 */ C_END, 0, 0, 0, 0, 0, 0, 0, 0, C_SPACE, C_NEWLINE, C_SPACE, C_SPACE, C_SPACE, 0, 0,
+	/* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x20 */ C_SPACE, 0, C_QUOTE, C_COMMENT, 0, 0, 0, 0, 0, 0, 0, 0, C_COMMA, 0, 0, 0,
+	/* 0x30 */ C_DIGIT, C_DIGIT, C_DIGIT, C_DIGIT, C_DIGIT, C_DIGIT, C_DIGIT, C_DIGIT, C_DIGIT, C_DIGIT, 0, 0, C_LANGLE, 0, C_RANGLE, 0,
+	/* 0x40 */ 0, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA,
+	/* 0x50 */ C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_LBRACKET, 0, 0, 0, C_ALPHA,
+	/* 0x60 */ 0, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA,
+	/* 0x70 */ C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_ALPHA, C_LBRACE, 0, C_RBRACE, 0, 0,
+};
 
-	return;
+static void token_error(struct lexer* l, int line, const char* what)
+{
+	fprintf(stderr, "%s@line:%d syntax error:%s\n", l->file, line, what);
+	THROW(l);
 }
 
-static void skip(struct lexer* l, int size)
+void lexer_scan(struct lexer* l, struct token* t)
 {
-	char *n = l->c;
-	int index = 0;
-	while (!eos(l,0) && index < size)
+	const unsigned char* c = (const unsigned char*)l->c;
+	for (;;)
+	{
+		switch (char_class[*c])
+		{
+		case C_SPACE:
+			c++;
+			continue;
+		case C_NEWLINE:
+			l->line++;
+			c++;
+			continue;
+		case C_COMMENT:
+			while (*c != '\n' && *c)
+				c++;
+			continue;
+		}
+		break;
+	}
+
+	t->line = l->line;
+	t->ptr = (const char*)c;
+	switch (char_class[*c])
+	{
+	case C_END:
+		t->type = TOKEN_EOF;
+		break;
+	case C_ALPHA:
+	{
+		const unsigned char* n = c + 1;
+		while (char_class[*n] >= C_ALPHA)
+			n++;
+		t->type = TOKEN_NAME;
+		c = n;
+		break;
+	}
+	case C_DIGIT:
 	{
-		n++;
-		index++;
+		const unsigned char* n = c + 1;
+		while (char_class[*n] == C_DIGIT)
+			n++;
+		t->type = TOKEN_NUMBER;
+		c = n;
+		break;
 	}
-		
-	l->c = n;
+	case C_LBRACE:
+		t->type = TOKEN_LBRACE;
+		c++;
+		break;
+	case C_RBRACE:
+		t->type = TOKEN_RBRACE;
+		c++;
+		break;
+	case C_LBRACKET:
+	{
+		//[]为变长数组，[N]为定长数组
+		const unsigned char* n = c + 1;
+		while (char_class[*n] == C_DIGIT)
+			n++;
+		if (*n != ']')
+			token_error(l, t->line, "expect []");
+		t->type = n == c + 1 ? TOKEN_ARRAY : TOKEN_FIXED;
+		c = n + 1;
+		break;
+	}
+	case C_LANGLE:
+		t->type = TOKEN_LANGLE;
+		c++;
+		break;
+	case C_RANGLE:
+		t->type = TOKEN_RANGLE;
+		c++;
+		break;
+	case C_COMMA:
+		t->type = TOKEN_COMMA;
+		c++;
+		break;
+	case C_QUOTE:
+	{
+		const unsigned char* n = c + 1;
+		while (*n != '\"' && *n != '\n' && *n)
+			n++;
+		if (*n != '\"')
+			token_error(l, t->line, "unterminated string");
+		t->type = TOKEN_STRING;
+		t->ptr = (const char*)c + 1;
+		c = n + 1;
+		break;
+	}
+	default:
+		token_error(l, t->line, "unexpected character");
+	}
+	t->len = (int)((const char*)c - t->ptr) - (t->type == TOKEN_STRING ? 1 : 0);
+	l->c = (char*)c;
 }
 
-static bool expect(struct lexer* l, int offset, char c)
+static bool token_is(struct token* t, const char* word, int len)
 {
-	return *(l->c + offset) == c;
+	return t->type == TOKEN_NAME && t->len == len && memcmp(t->ptr, word, len) == 0;
 }
 
-static bool expect_space(struct lexer* l, int offset)
+//每个词长度不能超过64
+static void token_name(struct lexer* l, struct token* t, char* name)
 {
-	return isspace(*(l->c + offset));
+	if (t->len > 64)
+	{
+		fprintf(stderr, "%s@line:%d syntax error:name:%.*s too long\n", l->file, t->line, t->len, t->ptr);
+		THROW(l);
+	}
+	memcpy(name, t->ptr, t->len);
+	name[t->len] = '\0';
 }
 
 void lexer_parse(struct lexer* l, struct protocol* parent);
 
-int lexer_parse_file(struct lexer* l, const char* file)
+int lexer_parse_buffer(struct lexer* l, const char* file, char* buffer)
 {
-	FILE *file_handle = fopen(file, "r");
-	fseek(file_handle, 0, SEEK_END);
-	int len = ftell(file_handle);
-	l->c = (char*)malloc(len + 1);
-	memset(l->c, 0, len + 1);
-	rewind(file_handle);
-	fread(l->c, 1, len, file_handle);
-	l->c[len] = 0;
-	fclose(file_handle);
-
+	//跳过utf8 bom，逐字节比较，空文件只有结尾的'\0'
+	if (buffer[0] == '\xef' && buffer[1] == '\xbb' && buffer[2] == '\xbf')
+		buffer += 3;
+	l->c = buffer;
 	l->line = 1;
-	l->file = (char*)malloc(strlen(file) + 1);
-	memcpy(l->file, file, strlen(file));
-	l->file[strlen(file)] = '\0';
+	l->file = arena_strdup(l->root->arena, file);
 
 	TRY(l) {
-		while (!eos(l, 0))
+		while (*l->c)
 		{
 			lexer_parse(l, l->root);
 		}
-		parse_done(l->main, (char*)file);
 		return 0;
 	}
 	return -1;
 }
 
-struct protocol* protobol_begin(struct protocol_table* table,const char* file, const char* name)
+int lexer_parse_file(struct lexer* l, const char* file)
+{
+	char* buffer = lexer_load(l->main, file, NULL);
+	if (buffer == NULL)
+		return -1;
+
+	if (lexer_parse_buffer(l, file, buffer) < 0)
+		return -1;
+	parse_done(l->main, file);
+	return 0;
+}
+
+struct protocol* protobol_begin(struct protocol* parent,const char* file, const char* name)
 {
 	//printf("protobol_begin:%s\n", name);
-	struct protocol* ptl = create_protocol(file,name);
-	add_protocol(table, ptl);
+	struct protocol* ptl = create_protocol(parent->arena,file,name);
+	add_protocol(parent->children, ptl);
 	return ptl;
 }
 
@@ -485,21 +684,15 @@ void protobol_over(struct protocol_table* table)
 void field_begin(struct protocol* ptl, const char* field_type)
 {
 	//printf("field_begin:%s\n", field_type);
-	int len = strlen(field_type);
-	ptl->lastfield = (char*)malloc(len + 1);
-	memcpy(ptl->lastfield, field_type, len);
-	ptl->lastfield[len] = '\0';
+	ptl->lastfield = arena_strdup(ptl->arena, field_type);
 }
 
-void field_over(struct protocol* ptl,int isarray, const char* field_name)
+void field_over(struct protocol* ptl,int isarray, const char* field_name, int tag)
 {
 	//printf("field_over:%s\n", field_name);
-	int len = strlen(field_name);
-	char* fname = (char*)malloc(len + 1);
-	memcpy(fname, field_name, len);
-	fname[len] = '\0';
+	char* fname = arena_strdup(ptl->arena, field_name);
 
-	struct field* f = create_field(ptl,isarray, ptl->lastfield, fname);
+	struct field* f = create_field(ptl,isarray, ptl->lastfield, fname, tag);
 	add_field(ptl, f);
 
 	ptl->lastfield = NULL;
@@ -507,12 +700,8 @@ void field_over(struct protocol* ptl,int isarray, const char* field_name)
 
 void lexer_parse(struct lexer* l, struct protocol* parent);
 
-void import_protocol(struct lexer* l,char* name)
+void import_protocol(struct lexer* l,const char* file)
 {
-	char file[64];
-	memset(file, 0, 64);
-	sprintf(file, "%s.protocol", name);
-
 	struct lexer import_lexer;
 	lexer_init(&import_lexer, l->main->root, protobol_begin, protobol_over, field_begin, field_over);
 	import_lexer.main = l->main;
@@ -522,223 +711,336 @@ void import_protocol(struct lexer* l,char* name)
 	}
 }
 
-void parse_protocol(struct lexer* l, struct protocol* parent)
+//枚举：enum Color { red green 5 blue }，枚举值可以显式指定，否则为上一项加1，第一项默认为0。
+//枚举与协议共用名字空间和作用域规则，枚举项作为字段保存，tag为枚举值
+void parse_enum(struct lexer* l, struct protocol* parent)
 {
+	struct token t;
 	char name[65];
-	memset(name, 0, 65);
 
-	next_token(l);
+	lexer_scan(l, &t);
+	if (t.type != TOKEN_NAME)
+		token_error(l, t.line, "expect enum name");
+	token_name(l, &t, name);
+
+	struct protocol* optl = query_protocol(parent->children, name);
+	if (optl) {
+		fprintf(stderr, "%s@line:%d syntax error:enum name:%s already define in file:%s\n", l->file, t.line, name, optl->file);
+		THROW(l);
+	}
+
+	struct protocol* e = l->cb.protocol_begin(parent, l->file, name);
+	e->parent = parent;
+	e->isenum = 1;
+
+	lexer_scan(l, &t);
+	if (t.type != TOKEN_LBRACE)
+		token_error(l, t.line, "expect {");
+
+	long long value = 0;
+	for (;;)
+	{
+		lexer_scan(l, &t);
+		if (t.type == TOKEN_RBRACE)
+		{
+			l->cb.protocol_over(parent->children);
+			break;
+		}
+		if (t.type != TOKEN_NAME)
+			token_error(l, t.line, t.type == TOKEN_EOF ? "expect }" : "expect enum item");
+		token_name(l, &t, name);
+
+		struct token n;
+		char* c = l->c;
+		int line = l->line;
+		lexer_scan(l, &n);
+		if (n.type == TOKEN_NUMBER)
+		{
+			value = n.len <= 10 ? strtoll(n.ptr, NULL, 10) : -1;
+		}
+		else
+		{
+			l->c = c;
+			l->line = line;
+		}
+		if (value < 0 || value > ENUM_VALUE_MAX)
+		{
+			fprintf(stderr, "%s@line:%d syntax error:enum %s item %s value out of range\n", l->file, t.line, e->name, name);
+			THROW(l);
+		}
+		for (int i = 0; i < e->size; i++)
+		{
+			if (strcmp(e->field[i]->name, name) == 0 || e->field[i]->tag == value)
+			{
+				fprintf(stderr, "%s@line:%d syntax error:enum %s item %s conflicts with %s\n", l->file, t.line, e->name, name, e->field[i]->name);
+				THROW(l);
+			}
+		}
+
+		l->cb.field_begin(e, "int");
+		l->cb.field_over(e, 0, name, (int)value);
+		value++;
+	}
+}
 
-	int err = sscanf(l->c, "%64[1-9a-zA-Z_]", name);
-	int len = strlen(name);
+//map<K,V>：键为整数类型(不含bool和枚举)或string，值为标量类型、枚举或协议，不能是数组。
+//后面不是<时返回false，map作为普通的类型名处理
+static bool parse_map(struct lexer* l, struct protocol* ptl, char* type)
+{
+	struct token t;
+	char key[65];
+	char value[65];
+	char* c = l->c;
+	int line = l->line;
+	lexer_scan(l, &t);
+	if (t.type != TOKEN_LANGLE)
+	{
+		l->c = c;
+		l->line = line;
+		return false;
+	}
 
-	//协议名不能超过64
-	if (!expect_space(l, len) && !expect(l, len, '{'))
+	lexer_scan(l, &t);
+	if (t.type != TOKEN_NAME)
+		token_error(l, t.line, "expect map key type");
+	token_name(l, &t, key);
+	int index = builtin_index(key);
+	if (index < 0 || (index != TYPE_STRING && !type_integer(index)) || (index & 1))
 	{
-		fprintf(stderr, "%s@line:%d syntax error:protocol name:%s too long\n", l->file, l->line, name);
+		fprintf(stderr, "%s@line:%d syntax error:map key type:%s must be integer or string\n", l->file, t.line, key);
 		THROW(l);
 	}
 
-	struct protocol* optl = query_protocol(parent->children,name);
-	if (optl) {
-		fprintf(stderr, "%s@line:%d syntax error:protocol name:%s already define in file:%s\n", l->file, l->line, name,optl->file);
+	lexer_scan(l, &t);
+	if (t.type != TOKEN_COMMA)
+		token_error(l, t.line, "expect ,");
+	lexer_scan(l, &t);
+	if (t.type != TOKEN_NAME)
+		token_error(l, t.line, "expect map value type");
+	token_name(l, &t, value);
+	if (builtin_index(value) < 0 && scope_protocol(ptl, value) == NULL)
+	{
+		fprintf(stderr, "%s@line:%d syntax error:unknown type:%s\n", l->file, t.line, value);
 		THROW(l);
 	}
 
-	struct protocol* ptl = l->cb.protocol_begin(parent->children, l->file, name);
-	ptl->parent = parent;
+	lexer_scan(l, &t);
+	if (t.type == TOKEN_ARRAY || t.type == TOKEN_FIXED)
+		token_error(l, t.line, "map value can not be array");
+	if (t.type != TOKEN_RANGLE)
+		token_error(l, t.line, "expect >");
+	sprintf(type, "map<%s,%s>", key, value);
+	return true;
+}
 
-	//跳过协议名
-	skip(l, len);
+void parse_protocol(struct lexer* l, struct protocol* parent)
+{
+	struct token t;
+	char name[65];
 
-	//跳过空格
-	skip_space(l);
+	lexer_scan(l, &t);
+	if (t.type != TOKEN_NAME)
+		token_error(l, t.line, "expect protocol name");
+	token_name(l, &t, name);
 
-	//协议名后有>=0个空格，空格之后必须是{
-	if (!expect(l, 0, '{'))
-	{
-		fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
+	struct protocol* optl = query_protocol(parent->children,name);
+	if (optl) {
+		fprintf(stderr, "%s@line:%d syntax error:protocol name:%s already define in file:%s\n", l->file, t.line, name,optl->file);
 		THROW(l);
 	}
 
-	//{之后必有空格
-	if (!expect_space(l, 1))
+	struct protocol* ptl = l->cb.protocol_begin(parent, l->file, name);
+	ptl->parent = parent;
+
+	//可选的显式id：protocol name 1001 { ... }
+	lexer_scan(l, &t);
+	if (t.type == TOKEN_NUMBER)
 	{
-		fprintf(stderr, "file:%s@line:%d syntax error:expect space\n", l->file, l->line);
-		THROW(l);
+		long id = t.len <= 5 ? strtol(t.ptr, NULL, 10) : 0;
+		if (id <= 0 || id > PROTOCOL_ID_MAX)
+		{
+			fprintf(stderr, "%s@line:%d syntax error:protocol id:%.*s out of range\n", l->file, t.line, t.len, t.ptr);
+			THROW(l);
+		}
+		ptl->id = (int)id;
+		lexer_scan(l, &t);
 	}
-	while (!eos(l,0))
-	{
-		next_token(l);
+	if (t.type != TOKEN_LBRACE)
+		token_error(l, t.line, "expect {");
 
-	__again:
-		if (expect(l, 0, '}'))
+	for (;;)
+	{
+		lexer_scan(l, &t);
+		if (t.type == TOKEN_RBRACE)
 		{
-			if (!eos(l,1) && !expect_space(l, 1))
-			{
-				fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
-				THROW(l);
-			}
 			l->cb.protocol_over(parent->children);
-			next_token(l);
 			break;
 		}
-		memset(name, 0, 65);
-		err = sscanf(l->c, "%64s", name);
-		if (err == 0)
-		{
-			fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
-			THROW(l);
-		}
-		int len = strlen(name);
+		if (t.type != TOKEN_NAME)
+			token_error(l, t.line, t.type == TOKEN_EOF ? "expect }" : "expect field type");
 
-		if (memcmp(name, "protocol", len) == 0)
+		if (token_is(&t, "protocol", 8))
 		{
 			parse_protocol(l, ptl);
-			if (expect_space(l, 0))
-				continue;
-			else
-				goto __again;
+			continue;
+		}
+		if (token_is(&t, "enum", 4))
+		{
+			parse_enum(l, ptl);
+			continue;
 		}
 
+		//字段类型，内置数组类型以int[]形式传给回调，协议数组以isarray标记。
+		//定长数组带上长度，如int[4]、Item[4]；map以map<int,Item>形式传给回调
+		char type[140];
 		int isarray = 0;
-		bool builtin = false;
-		for (int i = 0; i < sizeof(builtin_type) / sizeof(void*); i++)
+		struct token n;
+		if (token_is(&t, "map", 3) && parse_map(l, ptl, type))
 		{
-			if (memcmp(name, builtin_type[i], len) == 0)
-			{
-				builtin = true;
-				if (i%2 == 1)
-					isarray = 1;
-				break;
-			}
+			lexer_scan(l, &n);
+			if (n.type == TOKEN_ARRAY || n.type == TOKEN_FIXED)
+				token_error(l, n.line, "map can not be array");
 		}
-
-		
-		if (!builtin)
+		else
 		{
-			char tmp[65];
-			memset(tmp, 0, 65);
-			err = sscanf(name, "%64[0-9a-zA-Z_]", tmp);
-			if (err == 0)
+			token_name(l, &t, type);
+			bool builtin = builtin_index(type) >= 0;
+			if (!builtin && scope_protocol(ptl, type) == NULL)
 			{
-				fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
+				fprintf(stderr, "%s@line:%d syntax error:unknown type:%s\n", l->file, t.line, type);
 				THROW(l);
 			}
 
-			if (expect(l, strlen(tmp), '[') && expect(l, strlen(tmp)+1, ']'))
-				isarray = 1;
-
-			struct protocol* cursor = ptl;
-			struct protocol* protocol = NULL;
-			while (cursor)
+			lexer_scan(l, &n);
+			if (n.type == TOKEN_ARRAY)
 			{
-				protocol = query_protocol(cursor->children, tmp);
-				if (protocol != NULL)
-					break;
-				cursor = cursor->parent;
+				isarray = 1;
+				lexer_scan(l, &n);
+				if (builtin)
+					memcpy(type + t.len, "[]", 3);
 			}
-			if (protocol == NULL)
+			else if (n.type == TOKEN_FIXED)
 			{
-				fprintf(stderr, "%s@line:%d syntax error:unknown type:%s\n", l->file, l->line, tmp);
-				THROW(l);
+				long size = n.len <= 7 ? strtol(n.ptr + 1, NULL, 10) : 0;
+				if (size <= 0 || size > FIXED_ARRAY_MAX)
+				{
+					fprintf(stderr, "%s@line:%d syntax error:array size:%.*s out of range\n", l->file, n.line, n.len, n.ptr);
+					THROW(l);
+				}
+				isarray = 1;
+				sprintf(type + t.len, "[%ld]", size);
+				lexer_scan(l, &n);
 			}
-			
-			memcpy(name, tmp, strlen(tmp));
-			name[strlen(tmp)] = '\0';
 		}
 
-		if (expect_space(l,len) == 0)
-		{
-			fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
-			THROW(l);
-		}
+		if (n.type != TOKEN_NAME)
+			token_error(l, n.line, "expect field name");
+		token_name(l, &n, name);
 
-		l->cb.field_begin(ptl, name);
-		
-		next_token(l);
-		memset(name, 0, 65);
-		err = sscanf(l->c, "%64[1-9a-zA-Z_]", name);
-		if (err == 0)
+		//可选的字段标签：int hp 1，带标签的字段为可选字段，旧版本解码时可以跳过不认识的标签
+		int tag = 0;
+		char* c = l->c;
+		int line = l->line;
+		lexer_scan(l, &n);
+		if (n.type == TOKEN_NUMBER)
 		{
-			fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
-			THROW(l);
+			long value = n.len <= 9 ? strtol(n.ptr, NULL, 10) : 0;
+			if (value <= 0 || value > FIELD_TAG_MAX)
+			{
+				fprintf(stderr, "%s@line:%d syntax error:field tag:%.*s out of range\n", l->file, n.line, n.len, n.ptr);
+				THROW(l);
+			}
+			tag = (int)value;
+			for (int i = 0; i < ptl->size; i++)
+			{
+				if (ptl->field[i]->tag == tag)
+				{
+					fprintf(stderr, "%s@line:%d syntax error:field tag:%d already used by %s\n", l->file, n.line, tag, ptl->field[i]->name);
+					THROW(l);
+				}
+			}
 		}
-		len = strlen(name);
-		l->cb.field_over(ptl, isarray, name);
-		
-		//每一个字段名之后，必有空格
-		if (!expect_space(l, len))
+		else
 		{
-			fprintf(stderr, "%s@line:%d syntax error:expect space\n",l->file, l->line);
-			THROW(l);
+			l->c = c;
+			l->line = line;
 		}
+
+		l->cb.field_begin(ptl, type);
+		l->cb.field_over(ptl, isarray, name, tag);
 	}
 }
 
 void lexer_parse(struct lexer* l, struct protocol* parent)
 {
-	skip_space(l);
-	char name[65];
-	memset(name, 0, 65);
-
-	int err = sscanf(l->c, "%64[1-9a-zA-Z]", name);
-	if (err == 0) {
-		fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
-		THROW(l);
-	}
+	struct token t;
+	lexer_scan(l, &t);
+	if (t.type == TOKEN_EOF)
+		return;
 
-	int len = strlen(name);
-	if (memcmp(name, "protocol", len) == 0)
+	if (token_is(&t, "protocol", 8))
 	{
 		return parse_protocol(l, parent);
-	
 	}
-	else if (memcmp(name, "import", len) == 0)
+	else if (token_is(&t, "enum", 4))
 	{
-		if (!expect_space(l, len) && !expect(l, len, '\"'))
-		{
-			fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
-			THROW(l);
-		}
-
-		if (expect_space(l, len))
-			next_token(l);
-		else
-			skip(l, len);
-		
-		if (!expect(l,0,'\"'))
-		{
-			fprintf(stderr, "%s@line:%d syntax error:expect \"\n", l->file, l->line);
-			THROW(l);
-		}
-		err = sscanf(l->c, "\"%64[^\"]\"", name);
-		if (err == 0) {
-			fprintf(stderr, "%s@line:%d syntax error\n", l->file, l->line);
-			THROW(l);
-		}
-
-		if (exist_file(l->main, name) == false)
-			import_protocol(l, name);
-
-		skip(l, strlen(name) + 2);
-		if (!expect_space(l, 0))
-		{
-			fprintf(stderr, "%s@line:%d syntax error:expect space\n",l->file, l->line);
-			THROW(l);
-		}
+		return parse_enum(l, parent);
+	}
+	else if (token_is(&t, "import", 6))
+	{
+		lexer_scan(l, &t);
+		if (t.type != TOKEN_STRING)
+			token_error(l, t.line, "expect \"");
+
+		char file[80];
+		token_name(l, &t, file);
+		memcpy(file + t.len, ".protocol", 10);
+		if (exist_file(l->main, file) == false)
+			import_protocol(l, file);
 		return;
 	}
-	fprintf(stderr, "%s@line:%d syntax error:unknown %s\n", l->file, l->line, name);
+	fprintf(stderr, "%s@line:%d syntax error:unknown %.*s\n", l->file, t.line, t.len, t.ptr);
 	THROW(l);
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
-	struct lexer l;
-	lexer_init(&l, NULL, protobol_begin, protobol_over, field_begin, field_over);
-	l.main = &l;
-	lexer_parse_file(&l, "test.protocol");
-	dump_protocol(l.root,0);
-}
\ No newline at end of file
+	const char* file = "test.protocol";
+	const char* lua_output = NULL;
+	const char* cache = NULL;
+	int threads = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-lua") == 0 && i + 1 < argc)
+			lua_output = argv[++i];
+		else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+			cache = argv[++i];
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-bench-lexer") == 0)
+			return bench_lexer(10000, 10) < 0 ? 1 : 0;
+		else if (strcmp(argv[i], "-bench-codec") == 0)
+			return bench_codec(i + 1 < argc ? atoi(argv[i + 1]) : 1000000) < 0 ? 1 : 0;
+		else if (strcmp(argv[i], "-bench-encoder") == 0)
+			return bench_encoder(i + 1 < argc ? atoi(argv[i + 1]) : 1000000) < 0 ? 1 : 0;
+		else if (strcmp(argv[i], "-bench-utf8") == 0)
+			return bench_utf8(i + 1 < argc ? atoi(argv[i + 1]) : 10000) < 0 ? 1 : 0;
+		else if (strcmp(argv[i], "-bench-offset") == 0)
+			return bench_offset(i + 1 < argc ? atoi(argv[i + 1]) : 100000) < 0 ? 1 : 0;
+		else
+			file = argv[i];
+	}
+
+	struct protocol* root = protocol_load(file, cache, threads, NULL);
+	if (root == NULL)
+		return 1;
+
+	int ret = 0;
+	if (lua_output)
+		ret = gen_lua(root, lua_output) < 0 ? 1 : 0;
+	else
+		dump_protocol(root,0);
+	release_protocol(root);
+	return ret;
+}
@@ -0,0 +1,390 @@
+#include <assert.h>
+#include <string.h>
+
+#include "offset.h"
+
+#define OFFSET_MAX 0xffffffffu
+
+size_t offset_begin(struct write_buffer* buffer, size_t n)
+{
+	buffer_reserve(buffer, 4 + 4 * n);
+	size_t table = buffer->offset;
+	wire_put_uint32(buffer, (unsigned int)n);
+	memset(buffer->ptr + buffer->offset, 0, 4 * n);
+	buffer->offset += 4 * n;
+	return table;
+}
+
+int offset_set(struct write_buffer* buffer, size_t table, size_t i)
+{
+	size_t offset = buffer->offset - table;
+	if (offset > OFFSET_MAX)
+		return -1;
+	unsigned char* ptr = (unsigned char*)buffer->ptr + table + 4 + 4 * i;
+	ptr[0] = offset & 0xff;
+	ptr[1] = (offset >> 8) & 0xff;
+	ptr[2] = (offset >> 16) & 0xff;
+	ptr[3] = (offset >> 24) & 0xff;
+	return 0;
+}
+
+void offset_write_uint32(struct write_buffer* buffer, unsigned int value)
+{
+	buffer_reserve(buffer, 4);
+	wire_put_uint32(buffer, value);
+}
+
+void offset_write_integer(struct write_buffer* buffer, int type, unsigned long long value)
+{
+	size_t width = offset_width(type);
+	buffer_reserve(buffer, width);
+	for (size_t i = 0; i < width; i++)
+		buffer->ptr[buffer->offset++] = (char)(value >> (i * 8));
+}
+
+unsigned long long offset_load_integer(const char* ptr, int type)
+{
+	const unsigned char* p = (const unsigned char*)ptr;
+	size_t width = offset_width(type);
+	unsigned long long value = 0;
+	for (size_t i = 0; i < width; i++)
+		value |= (unsigned long long)p[i] << (i * 8);
+	if (type_signed(type) && width < 8 && (value >> (width * 8 - 1)))
+		value |= ~0ULL << (width * 8);
+	return value;
+}
+
+static void put_string(struct write_buffer* buffer, const struct snapshot_value* v)
+{
+	offset_write_uint32(buffer, (unsigned int)v->count);
+	buffer_addlstring(buffer, v->count ? v->u.str : "", v->count);
+}
+
+static int put_offset_protocol(struct write_buffer* buffer, struct protocol* ptl, const struct snapshot_value* values, int depth);
+
+static int put_offset_value(struct write_buffer* buffer, struct field* f, const struct snapshot_value* v, int depth)
+{
+	if (f->field_type.size && v->count != (size_t)f->field_type.size)
+		return -1;
+	switch (f->field_type.type)
+	{
+	case TYPE_INT:
+		offset_write_uint32(buffer, (unsigned int)v->u.i);
+		break;
+	case TYPE_FLOAT:
+		wire_write_float(buffer, v->u.f);
+		break;
+	case TYPE_DOUBLE:
+		wire_write_double(buffer, v->u.d);
+		break;
+	case TYPE_STRING:
+		put_string(buffer, v);
+		break;
+	case TYPE_INT_ARRAY:
+		offset_write_uint32(buffer, (unsigned int)v->count);
+		buffer_reserve(buffer, 4 * v->count);
+		for (size_t i = 0; i < v->count; i++)
+			wire_put_uint32(buffer, (unsigned int)v->u.ints[i]);
+		break;
+	case TYPE_FLOAT_ARRAY:
+		offset_write_uint32(buffer, (unsigned int)v->count);
+		buffer_reserve(buffer, sizeof(float) * v->count);
+		for (size_t i = 0; i < v->count; i++)
+			wire_put_float(buffer, v->u.floats[i]);
+		break;
+	case TYPE_DOUBLE_ARRAY:
+		offset_write_uint32(buffer, (unsigned int)v->count);
+		buffer_reserve(buffer, sizeof(double) * v->count);
+		for (size_t i = 0; i < v->count; i++)
+			wire_put_double(buffer, v->u.doubles[i]);
+		break;
+	case TYPE_STRING_ARRAY:
+	{
+		size_t table = offset_begin(buffer, v->count);
+		for (size_t i = 0; i < v->count; i++)
+		{
+			if (offset_set(buffer, table, i) < 0)
+				return -1;
+			put_string(buffer, &v->u.values[i]);
+		}
+		break;
+	}
+	case TYPE_PROTOCOL:
+	{
+		if (!f->field_type.isarray)
+			return put_offset_protocol(buffer, f->field_type.protocol, v->u.values, depth + 1);
+		size_t table = offset_begin(buffer, v->count);
+		for (size_t i = 0; i < v->count; i++)
+		{
+			if (offset_set(buffer, table, i) < 0 || put_offset_protocol(buffer, f->field_type.protocol, v->u.values[i].u.values, depth + 1) < 0)
+				return -1;
+		}
+		break;
+	}
+	case TYPE_BOOL:
+		offset_write_integer(buffer, TYPE_BOOL, v->u.b);
+		break;
+	case TYPE_BOOL_ARRAY:
+		offset_write_uint32(buffer, (unsigned int)v->count);
+		for (size_t i = 0; i < v->count; i++)
+			offset_write_integer(buffer, TYPE_BOOL, v->u.bools[i]);
+		break;
+	default:
+	{
+		//扩展整数超出类型的范围时编码失败
+		int type = f->field_type.type;
+		if (!type_integer(type))
+			return -1;
+		if ((type & 1) == 0)
+		{
+			if (!wire_integer_fits(type, snapshot_integer(type, v)))
+				return -1;
+			offset_write_integer(buffer, type, snapshot_integer(type, v));
+			break;
+		}
+		const unsigned long long* values = snapshot_integers(type, v);
+		offset_write_uint32(buffer, (unsigned int)v->count);
+		for (size_t i = 0; i < v->count; i++)
+		{
+			if (!wire_integer_fits(type, values[i]))
+				return -1;
+			offset_write_integer(buffer, type, values[i]);
+		}
+		break;
+	}
+	}
+	return 0;
+}
+
+static int put_offset_protocol(struct write_buffer* buffer, struct protocol* ptl, const struct snapshot_value* values, int depth)
+{
+	if (depth > OFFSET_MAX_DEPTH || values == NULL)
+		return -1;
+	size_t table = offset_begin(buffer, ptl->size);
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag ? !values[i].present : !snapshot_present(f, &values[i]))
+			continue;
+		if (offset_set(buffer, table, i) < 0 || put_offset_value(buffer, f, &values[i], depth) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int encode_offset_snapshot(void* ud, struct protocol* ptl, struct write_buffer* buffer)
+{
+	const struct snapshot_value* v = (const struct snapshot_value*)ud;
+	size_t begin = buffer->offset;
+	if (put_offset_protocol(buffer, ptl, v ? v->u.values : NULL, 0) < 0)
+		return -1;
+	//定长数组没有经过偏移表，整条消息的长度在这里检查
+	return buffer->offset - begin > OFFSET_MAX ? -1 : 0;
+}
+
+//偏移表开头的个数和之后的n项偏移都在数据之内
+static bool check_table(const char* data, const char* end, size_t* n)
+{
+	size_t size = end - data;
+	if (size < 4)
+		return false;
+	*n = offset_load(data);
+	return *n <= (size - 4) / 4;
+}
+
+//偏移表table第i项指向的位置，之后至少有need字节
+static const char* table_item(const char* table, const char* end, size_t i, size_t need)
+{
+	size_t offset = offset_load(table + 4 + 4 * i);
+	size_t size = end - table;
+	if (offset == 0 || offset > size || need > size - offset)
+		return NULL;
+	return table + offset;
+}
+
+static string_ref load_string(const char* ptr, const char* end)
+{
+	string_ref value = { "", 0 };
+	if (ptr == NULL)
+		return value;
+	size_t len = offset_load(ptr);
+	if (len <= (size_t)(end - ptr) - 4)
+	{
+		value.ptr = ptr + 4;
+		value.len = len;
+	}
+	return value;
+}
+
+offset_view decode_offset_view(struct protocol* ptl, const char* data, size_t size)
+{
+	size_t n;
+	if (data == NULL || !check_table(data, data + size, &n))
+		return offset_view();
+	return offset_view(ptl, data, data + size);
+}
+
+offset_view::offset_view(struct protocol* ptl, const char* data, const char* end)
+	: ptl_(ptl), data_(data), end_(end), count_(offset_load(data))
+{
+}
+
+int offset_view::field_index(const char* name) const
+{
+	for (int i = 0; i < ptl_->size; i++)
+	{
+		if (strcmp(ptl_->field[i]->name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+bool offset_view::has(int index) const
+{
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	return locate(index, ptl_->field[index]->field_type.type, 0) != NULL;
+}
+
+//旧数据的字段个数可能少于当前协议，多出的字段按不存在处理
+const char* offset_view::locate(int index, int type, size_t need) const
+{
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	assert(ptl_->field[index]->field_type.type == type);
+	if ((size_t)index >= count_)
+		return NULL;
+	return table_item(data_, end_, index, need);
+}
+
+const char* offset_view::locate_array(int index, int type, size_t element, size_t* count) const
+{
+	const char* ptr = locate(index, type, 4);
+	if (ptr == NULL)
+		return NULL;
+	size_t n = offset_load(ptr);
+	if (n > (size_t)(end_ - ptr - 4) / element)
+		return NULL;
+	*count = n;
+	return ptr + 4;
+}
+
+int offset_view::get_int(int index) const
+{
+	const char* ptr = locate(index, TYPE_INT, 4);
+	return ptr ? view_load<int>(ptr) : 0;
+}
+
+float offset_view::get_float(int index) const
+{
+	const char* ptr = locate(index, TYPE_FLOAT, sizeof(float));
+	return ptr ? view_load<float>(ptr) : 0;
+}
+
+double offset_view::get_double(int index) const
+{
+	const char* ptr = locate(index, TYPE_DOUBLE, sizeof(double));
+	return ptr ? view_load<double>(ptr) : 0;
+}
+
+string_ref offset_view::get_string(int index) const
+{
+	return load_string(locate(index, TYPE_STRING, 4), end_);
+}
+
+bool offset_view::get_bool(int index) const
+{
+	const char* ptr = locate(index, TYPE_BOOL, 1);
+	return ptr && *ptr != 0;
+}
+
+long long offset_view::get_int64(int index) const
+{
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	int type = ptl_->field[index]->field_type.type;
+	assert(type_integer(type) && type_signed(type) && (type & 1) == 0);
+	const char* ptr = locate(index, type, offset_width(type));
+	return ptr ? (long long)offset_load_integer(ptr, type) : 0;
+}
+
+unsigned long long offset_view::get_uint64(int index) const
+{
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	int type = ptl_->field[index]->field_type.type;
+	assert(type_integer(type) && !type_signed(type) && (type & 1) == 0);
+	const char* ptr = locate(index, type, offset_width(type));
+	return ptr ? offset_load_integer(ptr, type) : 0;
+}
+
+array_view<int> offset_view::get_int_array(int index) const
+{
+	size_t count;
+	const char* data = locate_array(index, TYPE_INT_ARRAY, sizeof(int), &count);
+	return data ? array_view<int>(data, count) : array_view<int>();
+}
+
+array_view<float> offset_view::get_float_array(int index) const
+{
+	size_t count;
+	const char* data = locate_array(index, TYPE_FLOAT_ARRAY, sizeof(float), &count);
+	return data ? array_view<float>(data, count) : array_view<float>();
+}
+
+array_view<double> offset_view::get_double_array(int index) const
+{
+	size_t count;
+	const char* data = locate_array(index, TYPE_DOUBLE_ARRAY, sizeof(double), &count);
+	return data ? array_view<double>(data, count) : array_view<double>();
+}
+
+//元素的偏移表与定长数组一样是个数之后的4字节数组，偏移相对于个数所在的位置
+offset_string_array offset_view::get_string_array(int index) const
+{
+	size_t count;
+	const char* data = locate_array(index, TYPE_STRING_ARRAY, 4, &count);
+	return data ? offset_string_array(data - 4, end_, count) : offset_string_array();
+}
+
+offset_integer_array offset_view::get_integer_array(int index) const
+{
+	size_t count;
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	int type = ptl_->field[index]->field_type.type;
+	assert((type_integer(type) || type == TYPE_BOOL_ARRAY) && (type & 1));
+	const char* data = locate_array(index, type, offset_width(type), &count);
+	return data ? offset_integer_array(data, count, type) : offset_integer_array();
+}
+
+offset_view offset_view::get_message(int index) const
+{
+	if (ptl_->field[index]->field_type.isarray)
+		return offset_view();
+	const char* ptr = locate(index, TYPE_PROTOCOL, 4);
+	if (ptr == NULL)
+		return offset_view();
+	return decode_offset_view(ptl_->field[index]->field_type.protocol, ptr, end_ - ptr);
+}
+
+offset_message_array offset_view::get_message_array(int index) const
+{
+	size_t count;
+	if (!ptl_->field[index]->field_type.isarray)
+		return offset_message_array();
+	const char* data = locate_array(index, TYPE_PROTOCOL, 4, &count);
+	if (data == NULL)
+		return offset_message_array();
+	return offset_message_array(ptl_->field[index]->field_type.protocol, data - 4, end_, count);
+}
+
+string_ref offset_string_array::operator[](size_t i) const
+{
+	if (i >= size_)
+		return load_string(NULL, end_);
+	return load_string(table_item(data_, end_, i, 4), end_);
+}
+
+offset_view offset_message_array::operator[](size_t i) const
+{
+	const char* ptr = i < size_ ? table_item(data_, end_, i, 4) : NULL;
+	if (ptr == NULL)
+		return offset_view();
+	return decode_offset_view(ptl_, ptr, end_ - ptr);
+}
@@ -0,0 +1,163 @@
+#ifndef OFFSET_H
+#define OFFSET_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+#include "wire.h"
+#include "view.h"
+#include "encoder.h"
+
+//偏移表格式：用于很大的快照消息，读取端可以直接跳到第N个字段或数组的第K个元素，不需要先解码前面的内容。
+//与紧凑格式不兼容，也没有存在位图和可选字段的key，双方必须约定使用哪种格式。
+//所有整数为小端uint32/int32，偏移都相对于所在偏移表的开头：
+//  协议实例    uint32 字段个数n, uint32 偏移[n], 字段值...    偏移为0表示不存在(取默认值)，下标为字段的定义顺序
+//  int/float/double  定长4/4/8字节
+//  bool/int8/uint8为1字节，int16/uint16为2字节，uint32/枚举为4字节，int64/uint64为8字节
+//  string      uint32 长度, 字节
+//  int[]/float[]/double[]及扩展整数和bool的数组  uint32 个数, 定长元素
+//  string[]/协议数组  uint32 个数k, uint32 偏移[k], 元素...
+//定长数组与对应的数组相同(总是写入，个数为N)；map没有按下标定位的意义，不能用偏移表格式编码
+//字段按下标定位，新版本只能在协议末尾增加字段；旧数据的字段个数较少，多出的字段按不存在处理。
+//偏移为32位，单条消息不能超过4GB
+
+#define OFFSET_MAX_DEPTH 64
+
+//写入n个元素的偏移表，偏移先填0，返回偏移表的开头
+size_t offset_begin(struct write_buffer* buffer, size_t n);
+//把下一个值的位置(当前写入位置)填入偏移表table的第i项，超过4GB返回-1
+int offset_set(struct write_buffer* buffer, size_t table, size_t i);
+void offset_write_uint32(struct write_buffer* buffer, unsigned int value);
+
+inline unsigned int offset_load(const char* ptr)
+{
+	const unsigned char* p = (const unsigned char*)ptr;
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+//整数类型(type_integer)和bool的定长字节数
+inline size_t offset_width(int type)
+{
+	switch (type & ~1)
+	{
+	case TYPE_BOOL:
+	case TYPE_INT8:
+	case TYPE_UINT8:
+		return 1;
+	case TYPE_INT16:
+	case TYPE_UINT16:
+		return 2;
+	case TYPE_INT64:
+	case TYPE_UINT64:
+		return 8;
+	}
+	return 4;
+}
+
+void offset_write_integer(struct write_buffer* buffer, int type, unsigned long long value);
+//有符号类型做符号扩展
+unsigned long long offset_load_integer(const char* ptr, int type);
+
+//按快照编码为偏移表格式，可以作为encode_func提交给编码服务。
+//位置字段取默认值时同样不写入；可选字段present为0时不写入
+int encode_offset_snapshot(void* ud, struct protocol* ptl, struct write_buffer* buffer);
+
+//string[]和协议数组：个数和第k个元素都是常数时间
+class offset_string_array {
+public:
+	offset_string_array() : data_(NULL), end_(NULL), size_(0) {}
+	offset_string_array(const char* data, const char* end, size_t size) : data_(data), end_(end), size_(size) {}
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	//越界或数据损坏时返回空字符串
+	string_ref operator[](size_t i) const;
+
+private:
+	const char* data_;
+	const char* end_;
+	size_t size_;
+};
+
+//整数和bool的数组，元素按offset_load_integer读出，有符号类型转为long long即可
+class offset_integer_array {
+public:
+	offset_integer_array() : data_(NULL), size_(0), type_(TYPE_INT) {}
+	offset_integer_array(const char* data, size_t size, int type) : data_(data), size_(size), type_(type) {}
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	unsigned long long operator[](size_t i) const { return offset_load_integer(data_ + i * offset_width(type_), type_); }
+
+private:
+	const char* data_;
+	size_t size_;
+	int type_;
+};
+
+class offset_view;
+
+class offset_message_array {
+public:
+	offset_message_array() : ptl_(NULL), data_(NULL), end_(NULL), size_(0) {}
+	offset_message_array(struct protocol* ptl, const char* data, const char* end, size_t size) : ptl_(ptl), data_(data), end_(end), size_(size) {}
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	//越界或数据损坏时返回无效视图
+	offset_view operator[](size_t i) const;
+
+private:
+	struct protocol* ptl_;
+	const char* data_;
+	const char* end_;
+	size_t size_;
+};
+
+//偏移表格式的只读视图：不预先校验整个消息(那样就不是常数时间了)，
+//每次访问只检查用到的偏移和长度是否落在数据之内，数据损坏时返回默认值而不会越界读取
+class offset_view {
+public:
+	offset_view() : ptl_(NULL), data_(NULL), end_(NULL), count_(0) {}
+	offset_view(struct protocol* ptl, const char* data, const char* end);
+
+	bool valid() const { return ptl_ != NULL; }
+	struct protocol* protocol() const { return ptl_; }
+
+	int field_index(const char* name) const;
+	bool has(int index) const;
+
+	int get_int(int index) const;
+	float get_float(int index) const;
+	double get_double(int index) const;
+	string_ref get_string(int index) const;
+	bool get_bool(int index) const;
+	//int和int8~int64
+	long long get_int64(int index) const;
+	//无符号整数和枚举
+	unsigned long long get_uint64(int index) const;
+	array_view<int> get_int_array(int index) const;
+	array_view<float> get_float_array(int index) const;
+	array_view<double> get_double_array(int index) const;
+	offset_string_array get_string_array(int index) const;
+	//扩展整数、枚举和bool的数组
+	offset_integer_array get_integer_array(int index) const;
+	offset_view get_message(int index) const;
+	offset_message_array get_message_array(int index) const;
+
+private:
+	//字段值的位置，之后至少有need字节；字段不存在、类型不符或越界时返回NULL
+	const char* locate(int index, int type, size_t need) const;
+	//定长元素数组的个数和数据
+	const char* locate_array(int index, int type, size_t element, size_t* count) const;
+
+	struct protocol* ptl_;
+	const char* data_;
+	const char* end_;
+	size_t count_;
+};
+
+//只检查开头的偏移表，数据不足时返回无效视图
+offset_view decode_offset_view(struct protocol* ptl, const char* data, size_t size);
+
+#endif
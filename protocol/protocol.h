@@ -0,0 +1,281 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <setjmp.h>
+
+#define TRY(l) if (setjmp((l)->exception) == 0)
+#define THROW(l) longjmp((l)->exception, 1)
+
+#define TYPE_INT				0
+#define TYPE_INT_ARRAY			1
+#define TYPE_FLOAT				2
+#define TYPE_FLOAT_ARRAY		3
+#define TYPE_DOUBLE				4
+#define TYPE_DOUBLE_ARRAY		5
+#define TYPE_STRING				6
+#define TYPE_STRING_ARRAY		7
+#define TYPE_PROTOCOL			8
+//扩展标量，同样是偶数为标量、奇数为对应的数组
+#define TYPE_BOOL				10
+#define TYPE_BOOL_ARRAY			11
+#define TYPE_INT8				12
+#define TYPE_INT8_ARRAY			13
+#define TYPE_INT16				14
+#define TYPE_INT16_ARRAY		15
+#define TYPE_INT64				16
+#define TYPE_INT64_ARRAY		17
+#define TYPE_UINT8				18
+#define TYPE_UINT8_ARRAY		19
+#define TYPE_UINT16				20
+#define TYPE_UINT16_ARRAY		21
+#define TYPE_UINT32				22
+#define TYPE_UINT32_ARRAY		23
+#define TYPE_UINT64				24
+#define TYPE_UINT64_ARRAY		25
+//枚举，field_type.protocol指向枚举的定义
+#define TYPE_ENUM				26
+#define TYPE_ENUM_ARRAY			27
+//map<K,V>，键和值的类型在field_type.key/value中
+#define TYPE_MAP				28
+#define TYPE_MAX				30
+
+//整数类型：int、定长整数、无符号整数和枚举，数组类型同样适用
+inline bool type_integer(int type)
+{
+	int t = type & ~1;
+	return t == TYPE_INT || (t >= TYPE_INT8 && t <= TYPE_ENUM);
+}
+
+inline bool type_signed(int type)
+{
+	int t = type & ~1;
+	return t == TYPE_INT || t == TYPE_INT8 || t == TYPE_INT16 || t == TYPE_INT64;
+}
+
+#define TOKEN_EOF		0
+#define TOKEN_NAME		1
+#define TOKEN_STRING	2
+#define TOKEN_LBRACE	3
+#define TOKEN_RBRACE	4
+#define TOKEN_ARRAY		5
+#define TOKEN_NUMBER	6
+//[N]，定长数组
+#define TOKEN_FIXED		7
+#define TOKEN_LANGLE	8
+#define TOKEN_RANGLE	9
+#define TOKEN_COMMA		10
+
+//协议id为1~PROTOCOL_ID_MAX，0表示未分配
+#define PROTOCOL_ID_MAX	0xffff
+//字段标签为1~FIELD_TAG_MAX，0表示按位置编码的必选字段
+#define FIELD_TAG_MAX	0x0fffffff
+//枚举值为0~ENUM_VALUE_MAX
+#define ENUM_VALUE_MAX	0x7fffffff
+//定长数组T[N]的长度为1~FIXED_ARRAY_MAX
+#define FIXED_ARRAY_MAX	0xffff
+
+struct token {
+	int type;
+	const char* ptr;
+	int len;
+	int line;
+};
+
+struct field_type {
+	int type;
+	int isarray;
+	//协议、枚举或map的值为协议、枚举时指向其定义
+	struct protocol* protocol;
+	//定长数组的长度，变长数组和其他类型为0
+	int size;
+	//map的键类型(整数或string)和值类型(标量或协议)
+	int key;
+	int value;
+};
+
+struct field {
+	char* name;
+	int tag;
+	struct field_type field_type;
+};
+
+struct protocol_table;
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk* chunk;
+	size_t size;
+};
+
+struct protocol {
+	struct protocol* next;
+	struct protocol* parent;
+	struct protocol_table* children;
+
+	struct arena* arena;
+	char* file;
+	char* name;
+	int id;
+	struct field** field;
+	int cap;
+	int size;
+
+	char* lastfield;
+	//枚举与协议共用结构和作用域：字段为枚举项，tag为枚举值；枚举没有协议id
+	int isenum;
+};
+
+struct protocol_table {
+	struct protocol** slots;
+	int size;
+};
+
+typedef struct protocol* (*protocol_begin_func)(struct protocol* parent,const char* file, const char* name);
+typedef void(*protocol_over_func)(struct protocol_table* table);
+typedef void(*field_begin_func)(struct protocol* ptl,const char* field_type);
+typedef void(*field_over_func)(struct protocol* ptl,int isarray, const char* field_name, int tag);
+
+
+struct file_hash {
+	char** name;
+	int offset;
+	int size;
+
+	int* slots;
+	int slot_size;
+};
+
+struct source {
+	char* data;
+	size_t size;
+	int mapped;
+};
+
+//文件的import关系，file[i]依赖的文件为dep[offset[i]]~dep[offset[i+1]-1]，下标与file_hash一致
+struct import_graph {
+	int size;
+	char** file;
+	int* offset;
+	int* dep;
+};
+
+struct lexer_cb {
+	protocol_begin_func protocol_begin;
+	protocol_over_func protocol_over;
+	field_begin_func field_begin;
+	field_over_func field_over;
+};
+
+struct lexer {
+	char* c;
+	int line;
+	char* file;
+
+	struct lexer* main;
+
+	jmp_buf exception;
+	struct protocol* root;
+
+	struct file_hash file_hash;
+	struct source* source;
+	int source_cap;
+	//为1时源文件读入内存而不映射，见source_open
+	int copy_source;
+
+	//lexer_parse_files成功后记录，分配在root的arena中
+	struct import_graph* imports;
+
+	struct lexer_cb cb;
+};
+
+struct protocol* create_root();
+void release_protocol(struct protocol* root);
+struct protocol* create_protocol(struct arena* arena, const char* file,const char* name);
+struct protocol* query_protocol(struct protocol_table* table, const char* name);
+void add_protocol(struct protocol_table* table, struct protocol* protocol);
+struct field* query_field(struct protocol* protocol, const char* name);
+void protocol_fullname(struct protocol* ptl, char* buffer, size_t size);
+//位置字段(不带标签)的个数，即消息开头存在位图的位数
+int protocol_positional(struct protocol* ptl);
+//位置字段的嵌套协议不能构成环，需要在分配id之后检查
+int check_nested(struct protocol* root);
+//map的键和值当作两个位置字段描述，读写时复用字段的函数
+void map_entry(struct field* f, struct field* key, struct field* value);
+void dump_protocol(struct protocol* root,int depth);
+
+void lexer_init(struct lexer* l, struct protocol* root, protocol_begin_func ptl_begin, protocol_over_func ptl_over, field_begin_func field_begin, field_over_func field_over);
+int lexer_parse_file(struct lexer* l, const char* file);
+void lexer_scan(struct lexer* l, struct token* t);
+int lexer_parse_buffer(struct lexer* l, const char* file, char* buffer);
+int find_file(struct lexer* l, const char* file);
+bool exist_file(struct lexer* l, const char* file);
+int parse_done(struct lexer* l, const char* file);
+
+struct protocol* protobol_begin(struct protocol* parent,const char* file, const char* name);
+void protobol_over(struct protocol_table* table);
+void field_begin(struct protocol* ptl, const char* field_type);
+void field_over(struct protocol* ptl,int isarray, const char* field_name, int tag);
+
+//arena.cpp
+struct arena* arena_create();
+void* arena_alloc(struct arena* a, size_t size);
+char* arena_strdup(struct arena* a, const char* str);
+void arena_merge(struct arena* to, struct arena* from);
+void arena_release(struct arena* a);
+
+//source.cpp
+int source_open(struct source* s, const char* file, int copy);
+void source_close(struct source* s);
+char* lexer_load(struct lexer* l, const char* file, int* index);
+void lexer_unload(struct lexer* l);
+
+//driver.cpp
+int lexer_parse_files(struct lexer* l, const char* file, int threads);
+int lexer_parse_list(struct lexer* l, const char** files, int count, int threads);
+
+//bench.cpp
+int bench_lexer(int count, int rounds);
+int bench_codec(int count);
+int bench_encoder(int count);
+int bench_utf8(int rounds);
+int bench_offset(int count);
+
+//gen_lua.cpp
+int gen_lua(struct protocol* root, const char* output);
+
+//dispatch.cpp
+typedef int(*dispatch_func)(void* ud, struct protocol* ptl, const char* data, size_t size);
+
+struct dispatch_slot {
+	struct protocol* protocol;
+	dispatch_func func;
+	void* ud;
+};
+
+//slots每个协议一项；index是按id开放寻址的hash，保存slots下标+1，0为空。
+//id分布在1~PROTOCOL_ID_MAX，按id直接做下标会让每个版本都占用整个id范围
+struct protocol_dispatch {
+	struct dispatch_slot* slots;
+	int size;
+	int* index;
+	int mask;
+};
+
+int assign_protocol_id(struct protocol* root);
+struct protocol_dispatch* create_dispatch(struct protocol* root);
+void release_dispatch(struct protocol_dispatch* d);
+struct dispatch_slot* dispatch_find(struct protocol_dispatch* d, int id);
+struct protocol* dispatch_protocol(struct protocol_dispatch* d, int id);
+int dispatch_register(struct protocol_dispatch* d, int id, dispatch_func func, void* ud);
+int dispatch_message(struct protocol_dispatch* d, int id, const char* data, size_t size);
+
+//cache.cpp
+//entry为入口文件，加载时与保存时的入口文件不同则缓存无效
+int protocol_cache_save(struct lexer* l, const char* entry, const char* output);
+struct protocol* protocol_cache_load(const char* input, const char* entry, int check, struct import_graph** imports);
+//缓存有效则直接加载，否则解析file并重新生成缓存，cache为NULL时只解析；失败返回NULL。
+//imports不为NULL时返回import关系，与协议树一起由release_protocol释放
+struct protocol* protocol_load(const char* file, const char* cache, int threads, struct import_graph** imports);
+
+#endif
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "reload.h"
+
+static struct schema_version* create_version(struct protocol* root, struct import_graph* imports)
+{
+	struct schema_version* v = (struct schema_version*)malloc(sizeof(*v));
+	v->root = root;
+	v->dispatch = create_dispatch(root);
+	v->imports = imports;
+	v->retire = 0;
+	v->next = NULL;
+	return v;
+}
+
+static void release_version(struct schema_version* v)
+{
+	release_dispatch(v->dispatch);
+	release_protocol(v->root);
+	free(v);
+}
+
+struct schema_registry* schema_create(const char* file, const char* cache, int threads)
+{
+	struct import_graph* imports;
+	struct protocol* root = protocol_load(file, cache, threads, &imports);
+	if (root == NULL)
+		return NULL;
+
+	struct schema_registry* r = new schema_registry();
+	r->current = create_version(root, imports);
+	r->epoch = 1;
+	for (int i = 0; i < SCHEMA_MAX_READER; i++)
+	{
+		r->used[i] = 0;
+		r->active[i] = 0;
+	}
+	r->retired = NULL;
+	r->threads = threads;
+	return r;
+}
+
+void schema_release(struct schema_registry* r)
+{
+	while (r->retired)
+	{
+		struct schema_version* next = r->retired->next;
+		release_version(r->retired);
+		r->retired = next;
+	}
+	release_version(r->current);
+	delete r;
+}
+
+int schema_reader(struct schema_registry* r)
+{
+	for (int i = 0; i < SCHEMA_MAX_READER; i++)
+	{
+		int expect = 0;
+		if (r->used[i].compare_exchange_strong(expect, 1))
+			return i;
+	}
+	return -1;
+}
+
+void schema_reader_exit(struct schema_registry* r, int reader)
+{
+	r->active[reader] = 0;
+	r->used[reader] = 0;
+}
+
+//先登记epoch再读取当前版本(均为seq_cst)：替换之后才登记的读者一定读到新版本
+struct schema_version* schema_read_lock(struct schema_registry* r, int reader)
+{
+	r->active[reader] = r->epoch.load();
+	return r->current.load();
+}
+
+void schema_read_unlock(struct schema_registry* r, int reader)
+{
+	r->active[reader] = 0;
+}
+
+//版本在epoch变为retire时被替换，所有读区的epoch都不小于retire时不再有人引用它
+static void reclaim(struct schema_registry* r)
+{
+	unsigned int oldest = r->epoch.load();
+	for (int i = 0; i < SCHEMA_MAX_READER; i++)
+	{
+		unsigned int e = r->active[i].load();
+		if (e != 0 && e < oldest)
+			oldest = e;
+	}
+
+	struct schema_version** link = &r->retired;
+	while (*link)
+	{
+		struct schema_version* v = *link;
+		if (v->retire <= oldest)
+		{
+			*link = v->next;
+			release_version(v);
+		}
+		else
+		{
+			link = &v->next;
+		}
+	}
+}
+
+static int find_graph_file(struct import_graph* g, const char* file)
+{
+	for (int i = 0; g && i < g->size; i++)
+	{
+		if (strcmp(g->file[i], file) == 0)
+			return i;
+	}
+	return -1;
+}
+
+//按完整名字(如test2.InnerProtocol)在新的协议树中查找
+static struct protocol* find_fullname(struct protocol* root, const char* fullname)
+{
+	char name[256];
+	struct protocol* ptl = root;
+	const char* p = fullname;
+	while (ptl && *p)
+	{
+		const char* dot = strchr(p, '.');
+		size_t len = dot ? (size_t)(dot - p) : strlen(p);
+		if (len >= sizeof(name))
+			return NULL;
+		memcpy(name, p, len);
+		name[len] = '\0';
+		ptl = query_protocol(ptl->children, name);
+		p = dot ? dot + 1 : p + len;
+	}
+	return ptl;
+}
+
+//旧协议到复制品的映射，开放寻址，按指针查找
+struct clone_map {
+	struct protocol** from;
+	struct protocol** to;
+	size_t mask;
+	size_t size;
+};
+
+static size_t pointer_slot(struct clone_map* m, struct protocol* ptl)
+{
+	size_t index = ((size_t)ptl >> 3) * 2654435761u & m->mask;
+	while (m->from[index] && m->from[index] != ptl)
+		index = (index + 1) & m->mask;
+	return index;
+}
+
+static void map_add(struct clone_map* m, struct protocol* from, struct protocol* to)
+{
+	if ((m->size + 1) * 2 > m->mask + 1)
+	{
+		struct clone_map n;
+		n.mask = m->mask ? m->mask * 2 + 1 : 255;
+		n.size = 0;
+		n.from = (struct protocol**)calloc(n.mask + 1, sizeof(struct protocol*));
+		n.to = (struct protocol**)malloc((n.mask + 1) * sizeof(struct protocol*));
+		for (size_t i = 0; m->mask && i <= m->mask; i++)
+		{
+			if (m->from[i])
+				map_add(&n, m->from[i], m->to[i]);
+		}
+		free(m->from);
+		free(m->to);
+		*m = n;
+	}
+	size_t index = pointer_slot(m, from);
+	m->from[index] = from;
+	m->to[index] = to;
+	m->size++;
+}
+
+static struct protocol* map_find(struct clone_map* m, struct protocol* from)
+{
+	if (m->mask == 0)
+		return NULL;
+	size_t index = pointer_slot(m, from);
+	return m->from[index] ? m->to[index] : NULL;
+}
+
+//复制协议及其内嵌协议，字段类型暂时指向旧版本的协议，全部解析完成后再统一替换
+static void clone_protocol(struct clone_map* m, struct protocol* parent, struct protocol* ptl)
+{
+	struct arena* arena = parent->arena;
+	struct protocol* copy = create_protocol(arena, ptl->file, ptl->name);
+	copy->parent = parent;
+	copy->id = ptl->id;
+	copy->isenum = ptl->isenum;
+	add_protocol(parent->children, copy);
+	map_add(m, ptl, copy);
+
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* child = table->slots[i]; child; child = child->next)
+			clone_protocol(m, copy, child);
+	}
+
+	copy->cap = ptl->size > 0 ? ptl->size : 1;
+	copy->field = (struct field**)arena_alloc(arena, sizeof(struct field*) * copy->cap);
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = (struct field*)arena_alloc(arena, sizeof(*f));
+		*f = *ptl->field[i];
+		f->name = arena_strdup(arena, f->name);
+		copy->field[i] = f;
+	}
+	copy->size = ptl->size;
+}
+
+//引用同样复制过来的协议时直接查映射，引用重新解析的协议时按完整名字查找
+static int resolve_clone(struct clone_map* m, struct protocol* root, struct protocol* ptl)
+{
+	char name[256];
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field_type* type = &ptl->field[i]->field_type;
+		if (type->protocol == NULL)
+			continue;
+		struct protocol* copy = map_find(m, type->protocol);
+		if (copy)
+		{
+			type->protocol = copy;
+			continue;
+		}
+		protocol_fullname(type->protocol, name, sizeof(name));
+		type->protocol = find_fullname(root, name);
+		if (type->protocol == NULL)
+		{
+			fprintf(stderr, "%s syntax error:type %s used by %s no longer exists\n", ptl->file, name, ptl->name);
+			return -1;
+		}
+	}
+
+	struct protocol_table* table = ptl->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* child = table->slots[i]; child; child = child->next)
+		{
+			if (resolve_clone(m, root, child) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+//受影响的文件：修改的文件以及依赖受影响文件的文件
+static char* mark_affected(struct import_graph* g, int changed)
+{
+	char* affected = (char*)malloc(g->size > 0 ? g->size : 1);
+	memset(affected, 0, g->size);
+	affected[changed] = 1;
+	bool more = true;
+	while (more)
+	{
+		more = false;
+		for (int i = 0; i < g->size; i++)
+		{
+			for (int j = g->offset[i]; !affected[i] && j < g->offset[i + 1]; j++)
+			{
+				if (affected[g->dep[j]])
+				{
+					affected[i] = 1;
+					more = true;
+				}
+			}
+		}
+	}
+	return affected;
+}
+
+static struct schema_version* rebuild(struct schema_registry* r, struct schema_version* old, int changed)
+{
+	struct import_graph* g = old->imports;
+	char* affected = mark_affected(g, changed);
+
+	struct lexer l;
+	lexer_init(&l, NULL, protobol_begin, protobol_over, field_begin, field_over);
+	l.main = &l;
+	//修改的文件可能还在被改写，不能映射
+	l.copy_source = 1;
+
+	//未受影响的文件按原顺序登记为已解析，import关系换算到新的下标
+	int count = 0;
+	for (int i = 0; i < g->size; i++)
+	{
+		if (!affected[i])
+			parse_done(&l, g->file[i]);
+		else
+			count++;
+	}
+	struct import_graph* prev = (struct import_graph*)arena_alloc(l.root->arena, sizeof(*prev));
+	prev->size = 0;
+	prev->file = NULL;
+	prev->offset = (int*)arena_alloc(l.root->arena, sizeof(int) * (g->size + 1));
+	prev->dep = (int*)arena_alloc(l.root->arena, sizeof(int) * (g->offset[g->size] > 0 ? g->offset[g->size] : 1));
+	prev->offset[0] = 0;
+	for (int i = 0; i < g->size; i++)
+	{
+		if (affected[i])
+			continue;
+		int n = prev->offset[prev->size];
+		for (int j = g->offset[i]; j < g->offset[i + 1]; j++)
+			prev->dep[n++] = find_file(&l, g->file[g->dep[j]]);
+		prev->offset[++prev->size] = n;
+	}
+	l.imports = prev;
+
+	struct clone_map map;
+	memset(&map, 0, sizeof(map));
+	struct protocol_table* table = old->root->children;
+	for (int i = 0; i < table->size; i++)
+	{
+		for (struct protocol* ptl = table->slots[i]; ptl; ptl = ptl->next)
+		{
+			if (exist_file(&l, ptl->file))
+				clone_protocol(&map, l.root, ptl);
+		}
+	}
+
+	const char** files = (const char**)malloc(sizeof(char*) * count);
+	count = 0;
+	for (int i = 0; i < g->size; i++)
+	{
+		if (affected[i])
+			files[count++] = g->file[i];
+	}
+	int ret = lexer_parse_list(&l, files, count, r->threads);
+	lexer_unload(&l);
+	free(files);
+	free(affected);
+
+	table = l.root->children;
+	for (int i = 0; ret == 0 && i < table->size; i++)
+	{
+		for (struct protocol* ptl = table->slots[i]; ret == 0 && ptl; ptl = ptl->next)
+		{
+			if (find_file(&l, ptl->file) < prev->size)
+				ret = resolve_clone(&map, l.root, ptl);
+		}
+	}
+	free(map.from);
+	free(map.to);
+
+	if (ret < 0)
+	{
+		release_protocol(l.root);
+		return NULL;
+	}
+	return create_version(l.root, l.imports);
+}
+
+int schema_reload(struct schema_registry* r, const char* file)
+{
+	std::lock_guard<std::mutex> guard(r->lock);
+	struct schema_version* old = r->current.load();
+	int changed = find_graph_file(old->imports, file);
+	if (changed < 0)
+	{
+		fprintf(stderr, "%s is not part of the loaded protocols\n", file);
+		return -1;
+	}
+
+	struct schema_version* v = rebuild(r, old, changed);
+	if (v == NULL)
+		return -1;
+
+	r->current.store(v);
+	old->retire = ++r->epoch;
+	old->next = r->retired;
+	r->retired = old;
+	reclaim(r);
+	return 0;
+}
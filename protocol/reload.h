@@ -0,0 +1,55 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <atomic>
+#include <mutex>
+
+#include "protocol.h"
+
+//协议热更新：某个协议文件修改后，只重新解析它以及直接或间接import它的文件，
+//其余文件的协议从当前版本复制，不再经过词法分析。新版本构建完成后原子替换当前指针，
+//编解码线程不需要停下来。旧版本在所有读者都离开之后才释放(基于epoch的RCU)
+
+#define SCHEMA_MAX_READER 64
+
+//一个版本内的协议树、分派表和import关系都不再修改，可以被多个线程同时读取
+struct schema_version {
+	struct protocol* root;
+	struct protocol_dispatch* dispatch;
+	struct import_graph* imports;
+
+	unsigned int retire;
+	struct schema_version* next;
+};
+
+struct schema_registry {
+	std::atomic<struct schema_version*> current;
+	std::atomic<unsigned int> epoch;
+
+	//读者槽位：used标记占用，active为进入读区时的epoch，0表示不在读区
+	std::atomic<int> used[SCHEMA_MAX_READER];
+	std::atomic<unsigned int> active[SCHEMA_MAX_READER];
+
+	//reload之间互斥，retired只在持锁时访问
+	std::mutex lock;
+	struct schema_version* retired;
+	int threads;
+};
+
+//完整解析file，cache不为NULL时经由该缓存文件加载，失败返回NULL
+struct schema_registry* schema_create(const char* file, const char* cache, int threads);
+//调用者保证此时已经没有读者
+void schema_release(struct schema_registry* r);
+
+//每个读线程占用一个槽位，槽位用完返回-1
+int schema_reader(struct schema_registry* r);
+void schema_reader_exit(struct schema_registry* r, int reader);
+
+//读区内返回的版本保持有效，读区不能嵌套
+struct schema_version* schema_read_lock(struct schema_registry* r, int reader);
+void schema_read_unlock(struct schema_registry* r, int reader);
+
+//file修改后重新加载，失败时当前版本保持不变
+int schema_reload(struct schema_registry* r, const char* file);
+
+#endif
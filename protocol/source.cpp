@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "protocol.h"
+
+//协议源文件以只读方式映射到内存。扫描器依赖结尾的'\0'：
+//文件大小不是页大小整数倍时，映射的最后一页剩余部分由系统填0，可直接作为结束符，无需拷贝；
+//恰好整页(或空文件)时才退回到分配内存读入。
+//映射要求解析期间文件不被改写：截断后访问映射的页会SIGBUS，原地追加则最后一页不再以'\0'结束。
+//热更新时文件可能正被编辑器改写，因此copy为1时总是读入一份副本
+
+static size_t page_size()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static int source_read(struct source* s, const char* file)
+{
+	FILE *file_handle = fopen(file, "rb");
+	if (file_handle == NULL)
+		return -1;
+	fseek(file_handle, 0, SEEK_END);
+	long size = ftell(file_handle);
+	rewind(file_handle);
+	if (size < 0)
+	{
+		fclose(file_handle);
+		return -1;
+	}
+	s->data = (char*)malloc((size_t)size + 1);
+	s->size = fread(s->data, 1, (size_t)size, file_handle);
+	s->data[s->size] = 0;
+	s->mapped = 0;
+	fclose(file_handle);
+	return 0;
+}
+
+int source_open(struct source* s, const char* file, int copy)
+{
+	memset(s, 0, sizeof(*s));
+	if (copy)
+		return source_read(s, file);
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return -1;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size))
+	{
+		CloseHandle(handle);
+		return -1;
+	}
+	s->size = (size_t)size.QuadPart;
+	if (s->size % page_size() == 0)
+	{
+		CloseHandle(handle);
+		return source_read(s, file);
+	}
+
+	HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);
+	if (mapping == NULL)
+		return source_read(s, file);
+	s->data = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (s->data == NULL)
+		return source_read(s, file);
+#else
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	s->size = (size_t)st.st_size;
+	if (s->size % page_size() == 0)
+	{
+		close(fd);
+		return source_read(s, file);
+	}
+
+	void* data = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return source_read(s, file);
+	s->data = (char*)data;
+#endif
+	s->mapped = 1;
+	return 0;
+}
+
+void source_close(struct source* s)
+{
+	if (s->data == NULL)
+		return;
+	if (s->mapped)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(s->data);
+#else
+		munmap(s->data, s->size);
+#endif
+	}
+	else
+	{
+		free(s->data);
+	}
+	s->data = NULL;
+}
+
+//文件在第一次加载时登记到main->file_hash，映射按下标保存，import同一文件时直接复用
+char* lexer_load(struct lexer* l, const char* file, int* index)
+{
+	int i = parse_done(l, file);
+	if (i >= l->source_cap)
+	{
+		int ncap = l->source_cap == 0 ? 16 : l->source_cap;
+		while (ncap <= i)
+			ncap *= 2;
+		l->source = (struct source*)realloc(l->source, sizeof(*l->source) * ncap);
+		memset(l->source + l->source_cap, 0, sizeof(*l->source) * (ncap - l->source_cap));
+		l->source_cap = ncap;
+	}
+	if (index)
+		*index = i;
+
+	struct source* s = &l->source[i];
+	if (s->data == NULL && source_open(s, file, l->copy_source) < 0)
+	{
+		fprintf(stderr, "can not open %s\n", file);
+		return NULL;
+	}
+	return s->data;
+}
+
+void lexer_unload(struct lexer* l)
+{
+	for (int i = 0; i < l->source_cap; i++)
+		source_close(&l->source[i]);
+	free(l->source);
+	l->source = NULL;
+	l->source_cap = 0;
+}
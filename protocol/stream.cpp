@@ -0,0 +1,620 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "stream.h"
+
+#define PHASE_FIELD		0
+#define PHASE_VALUE		1
+#define PHASE_COUNT		2
+#define PHASE_BYTES		3
+#define PHASE_ELEMENT	4
+#define PHASE_NEXT		5
+#define PHASE_KEY		6
+#define PHASE_BLOCK		7
+#define PHASE_SKIP		8
+#define PHASE_SKIP_LEN	9
+#define PHASE_SKIP_BYTES	10
+#define PHASE_BITMAP	11
+
+#define READ_ERROR	-1
+#define READ_MORE	0
+#define READ_DONE	1
+
+struct stream_input {
+	const char* begin;
+	const char* ptr;
+	const char* end;
+};
+
+void stream_init(struct stream_decoder* d, stream_func func, void* ud)
+{
+	memset(d, 0, sizeof(*d));
+	d->func = func;
+	d->ud = ud;
+}
+
+void stream_release(struct stream_decoder* d)
+{
+	free(d->bitmap);
+	d->bitmap = NULL;
+	d->bitmap_size = 0;
+	d->bitmap_cap = 0;
+	if (d->scratch)
+	{
+		buffer_release(d->scratch);
+		free(d->scratch);
+		d->scratch = NULL;
+	}
+}
+
+static void reset_value(struct stream_decoder* d)
+{
+	d->acc = 0;
+	d->shift = 0;
+	d->consumed = 0;
+	d->have = 0;
+	d->string_phase = 0;
+	d->string_len = 0;
+}
+
+static int emit(struct stream_decoder* d, struct stream_event* e)
+{
+	return d->func(d->ud, e) == 0 ? 0 : -1;
+}
+
+//新的一层从存在位图开始读取，remain为位图还没读到的字节数
+static void init_frame(struct stream_decoder* d, struct stream_frame* fr, struct protocol* ptl)
+{
+	size_t bytes = WIRE_BITMAP_SIZE(protocol_positional(ptl));
+	if (d->bitmap_size + bytes > d->bitmap_cap)
+	{
+		size_t cap = d->bitmap_cap == 0 ? 64 : d->bitmap_cap;
+		while (cap < d->bitmap_size + bytes)
+			cap *= 2;
+		d->bitmap = (unsigned char*)realloc(d->bitmap, cap);
+		d->bitmap_cap = cap;
+	}
+	fr->protocol = ptl;
+	fr->index = 0;
+	fr->phase = PHASE_BITMAP;
+	fr->remain = bytes;
+	fr->bytes = 0;
+	fr->block = 0;
+	fr->bitmap = d->bitmap_size;
+	fr->bit = 0;
+	fr->element = 0;
+	fr->bits = 0;
+	d->bitmap_size += bytes;
+}
+
+static int push_frame(struct stream_decoder* d, struct protocol* ptl, struct field* f)
+{
+	if (d->depth == STREAM_MAX_DEPTH)
+		return -1;
+	init_frame(d, &d->frame[d->depth++], ptl);
+
+	struct stream_event e;
+	memset(&e, 0, sizeof(e));
+	e.type = STREAM_BEGIN_PROTOCOL;
+	e.protocol = ptl;
+	e.field = f;
+	return emit(d, &e);
+}
+
+void stream_begin(struct stream_decoder* d, struct protocol* ptl)
+{
+	d->depth = 0;
+	d->bitmap_size = 0;
+	reset_value(d);
+	init_frame(d, &d->frame[d->depth++], ptl);
+}
+
+static int read_uvarint(struct stream_decoder* d, struct stream_input* in, unsigned long long* value)
+{
+	while (in->ptr < in->end)
+	{
+		unsigned char c = (unsigned char)*in->ptr++;
+		d->consumed++;
+		if (d->shift >= 64)
+			return READ_ERROR;
+		d->acc |= (unsigned long long)(c & 0x7f) << d->shift;
+		d->shift += 7;
+		if ((c & 0x80) == 0)
+		{
+			*value = d->acc;
+			d->acc = 0;
+			d->shift = 0;
+			return READ_DONE;
+		}
+	}
+	return READ_MORE;
+}
+
+//定长数据完整时直接指向输入，否则先收集到fixed
+static int read_fixed(struct stream_decoder* d, struct stream_input* in, int n, const char** ptr)
+{
+	if (d->have == 0 && in->end - in->ptr >= n)
+	{
+		*ptr = in->ptr;
+		in->ptr += n;
+		return READ_DONE;
+	}
+	while (d->have < n && in->ptr < in->end)
+		d->fixed[d->have++] = *in->ptr++;
+	if (d->have < n)
+		return READ_MORE;
+	d->have = 0;
+	*ptr = d->fixed;
+	return READ_DONE;
+}
+
+static int read_string(struct stream_decoder* d, struct stream_input* in, struct stream_event* e)
+{
+	if (d->string_phase == 0)
+	{
+		unsigned long long len;
+		int r = read_uvarint(d, in, &len);
+		if (r != READ_DONE)
+			return r;
+		if (len > 0x7fffffff)
+			return READ_ERROR;
+		d->string_len = (size_t)len;
+		d->string_phase = 1;
+		if (d->scratch)
+			buffer_reset(d->scratch);
+	}
+
+	size_t have = d->scratch ? d->scratch->offset : 0;
+	size_t avail = in->end - in->ptr;
+	if (have == 0 && avail >= d->string_len)
+	{
+		e->str = in->ptr;
+		e->len = d->string_len;
+		in->ptr += d->string_len;
+		d->string_phase = 0;
+		return READ_DONE;
+	}
+
+	//跨片的字符串拷贝到内部缓冲
+	if (d->scratch == NULL)
+	{
+		d->scratch = (struct write_buffer*)malloc(sizeof(*d->scratch));
+		buffer_init(d->scratch);
+	}
+	size_t need = d->string_len - have;
+	size_t n = avail < need ? avail : need;
+	buffer_addlstring(d->scratch, in->ptr, n);
+	in->ptr += n;
+	if (n < need)
+		return READ_MORE;
+	e->str = d->scratch->ptr;
+	e->len = d->string_len;
+	d->string_phase = 0;
+	return READ_DONE;
+}
+
+static int read_value(struct stream_decoder* d, struct stream_input* in, int type, struct stream_event* e)
+{
+	const char* ptr;
+	int r;
+	switch (type)
+	{
+	case TYPE_INT:
+	{
+		unsigned long long u;
+		r = read_uvarint(d, in, &u);
+		if (r == READ_DONE)
+		{
+			unsigned int z = (unsigned int)u;
+			e->value.i = (int)((z >> 1) ^ (0u - (z & 1)));
+		}
+		return r;
+	}
+	case TYPE_FLOAT:
+		r = read_fixed(d, in, 4, &ptr);
+		if (r == READ_DONE)
+			wire_copy_float(&e->value.f, ptr, 1);
+		return r;
+	case TYPE_DOUBLE:
+		r = read_fixed(d, in, 8, &ptr);
+		if (r == READ_DONE)
+			wire_copy_double(&e->value.d, ptr, 1);
+		return r;
+	case TYPE_STRING:
+		return read_string(d, in, e);
+	}
+	if (type_integer(type) || type == TYPE_BOOL)
+	{
+		unsigned long long u;
+		r = read_uvarint(d, in, &u);
+		if (r != READ_DONE)
+			return r;
+		if (type_signed(type))
+			u = (unsigned long long)wire_unzigzag(u);
+		if (!wire_integer_fits(type, u))
+			return READ_ERROR;
+		if (type == TYPE_BOOL)
+			e->value.b = u != 0;
+		else if (type_signed(type))
+			e->value.l = (long long)u;
+		else
+			e->value.u = u;
+		return READ_DONE;
+	}
+	return READ_ERROR;
+}
+
+//map与数组一样以个数开头
+static int is_array(struct field* f)
+{
+	if (f->field_type.type == TYPE_MAP)
+		return 1;
+	return f->field_type.type == TYPE_PROTOCOL ? f->field_type.isarray : (f->field_type.type & 1);
+}
+
+static size_t position(struct stream_decoder* d, struct stream_input* in)
+{
+	return d->position + (in->ptr - in->begin);
+}
+
+static int begin_field(struct stream_decoder* d, struct stream_frame* fr, struct field* f)
+{
+	if (f->field_type.type == TYPE_PROTOCOL && !f->field_type.isarray)
+	{
+		fr->phase = PHASE_NEXT;
+		return push_frame(d, f->field_type.protocol, f);
+	}
+	fr->phase = is_array(f) ? PHASE_COUNT : PHASE_VALUE;
+	return 0;
+}
+
+//位图中不存在的位置字段按默认值回调，嵌套协议和定长数组总是写入，不存在时数据不合法
+static int default_field(struct stream_decoder* d, struct stream_event* e, struct field* f)
+{
+	if ((f->field_type.type == TYPE_PROTOCOL && !f->field_type.isarray) || f->field_type.size)
+		return -1;
+	if (is_array(f))
+	{
+		e->type = STREAM_BEGIN_ARRAY;
+		if (emit(d, e) < 0)
+			return -1;
+		e->type = STREAM_END_ARRAY;
+		return emit(d, e);
+	}
+	e->type = STREAM_VALUE;
+	if (f->field_type.type == TYPE_STRING)
+		e->str = "";
+	return emit(d, e);
+}
+
+static struct field* find_tag(struct protocol* ptl, unsigned int key, int* index)
+{
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag != 0 && (unsigned int)WIRE_KEY(f->tag, wire_tag_type(f->field_type.type)) == key)
+		{
+			*index = i;
+			return f;
+		}
+	}
+	return NULL;
+}
+
+int stream_feed(struct stream_decoder* d, const char* data, size_t size, size_t* used)
+{
+	struct stream_input in;
+	in.begin = data;
+	in.ptr = data;
+	in.end = data + size;
+	int ret = STREAM_MORE;
+
+	while (d->depth > 0)
+	{
+		struct stream_frame* fr = &d->frame[d->depth - 1];
+		struct stream_event e;
+		memset(&e, 0, sizeof(e));
+		e.protocol = fr->protocol;
+
+		if (fr->phase == PHASE_BITMAP)
+		{
+			size_t avail = in.end - in.ptr;
+			size_t n = avail < fr->remain ? avail : fr->remain;
+			if (n > 0)
+			{
+				size_t have = d->bitmap_size - fr->bitmap;
+				memcpy(d->bitmap + fr->bitmap + have - fr->remain, in.ptr, n);
+				in.ptr += n;
+				fr->remain -= n;
+			}
+			if (fr->remain > 0)
+				goto more;
+			fr->phase = PHASE_FIELD;
+		}
+
+		//位置字段读完后进入可选字段区，逐个读取key直到key 0
+		if (fr->index == fr->protocol->size)
+		{
+			fr->index = 0;
+			fr->phase = PHASE_KEY;
+		}
+		if (fr->phase >= PHASE_KEY)
+		{
+			switch (fr->phase)
+			{
+			case PHASE_KEY:
+			{
+				unsigned long long key;
+				int r = read_uvarint(d, &in, &key);
+				if (r == READ_ERROR || (r == READ_DONE && key > 0xffffffffULL))
+					goto error;
+				if (r == READ_MORE)
+					goto more;
+				d->consumed = 0;
+				if (key == 0)
+				{
+					e.type = STREAM_END_PROTOCOL;
+					d->depth--;
+					d->bitmap_size = fr->bitmap;
+					if (d->depth > 0)
+						e.field = d->frame[d->depth - 1].protocol->field[d->frame[d->depth - 1].index];
+					if (d->depth > 0 && emit(d, &e) < 0)
+						goto error;
+					break;
+				}
+				int index;
+				struct field* f = find_tag(fr->protocol, (unsigned int)key, &index);
+				if (f == NULL)
+				{
+					switch (WIRE_KEY_TYPE(key))
+					{
+					case WIRE_VARINT:
+						fr->phase = PHASE_SKIP;
+						break;
+					case WIRE_FIXED32:
+						d->skip = 4;
+						fr->phase = PHASE_SKIP_BYTES;
+						break;
+					case WIRE_FIXED64:
+						d->skip = 8;
+						fr->phase = PHASE_SKIP_BYTES;
+						break;
+					default:
+						fr->phase = PHASE_SKIP_LEN;
+						break;
+					}
+					break;
+				}
+				fr->index = index;
+				fr->block = f->field_type.type != TYPE_STRING && WIRE_KEY_TYPE(key) == WIRE_BYTES;
+				if (fr->block)
+					fr->phase = PHASE_BLOCK;
+				else if (begin_field(d, fr, f) < 0)
+					goto error;
+				break;
+			}
+			case PHASE_BLOCK:
+			{
+				unsigned long long len;
+				int r = read_uvarint(d, &in, &len);
+				if (r == READ_ERROR || (r == READ_DONE && len > 0x7fffffff))
+					goto error;
+				if (r == READ_MORE)
+					goto more;
+				d->consumed = 0;
+				fr->end = position(d, &in) + (size_t)len;
+				if (begin_field(d, fr, fr->protocol->field[fr->index]) < 0)
+					goto error;
+				break;
+			}
+			case PHASE_SKIP:
+			{
+				unsigned long long value;
+				int r = read_uvarint(d, &in, &value);
+				if (r == READ_ERROR)
+					goto error;
+				if (r == READ_MORE)
+					goto more;
+				d->consumed = 0;
+				fr->phase = PHASE_KEY;
+				break;
+			}
+			case PHASE_SKIP_LEN:
+			{
+				unsigned long long len;
+				int r = read_uvarint(d, &in, &len);
+				if (r == READ_ERROR || (r == READ_DONE && len > 0x7fffffff))
+					goto error;
+				if (r == READ_MORE)
+					goto more;
+				d->consumed = 0;
+				d->skip = (size_t)len;
+				fr->phase = PHASE_SKIP_BYTES;
+				break;
+			}
+			case PHASE_SKIP_BYTES:
+			{
+				size_t avail = in.end - in.ptr;
+				size_t n = avail < d->skip ? avail : d->skip;
+				in.ptr += n;
+				d->skip -= n;
+				if (d->skip > 0)
+					goto more;
+				fr->phase = PHASE_KEY;
+				break;
+			}
+			}
+			continue;
+		}
+
+		struct field* f = fr->protocol->field[fr->index];
+		int type = f->field_type.type;
+		e.field = f;
+		switch (fr->phase)
+		{
+		case PHASE_FIELD:
+			//可选字段不在位置字段中
+			if (f->tag != 0)
+			{
+				fr->index++;
+			}
+			else if (WIRE_BIT(d->bitmap + fr->bitmap, fr->bit) && type == TYPE_BOOL)
+			{
+				//bool的值就是这一位
+				e.type = STREAM_VALUE;
+				e.value.b = true;
+				if (emit(d, &e) < 0)
+					goto error;
+				fr->phase = PHASE_NEXT;
+			}
+			else if (WIRE_BIT(d->bitmap + fr->bitmap, fr->bit))
+			{
+				if (begin_field(d, fr, f) < 0)
+					goto error;
+			}
+			else
+			{
+				if (default_field(d, &e, f) < 0)
+					goto error;
+				fr->phase = PHASE_NEXT;
+			}
+			break;
+		case PHASE_VALUE:
+		{
+			int r = read_value(d, &in, type, &e);
+			if (r == READ_ERROR)
+				goto error;
+			if (r == READ_MORE)
+				goto more;
+			e.type = STREAM_VALUE;
+			if (emit(d, &e) < 0)
+				goto error;
+			fr->phase = PHASE_NEXT;
+			break;
+		}
+		case PHASE_COUNT:
+		{
+			unsigned long long count;
+			int r = read_uvarint(d, &in, &count);
+			if (r == READ_ERROR || (r == READ_DONE && count > STREAM_MAX_COUNT))
+				goto error;
+			if (r == READ_MORE)
+				goto more;
+			if (f->field_type.size && count != (unsigned long long)f->field_type.size)
+				goto error;
+			d->consumed = 0;
+			//map的每一项为键和值两个元素
+			fr->remain = (size_t)count * (type == TYPE_MAP ? 2 : 1);
+			e.type = STREAM_BEGIN_ARRAY;
+			e.count = (size_t)count;
+			if (emit(d, &e) < 0)
+				goto error;
+			fr->element = 0;
+			fr->phase = type_integer(type) && count > 0 ? PHASE_BYTES : PHASE_ELEMENT;
+			break;
+		}
+		case PHASE_BYTES:
+		{
+			unsigned long long bytes;
+			int r = read_uvarint(d, &in, &bytes);
+			if (r == READ_ERROR || (r == READ_DONE && bytes < fr->remain))
+				goto error;
+			if (r == READ_MORE)
+				goto more;
+			d->consumed = 0;
+			fr->bytes = (size_t)bytes;
+			fr->phase = PHASE_ELEMENT;
+			break;
+		}
+		case PHASE_ELEMENT:
+			if (fr->remain == 0)
+			{
+				//整数数组的字节数必须与实际元素长度一致
+				if (fr->bytes != 0)
+					goto error;
+				e.type = STREAM_END_ARRAY;
+				if (emit(d, &e) < 0)
+					goto error;
+				fr->phase = PHASE_NEXT;
+				break;
+			}
+			if (type == TYPE_PROTOCOL || (type == TYPE_MAP && (fr->element & 1) && f->field_type.value == TYPE_PROTOCOL))
+			{
+				fr->element++;
+				fr->remain--;
+				if (push_frame(d, f->field_type.protocol, f) < 0)
+					goto error;
+			}
+			else if (type == TYPE_BOOL_ARRAY)
+			{
+				//每8个元素读入一个字节
+				if ((fr->element & 7) == 0)
+				{
+					const char* ptr;
+					int r = read_fixed(d, &in, 1, &ptr);
+					if (r == READ_MORE)
+						goto more;
+					fr->bits = (unsigned char)*ptr;
+				}
+				e.value.b = ((fr->bits >> (fr->element & 7)) & 1) != 0;
+				fr->element++;
+				fr->remain--;
+				e.type = STREAM_VALUE;
+				if (emit(d, &e) < 0)
+					goto error;
+			}
+			else
+			{
+				//map的键和值交替出现
+				int element = type != TYPE_MAP ? type - 1 : (fr->element & 1) ? f->field_type.value : f->field_type.key;
+				int r = read_value(d, &in, element, &e);
+				if (r == READ_ERROR)
+					goto error;
+				if (r == READ_MORE)
+					goto more;
+				if (type_integer(type))
+				{
+					if ((size_t)d->consumed > fr->bytes)
+						goto error;
+					fr->bytes -= d->consumed;
+				}
+				d->consumed = 0;
+				fr->element++;
+				fr->remain--;
+				e.type = STREAM_VALUE;
+				if (emit(d, &e) < 0)
+					goto error;
+			}
+			break;
+		case PHASE_NEXT:
+			if (f->tag == 0)
+			{
+				fr->bit++;
+				fr->index++;
+				fr->phase = PHASE_FIELD;
+				break;
+			}
+			//外层长度必须与值的实际长度一致
+			if (fr->block && position(d, &in) != fr->end)
+				goto error;
+			fr->block = 0;
+			fr->phase = PHASE_KEY;
+			break;
+		}
+	}
+	ret = STREAM_DONE;
+
+more:
+	d->position += in.ptr - data;
+	if (used)
+		*used = in.ptr - data;
+	return ret;
+
+error:
+	d->position += in.ptr - data;
+	if (used)
+		*used = in.ptr - data;
+	d->depth = 0;
+	return -1;
+}
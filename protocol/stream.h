@@ -0,0 +1,98 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+#include "wire.h"
+
+//流式解码：数据可以任意切分后分多次喂入，在varint、字符串、数组中间断开时保存状态，
+//下次喂入时从断点继续。解码结果以事件回调给使用者，不需要先拼出完整消息。
+//位图中不存在的位置字段同样回调，值为默认值(0、空字符串、个数为0的数组)
+//map与数组相同，以STREAM_BEGIN_ARRAY(count为项数)开始，之后键和值交替回调，值为协议时是一对BEGIN/END_PROTOCOL
+
+#define STREAM_MAX_DEPTH 64
+#define STREAM_MAX_COUNT (16 * 1024 * 1024)
+
+#define STREAM_MORE		0
+#define STREAM_DONE		1
+
+#define STREAM_VALUE			0
+#define STREAM_BEGIN_ARRAY		1
+#define STREAM_END_ARRAY		2
+#define STREAM_BEGIN_PROTOCOL	3
+#define STREAM_END_PROTOCOL		4
+
+//str只在回调期间有效：完整落在本次数据内的字符串直接指向输入，跨片的字符串指向内部缓冲。
+//扩展整数的值：int8~int64为value.l，无符号整数和枚举为value.u，bool为value.b
+struct stream_event {
+	int type;
+	struct protocol* protocol;
+	struct field* field;
+	size_t count;
+	union {
+		int i;
+		float f;
+		double d;
+		long long l;
+		unsigned long long u;
+		bool b;
+	} value;
+	const char* str;
+	size_t len;
+};
+
+//返回非0中止解码，stream_feed返回-1
+typedef int(*stream_func)(void* ud, struct stream_event* e);
+
+struct stream_frame {
+	struct protocol* protocol;
+	int index;
+	int phase;
+	size_t remain;
+	size_t bytes;
+	//可选字段外层长度结束的位置
+	int block;
+	size_t end;
+	//存在位图在decoder->bitmap中的位置，bit为当前位置字段的位号
+	size_t bitmap;
+	int bit;
+	//bool[]：当前元素的下标和所在的字节
+	size_t element;
+	unsigned char bits;
+};
+
+struct stream_decoder {
+	struct stream_frame frame[STREAM_MAX_DEPTH];
+	int depth;
+
+	//正在读取的基本值，同一时刻只有一个
+	unsigned long long acc;
+	int shift;
+	int consumed;
+	char fixed[8];
+	int have;
+	int string_phase;
+	size_t string_len;
+	struct write_buffer* scratch;
+	//正在跳过的不认识的可选字段还剩的字节数
+	size_t skip;
+	//已经喂入并消耗的总字节数
+	size_t position;
+	//各层消息的存在位图，按frame顺序依次存放
+	unsigned char* bitmap;
+	size_t bitmap_size;
+	size_t bitmap_cap;
+
+	stream_func func;
+	void* ud;
+};
+
+void stream_init(struct stream_decoder* d, stream_func func, void* ud);
+void stream_release(struct stream_decoder* d);
+//开始解码一条ptl消息
+void stream_begin(struct stream_decoder* d, struct protocol* ptl);
+//used返回本次消耗的字节数，消息结束时剩余数据属于下一条消息
+int stream_feed(struct stream_decoder* d, const char* data, size_t size, size_t* used);
+
+#endif
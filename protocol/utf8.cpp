@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+
+#include "utf8.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define UTF8_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define UTF8_TARGET(x)
+#else
+#define UTF8_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+//逐字节校验，连续的ASCII每次判断8字节
+int utf8_valid_scalar(const char* str, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)str;
+	const unsigned char* end = p + len;
+	while (p < end)
+	{
+		if (end - p >= 8)
+		{
+			unsigned long long word;
+			memcpy(&word, p, sizeof(word));
+			if ((word & 0x8080808080808080ULL) == 0)
+			{
+				p += 8;
+				continue;
+			}
+		}
+		unsigned char c = *p;
+		if (c < 0x80)
+		{
+			p++;
+			continue;
+		}
+		size_t n;
+		unsigned char lo = 0x80;
+		unsigned char hi = 0xBF;
+		if (c >= 0xC2 && c <= 0xDF)
+		{
+			n = 2;
+		}
+		else if (c >= 0xE0 && c <= 0xEF)
+		{
+			n = 3;
+			//E0后不能是超长编码，ED后不能是代理区
+			if (c == 0xE0)
+				lo = 0xA0;
+			else if (c == 0xED)
+				hi = 0x9F;
+		}
+		else if (c >= 0xF0 && c <= 0xF4)
+		{
+			n = 4;
+			if (c == 0xF0)
+				lo = 0x90;
+			else if (c == 0xF4)
+				hi = 0x8F;
+		}
+		else
+		{
+			return 0;
+		}
+		if ((size_t)(end - p) < n || p[1] < lo || p[1] > hi)
+			return 0;
+		for (size_t i = 2; i < n; i++)
+		{
+			if ((p[i] & 0xC0) != 0x80)
+				return 0;
+		}
+		p += n;
+	}
+	return 1;
+}
+
+#ifdef UTF8_SIMD
+
+//向量实现按"Validating UTF-8 In Less Than One Instruction Per Byte"(Keiser, Lemire)：
+//每个字节与前一个字节的高4位、低4位和本字节的高4位各查一张表，三者相与得到两字节组合的错误，
+//3、4字节序列的后续字节位置由前2、3个字节是否为对应的首字节决定。
+//块末尾未完成的序列由下一块的前几个字节校验，最后不足一块的部分补0(ASCII)后照常处理
+
+#define TOO_SHORT		(1 << 0)
+#define TOO_LONG		(1 << 1)
+#define OVERLONG_3		(1 << 2)
+#define TOO_LARGE		(1 << 3)
+#define SURROGATE		(1 << 4)
+#define OVERLONG_2		(1 << 5)
+#define TOO_LARGE_1000	(1 << 6)
+#define OVERLONG_4		(1 << 6)
+#define TWO_CONTS		(1 << 7)
+#define CARRY			(TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+//前一个字节的高4位
+static const unsigned char table_byte_1_high[16] = {
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+	TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+	TOO_SHORT | OVERLONG_2,
+	TOO_SHORT,
+	TOO_SHORT | OVERLONG_3 | SURROGATE,
+	TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+//前一个字节的低4位
+static const unsigned char table_byte_1_low[16] = {
+	CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+	CARRY | OVERLONG_2,
+	CARRY,
+	CARRY,
+	CARRY | TOO_LARGE,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+//本字节的高4位
+static const unsigned char table_byte_2_high[16] = {
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+//块的最后3个字节分别不能是4、3、2字节序列的首字节，否则序列延续到下一块
+static const unsigned char incomplete_max[32] = {
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+};
+
+UTF8_TARGET("sse4.1")
+static __m128i check_sse4(__m128i input, __m128i prev_input)
+{
+	const __m128i low4 = _mm_set1_epi8(0x0F);
+	__m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+	__m128i byte_1_high = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)table_byte_1_high), _mm_and_si128(_mm_srli_epi16(prev1, 4), low4));
+	__m128i byte_1_low = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)table_byte_1_low), _mm_and_si128(prev1, low4));
+	__m128i byte_2_high = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)table_byte_2_high), _mm_and_si128(_mm_srli_epi16(input, 4), low4));
+	__m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+	__m128i prev2 = _mm_alignr_epi8(input, prev_input, 16 - 2);
+	__m128i prev3 = _mm_alignr_epi8(input, prev_input, 16 - 3);
+	__m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+	__m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+	__m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+	return _mm_xor_si128(must23, special);
+}
+
+UTF8_TARGET("sse4.1")
+static int valid_sse4(const char* str, size_t len)
+{
+	__m128i error = _mm_setzero_si128();
+	__m128i prev_input = _mm_setzero_si128();
+	__m128i prev_incomplete = _mm_setzero_si128();
+	const __m128i max = _mm_loadu_si128((const __m128i*)(incomplete_max + 16));
+	char tail[16];
+	size_t i = 0;
+	while (i < len)
+	{
+		__m128i input;
+		if (len - i >= 16)
+		{
+			input = _mm_loadu_si128((const __m128i*)(str + i));
+		}
+		else
+		{
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, str + i, len - i);
+			input = _mm_loadu_si128((const __m128i*)tail);
+		}
+		if (_mm_movemask_epi8(input) == 0)
+		{
+			error = _mm_or_si128(error, prev_incomplete);
+			prev_incomplete = _mm_setzero_si128();
+		}
+		else
+		{
+			error = _mm_or_si128(error, check_sse4(input, prev_input));
+			prev_incomplete = _mm_subs_epu8(input, max);
+		}
+		prev_input = input;
+		i += 16;
+	}
+	error = _mm_or_si128(error, prev_incomplete);
+	return _mm_testz_si128(error, error);
+}
+
+//256位的alignr在两个128位通道内分别进行，先把上一块的高半和本块的低半拼成跨通道的前一块
+UTF8_TARGET("avx2")
+static __m256i check_avx2(__m256i input, __m256i prev_input)
+{
+	const __m256i low4 = _mm256_set1_epi8(0x0F);
+	__m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+	__m256i prev1 = _mm256_alignr_epi8(input, shifted, 16 - 1);
+	__m256i byte_1_high = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)table_byte_1_high)), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low4));
+	__m256i byte_1_low = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)table_byte_1_low)), _mm256_and_si256(prev1, low4));
+	__m256i byte_2_high = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)table_byte_2_high)), _mm256_and_si256(_mm256_srli_epi16(input, 4), low4));
+	__m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+	__m256i prev2 = _mm256_alignr_epi8(input, shifted, 16 - 2);
+	__m256i prev3 = _mm256_alignr_epi8(input, shifted, 16 - 3);
+	__m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+	__m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+	__m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+	return _mm256_xor_si256(must23, special);
+}
+
+UTF8_TARGET("avx2")
+static int valid_avx2(const char* str, size_t len)
+{
+	__m256i error = _mm256_setzero_si256();
+	__m256i prev_input = _mm256_setzero_si256();
+	__m256i prev_incomplete = _mm256_setzero_si256();
+	const __m256i max = _mm256_loadu_si256((const __m256i*)incomplete_max);
+	char tail[32];
+	size_t i = 0;
+	while (i < len)
+	{
+		__m256i input;
+		if (len - i >= 32)
+		{
+			input = _mm256_loadu_si256((const __m256i*)(str + i));
+		}
+		else
+		{
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, str + i, len - i);
+			input = _mm256_loadu_si256((const __m256i*)tail);
+		}
+		if (_mm256_movemask_epi8(input) == 0)
+		{
+			error = _mm256_or_si256(error, prev_incomplete);
+			prev_incomplete = _mm256_setzero_si256();
+		}
+		else
+		{
+			error = _mm256_or_si256(error, check_avx2(input, prev_input));
+			prev_incomplete = _mm256_subs_epu8(input, max);
+		}
+		prev_input = input;
+		i += 32;
+	}
+	error = _mm256_or_si256(error, prev_incomplete);
+	return _mm256_testz_si256(error, error);
+}
+
+//AVX2还需要操作系统保存ymm寄存器(XCR0的第1、2位)
+static int detect()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int leaves = info[0];
+	__cpuid(info, 1);
+	int sse4 = (info[2] & (1 << 19)) != 0;
+	int osxsave = (info[2] & (1 << 27)) != 0;
+	int avx = (info[2] & (1 << 28)) != 0;
+	int avx2 = 0;
+	if (leaves >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+	if (avx2 && avx && osxsave && (_xgetbv(0) & 6) == 6)
+		return UTF8_AVX2;
+	return sse4 ? UTF8_SSE4 : UTF8_SCALAR;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return UTF8_AVX2;
+	return __builtin_cpu_supports("sse4.1") ? UTF8_SSE4 : UTF8_SCALAR;
+#endif
+}
+
+#else
+
+static int detect()
+{
+	return UTF8_SCALAR;
+}
+
+#endif
+
+//-2表示还没有检测
+static std::atomic<int> current(-2);
+static std::atomic<int> supported(-2);
+
+int utf8_impl(int force)
+{
+	int impl = current.load(std::memory_order_relaxed);
+	if (impl == -2)
+	{
+		impl = detect();
+		supported.store(impl);
+		current.store(impl);
+	}
+	if (force >= UTF8_SCALAR && force <= supported.load())
+	{
+		current.store(force);
+		impl = force;
+	}
+	return impl;
+}
+
+//短字符串直接逐字节，向量化的收益抵不上补齐的开销
+int utf8_valid(const char* str, size_t len)
+{
+	if (len < 16)
+		return utf8_valid_scalar(str, len);
+#ifdef UTF8_SIMD
+	switch (utf8_impl(-1))
+	{
+	case UTF8_AVX2:
+		return valid_avx2(str, len);
+	case UTF8_SSE4:
+		return valid_sse4(str, len);
+	}
+#endif
+	return utf8_valid_scalar(str, len);
+}
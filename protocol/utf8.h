@@ -0,0 +1,19 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+//UTF-8校验：拒绝截断的序列、多余的后续字节、超长编码、代理区(U+D800~U+DFFF)和超过U+10FFFF的码点。
+//首次调用时按CPU选择AVX2、SSE4.1或逐字节的实现，结果完全相同
+
+#define UTF8_SCALAR	0
+#define UTF8_SSE4	1
+#define UTF8_AVX2	2
+
+//合法返回1
+int utf8_valid(const char* str, size_t len);
+int utf8_valid_scalar(const char* str, size_t len);
+//当前使用的实现，force为UTF8_*时改为指定的实现(CPU不支持时不改)，-1只查询
+int utf8_impl(int force);
+
+#endif
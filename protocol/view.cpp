@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "view.h"
+
+static int skip_field(struct read_buffer* reader, struct field* f, int depth)
+{
+	//定长数组的个数必须与定义一致
+	size_t count;
+	struct read_buffer peek = *reader;
+	if (f->field_type.size && (wire_read_count(&peek, &count) < 0 || count != (size_t)f->field_type.size))
+		return -1;
+
+	if (f->field_type.type == TYPE_MAP)
+	{
+		struct field key;
+		struct field value;
+		map_entry(f, &key, &value);
+		if (wire_read_count(reader, &count) < 0)
+			return -1;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (skip_field(reader, &key, depth) < 0 || skip_field(reader, &value, depth) < 0)
+				return -1;
+		}
+		return 0;
+	}
+	if (f->field_type.type != TYPE_PROTOCOL)
+		return wire_skip(reader, f->field_type.type);
+
+	if (!f->field_type.isarray)
+		return skip_protocol(reader, f->field_type.protocol, depth + 1);
+
+	if (wire_read_count(reader, &count) < 0)
+		return -1;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (skip_protocol(reader, f->field_type.protocol, depth + 1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static unsigned int field_key(struct field* f)
+{
+	return WIRE_KEY(f->tag, wire_tag_type(f->field_type.type));
+}
+
+//可选字段的值，数组和协议外面包了一层长度
+static int skip_tagged_field(struct read_buffer* reader, struct field* f, int depth)
+{
+	if (f->field_type.type == TYPE_STRING || wire_tag_type(f->field_type.type) != WIRE_BYTES)
+		return skip_field(reader, f, depth);
+
+	size_t n;
+	if (wire_read_count(reader, &n) < 0)
+		return -1;
+	size_t size = reader->size;
+	reader->size = reader->offset + n;
+	int ret = skip_field(reader, f, depth);
+	if (reader->offset != reader->size)
+		ret = -1;
+	reader->size = size;
+	return ret;
+}
+
+static struct field* find_tag(struct protocol* ptl, unsigned int key)
+{
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag != 0 && field_key(f) == key)
+			return f;
+	}
+	return NULL;
+}
+
+//跳过位图和存在的位置字段，到达target(ptl->size表示全部)时停止，返回target是否存在
+static int skip_positional(struct read_buffer* reader, struct protocol* ptl, int target, int depth)
+{
+	const char* bitmap;
+	if (wire_read_bitmap(reader, WIRE_BITMAP_SIZE(protocol_positional(ptl)), &bitmap) < 0)
+		return -1;
+	int bit = 0;
+	for (int i = 0; i < ptl->size; i++)
+	{
+		struct field* f = ptl->field[i];
+		if (f->tag != 0)
+			continue;
+		if (i == target)
+			return WIRE_BIT(bitmap, bit);
+		if (WIRE_BIT(bitmap, bit))
+		{
+			//bool的值就是这一位，没有数据
+			if (f->field_type.type != TYPE_BOOL && skip_field(reader, f, depth) < 0)
+				return -1;
+		}
+		else if ((f->field_type.type == TYPE_PROTOCOL && !f->field_type.isarray) || f->field_type.size)
+		{
+			//嵌套协议和定长数组总是写入
+			return -1;
+		}
+		bit++;
+	}
+	return 0;
+}
+
+int skip_protocol(struct read_buffer* reader, struct protocol* ptl, int depth)
+{
+	//协议直接或间接包含自身时，防止无限递归
+	if (depth > VIEW_MAX_DEPTH)
+		return -1;
+	if (skip_positional(reader, ptl, ptl->size, depth) < 0)
+		return -1;
+
+	//认识的可选字段完整校验，不认识的按key类型跳过
+	unsigned int key;
+	for (;;)
+	{
+		if (wire_read_key(reader, &key) < 0)
+			return -1;
+		if (key == 0)
+			return 0;
+		struct field* f = find_tag(ptl, key);
+		if (f ? skip_tagged_field(reader, f, depth) < 0 : wire_skip_value(reader, key) < 0)
+			return -1;
+	}
+}
+
+message_view decode_view(struct protocol* ptl, const char* data, size_t size)
+{
+	struct read_buffer reader;
+	reader_init(&reader, data, size);
+	if (skip_protocol(&reader, ptl, 0) < 0 || reader.offset != size)
+		return message_view();
+	return message_view(ptl, data, size);
+}
+
+int message_view::field_index(const char* name) const
+{
+	for (int i = 0; i < ptl_->size; i++)
+	{
+		if (strcmp(ptl_->field[i]->name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+bool message_view::has(int index) const
+{
+	struct read_buffer reader;
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	return seek(index, ptl_->field[index]->field_type.type, &reader);
+}
+
+bool message_view::locate(int index, struct read_buffer* reader) const
+{
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	return seek(index, ptl_->field[index]->field_type.type, reader);
+}
+
+//数据在decode_view时已经校验过，这里的跳过不会失败。
+//位置字段取默认值或可选字段不存在时返回false，取值函数返回默认值
+bool message_view::seek(int index, int type, struct read_buffer* reader) const
+{
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	assert(ptl_->field[index]->field_type.type == type);
+	reader_init(reader, data_, size_);
+	struct field* target = ptl_->field[index];
+	if (target->tag == 0)
+		return skip_positional(reader, ptl_, index, 0) > 0;
+
+	if (skip_positional(reader, ptl_, ptl_->size, 0) < 0)
+		return false;
+	unsigned int key;
+	unsigned int expect = field_key(target);
+	while (wire_read_key(reader, &key) == 0 && key != 0)
+	{
+		if (key == expect)
+		{
+			size_t n;
+			if (type != TYPE_STRING && WIRE_KEY_TYPE(key) == WIRE_BYTES)
+				return wire_read_count(reader, &n) == 0;
+			return true;
+		}
+		if (wire_skip_value(reader, key) < 0)
+			return false;
+	}
+	return false;
+}
+
+int message_view::get_int(int index) const
+{
+	struct read_buffer reader;
+	int value = 0;
+	if (seek(index, TYPE_INT, &reader))
+		wire_read_int(&reader, &value);
+	return value;
+}
+
+float message_view::get_float(int index) const
+{
+	struct read_buffer reader;
+	float value = 0;
+	if (seek(index, TYPE_FLOAT, &reader))
+		wire_read_float(&reader, &value);
+	return value;
+}
+
+double message_view::get_double(int index) const
+{
+	struct read_buffer reader;
+	double value = 0;
+	if (seek(index, TYPE_DOUBLE, &reader))
+		wire_read_double(&reader, &value);
+	return value;
+}
+
+string_ref message_view::get_string(int index) const
+{
+	struct read_buffer reader;
+	string_ref value = { "", 0 };
+	if (seek(index, TYPE_STRING, &reader))
+		wire_read_string(&reader, &value.ptr, &value.len);
+	return value;
+}
+
+//位置字段的bool存在即为true，不读取数据
+bool message_view::get_bool(int index) const
+{
+	struct read_buffer reader;
+	unsigned long long value = 0;
+	if (!seek(index, TYPE_BOOL, &reader))
+		return false;
+	if (ptl_->field[index]->tag == 0)
+		return true;
+	wire_read_integer(&reader, TYPE_BOOL, &value);
+	return value != 0;
+}
+
+unsigned long long message_view::get_integer(int index) const
+{
+	struct read_buffer reader;
+	unsigned long long value = 0;
+	int type = ptl_->field[index]->field_type.type;
+	if (seek(index, type, &reader))
+		wire_read_integer(&reader, type, &value);
+	return value;
+}
+
+long long message_view::get_int64(int index) const
+{
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	int type = ptl_->field[index]->field_type.type;
+	assert(type_integer(type) && type_signed(type) && (type & 1) == 0);
+	return (long long)get_integer(index);
+}
+
+unsigned long long message_view::get_uint64(int index) const
+{
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	int type = ptl_->field[index]->field_type.type;
+	assert(type_integer(type) && !type_signed(type) && (type & 1) == 0);
+	return get_integer(index);
+}
+
+template<class T>
+static array_view<T> get_array(struct read_buffer* reader, int type)
+{
+	size_t count;
+	size_t bytes;
+	const char* data;
+	if (wire_read_array(reader, type, &count, &data, &bytes) < 0)
+		return array_view<T>();
+	return array_view<T>(data, count);
+}
+
+int_array_view message_view::get_int_array(int index) const
+{
+	struct read_buffer reader;
+	size_t count;
+	size_t bytes;
+	const char* data;
+	if (!seek(index, TYPE_INT_ARRAY, &reader) || wire_read_array(&reader, TYPE_INT_ARRAY, &count, &data, &bytes) < 0)
+		return int_array_view();
+	return int_array_view(data, bytes, count);
+}
+
+array_view<float> message_view::get_float_array(int index) const
+{
+	struct read_buffer reader;
+	if (!seek(index, TYPE_FLOAT_ARRAY, &reader))
+		return array_view<float>();
+	return get_array<float>(&reader, TYPE_FLOAT_ARRAY);
+}
+
+array_view<double> message_view::get_double_array(int index) const
+{
+	struct read_buffer reader;
+	if (!seek(index, TYPE_DOUBLE_ARRAY, &reader))
+		return array_view<double>();
+	return get_array<double>(&reader, TYPE_DOUBLE_ARRAY);
+}
+
+string_array_view message_view::get_string_array(int index) const
+{
+	struct read_buffer reader;
+	size_t count;
+	if (!seek(index, TYPE_STRING_ARRAY, &reader) || wire_read_count(&reader, &count) < 0)
+		return string_array_view();
+	return string_array_view(reader.ptr + reader.offset, reader.size - reader.offset, count);
+}
+
+integer_array_view message_view::get_integer_array(int index) const
+{
+	struct read_buffer reader;
+	size_t count;
+	size_t bytes;
+	const char* data;
+	assert(ptl_ != NULL && index >= 0 && index < ptl_->size);
+	int type = ptl_->field[index]->field_type.type;
+	assert(type_integer(type) && (type & 1));
+	if (!seek(index, type, &reader) || wire_read_array(&reader, type, &count, &data, &bytes) < 0)
+		return integer_array_view();
+	return integer_array_view(data, bytes, count, type - 1);
+}
+
+bool_array_view message_view::get_bool_array(int index) const
+{
+	struct read_buffer reader;
+	size_t count;
+	size_t bytes;
+	const char* data;
+	if (!seek(index, TYPE_BOOL_ARRAY, &reader) || wire_read_array(&reader, TYPE_BOOL_ARRAY, &count, &data, &bytes) < 0)
+		return bool_array_view();
+	return bool_array_view(data, count);
+}
+
+message_view message_view::get_message(int index) const
+{
+	struct read_buffer reader;
+	if (!seek(index, TYPE_PROTOCOL, &reader) || ptl_->field[index]->field_type.isarray)
+		return message_view();
+	struct protocol* ptl = ptl_->field[index]->field_type.protocol;
+	size_t begin = reader.offset;
+	if (skip_protocol(&reader, ptl, 0) < 0)
+		return message_view();
+	return message_view(ptl, reader.ptr + begin, reader.offset - begin);
+}
+
+message_array_view message_view::get_message_array(int index) const
+{
+	struct read_buffer reader;
+	size_t count;
+	if (!seek(index, TYPE_PROTOCOL, &reader) || !ptl_->field[index]->field_type.isarray || wire_read_count(&reader, &count) < 0)
+		return message_array_view();
+	return message_array_view(ptl_->field[index]->field_type.protocol, reader.ptr + reader.offset, reader.size - reader.offset, count);
+}
+
+void int_array_view::copy_to(int* values) const
+{
+	const char* ptr = data_;
+	for (size_t i = 0; i < size_; i++)
+		wire_next_int(&ptr, data_ + bytes_, &values[i]);
+}
+
+string_ref string_array_view::iterator::operator*() const
+{
+	struct read_buffer reader = reader_;
+	string_ref value = { "", 0 };
+	wire_read_string(&reader, &value.ptr, &value.len);
+	return value;
+}
+
+string_array_view::iterator& string_array_view::iterator::operator++()
+{
+	wire_skip(&reader_, TYPE_STRING);
+	index_++;
+	return *this;
+}
+
+message_view message_array_view::iterator::operator*() const
+{
+	struct read_buffer reader = reader_;
+	if (skip_protocol(&reader, ptl_, 0) < 0)
+		return message_view();
+	return message_view(ptl_, reader_.ptr + reader_.offset, reader.offset - reader_.offset);
+}
+
+message_array_view::iterator& message_array_view::iterator::operator++()
+{
+	skip_protocol(&reader_, ptl_, 0);
+	index_++;
+	return *this;
+}
@@ -0,0 +1,275 @@
+#ifndef VIEW_H
+#define VIEW_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "wire.h"
+
+//C++只读视图：decode_view对整个消息校验一次，返回的视图不分配内存，
+//字符串为指向输入数据的(指针,长度)，数组为数据上的span，只在访问时才定位字段
+
+#define VIEW_MAX_DEPTH 64
+
+struct string_ref {
+	const char* ptr;
+	size_t len;
+};
+
+template<class T>
+inline T view_load(const char* ptr);
+
+//偏移表格式的int为定长小端int32
+template<>
+inline int view_load<int>(const char* ptr)
+{
+	const unsigned char* p = (const unsigned char*)ptr;
+	return (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+}
+
+template<>
+inline float view_load<float>(const char* ptr)
+{
+	float value;
+	wire_copy_float(&value, ptr, 1);
+	return value;
+}
+
+template<>
+inline double view_load<double>(const char* ptr)
+{
+	double value;
+	wire_copy_double(&value, ptr, 1);
+	return value;
+}
+
+//float[]/double[](以及偏移表格式的int[])为定长数据，支持随机访问和整块拷贝
+template<class T>
+class array_view {
+public:
+	array_view() : data_(NULL), size_(0) {}
+	array_view(const char* data, size_t size) : data_(data), size_(size) {}
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	T operator[](size_t i) const { return view_load<T>(data_ + i * sizeof(T)); }
+	void copy_to(T* values) const;
+
+private:
+	const char* data_;
+	size_t size_;
+};
+
+template<>
+inline void array_view<int>::copy_to(int* values) const
+{
+	for (size_t i = 0; i < size_; i++)
+		values[i] = view_load<int>(data_ + i * sizeof(int));
+}
+
+template<>
+inline void array_view<float>::copy_to(float* values) const { wire_copy_float(values, data_, size_); }
+
+template<>
+inline void array_view<double>::copy_to(double* values) const { wire_copy_double(values, data_, size_); }
+
+//int[]为变长的varint序列，只能顺序遍历
+class int_array_view {
+public:
+	class iterator {
+	public:
+		iterator(const char* ptr, const char* end) : ptr_(ptr), end_(end), value_(0) { load(); }
+		int operator*() const { return value_; }
+		iterator& operator++() { ptr_ = next_; load(); return *this; }
+		bool operator!=(const iterator& other) const { return ptr_ != other.ptr_; }
+	private:
+		void load()
+		{
+			//数据损坏时直接到末尾，不会停在原地
+			next_ = ptr_;
+			if (ptr_ != end_ && wire_next_int(&next_, end_, &value_) < 0)
+				next_ = end_;
+		}
+		const char* ptr_;
+		const char* next_;
+		const char* end_;
+		int value_;
+	};
+
+	int_array_view() : data_(NULL), bytes_(0), size_(0) {}
+	int_array_view(const char* data, size_t bytes, size_t size) : data_(data), bytes_(bytes), size_(size) {}
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	iterator begin() const { return iterator(data_, data_ + bytes_); }
+	iterator end() const { return iterator(data_ + bytes_, data_ + bytes_); }
+	void copy_to(int* values) const;
+
+private:
+	const char* data_;
+	size_t bytes_;
+	size_t size_;
+};
+
+//扩展整数和枚举的数组与int[]相同为varint序列，元素为64位值，有符号类型转为long long即可
+class integer_array_view {
+public:
+	class iterator {
+	public:
+		iterator(const char* ptr, const char* end, int type) : ptr_(ptr), end_(end), type_(type), value_(0) { load(); }
+		unsigned long long operator*() const { return value_; }
+		iterator& operator++() { ptr_ = next_; load(); return *this; }
+		bool operator!=(const iterator& other) const { return ptr_ != other.ptr_; }
+	private:
+		void load()
+		{
+			//数据损坏时直接到末尾，不会停在原地
+			next_ = ptr_;
+			if (ptr_ != end_ && wire_next_integer(&next_, end_, type_, &value_) < 0)
+				next_ = end_;
+		}
+		const char* ptr_;
+		const char* next_;
+		const char* end_;
+		int type_;
+		unsigned long long value_;
+	};
+
+	integer_array_view() : data_(NULL), bytes_(0), size_(0), type_(TYPE_INT) {}
+	integer_array_view(const char* data, size_t bytes, size_t size, int type) : data_(data), bytes_(bytes), size_(size), type_(type) {}
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	iterator begin() const { return iterator(data_, data_ + bytes_, type_); }
+	iterator end() const { return iterator(data_ + bytes_, data_ + bytes_, type_); }
+
+private:
+	const char* data_;
+	size_t bytes_;
+	size_t size_;
+	//元素类型
+	int type_;
+};
+
+//bool[]按位打包，支持随机访问
+class bool_array_view {
+public:
+	bool_array_view() : data_(NULL), size_(0) {}
+	bool_array_view(const char* data, size_t size) : data_(data), size_(size) {}
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	bool operator[](size_t i) const { return WIRE_BIT(data_, i) != 0; }
+
+private:
+	const char* data_;
+	size_t size_;
+};
+
+class string_array_view {
+public:
+	class iterator {
+	public:
+		iterator(const char* data, size_t size, size_t index) : index_(index) { reader_init(&reader_, data, size); }
+		string_ref operator*() const;
+		iterator& operator++();
+		bool operator!=(const iterator& other) const { return index_ != other.index_; }
+	private:
+		struct read_buffer reader_;
+		size_t index_;
+	};
+
+	string_array_view() : data_(NULL), bytes_(0), size_(0) {}
+	string_array_view(const char* data, size_t bytes, size_t size) : data_(data), bytes_(bytes), size_(size) {}
+
+	size_t size() const { return size_; }
+	iterator begin() const { return iterator(data_, bytes_, 0); }
+	iterator end() const { return iterator(data_, bytes_, size_); }
+
+private:
+	const char* data_;
+	size_t bytes_;
+	size_t size_;
+};
+
+class message_view {
+public:
+	message_view() : ptl_(NULL), data_(NULL), size_(0) {}
+	message_view(struct protocol* ptl, const char* data, size_t size) : ptl_(ptl), data_(data), size_(size) {}
+
+	bool valid() const { return ptl_ != NULL; }
+	struct protocol* protocol() const { return ptl_; }
+	const char* data() const { return data_; }
+	size_t size() const { return size_; }
+
+	//字段下标可以缓存，避免每次按名字查找
+	int field_index(const char* name) const;
+	//位置字段取默认值时不写入，可选字段只有编码时给出了值才存在
+	bool has(int index) const;
+	//reader定位到字段值的开头(可选字段的外层长度之后)，字段不存在时返回false
+	bool locate(int index, struct read_buffer* reader) const;
+
+	int get_int(int index) const;
+	float get_float(int index) const;
+	double get_double(int index) const;
+	string_ref get_string(int index) const;
+	bool get_bool(int index) const;
+	//int和int8~int64
+	long long get_int64(int index) const;
+	//无符号整数和枚举
+	unsigned long long get_uint64(int index) const;
+	int_array_view get_int_array(int index) const;
+	array_view<float> get_float_array(int index) const;
+	array_view<double> get_double_array(int index) const;
+	string_array_view get_string_array(int index) const;
+	//int[]以外的整数数组和枚举数组
+	integer_array_view get_integer_array(int index) const;
+	bool_array_view get_bool_array(int index) const;
+	message_view get_message(int index) const;
+	class message_array_view get_message_array(int index) const;
+
+private:
+	bool seek(int index, int type, struct read_buffer* reader) const;
+	unsigned long long get_integer(int index) const;
+
+	struct protocol* ptl_;
+	const char* data_;
+	size_t size_;
+};
+
+class message_array_view {
+public:
+	class iterator {
+	public:
+		iterator(struct protocol* ptl, const char* data, size_t size, size_t index) : ptl_(ptl), index_(index) { reader_init(&reader_, data, size); }
+		message_view operator*() const;
+		iterator& operator++();
+		bool operator!=(const iterator& other) const { return index_ != other.index_; }
+	private:
+		struct protocol* ptl_;
+		struct read_buffer reader_;
+		size_t index_;
+	};
+
+	message_array_view() : ptl_(NULL), data_(NULL), bytes_(0), size_(0) {}
+	message_array_view(struct protocol* ptl, const char* data, size_t bytes, size_t size) : ptl_(ptl), data_(data), bytes_(bytes), size_(size) {}
+
+	size_t size() const { return size_; }
+	iterator begin() const { return iterator(ptl_, data_, bytes_, 0); }
+	iterator end() const { return iterator(ptl_, data_, bytes_, size_); }
+
+private:
+	struct protocol* ptl_;
+	const char* data_;
+	size_t bytes_;
+	size_t size_;
+};
+
+//校验失败返回无效视图(valid()为false)
+message_view decode_view(struct protocol* ptl, const char* data, size_t size);
+
+//跳过一个完整的协议实例，数据不合法返回-1
+int skip_protocol(struct read_buffer* reader, struct protocol* ptl, int depth);
+
+#endif
@@ -0,0 +1,845 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "wire.h"
+
+void buffer_init(struct write_buffer* buffer)
+{
+	buffer->ptr = buffer->init;
+	buffer->size = WIRE_BUFFER_SIZE;
+	buffer->offset = 0;
+}
+
+void buffer_reserve(struct write_buffer* buffer, size_t len)
+{
+	if (buffer->offset + len > buffer->size)
+	{
+		size_t nsize = buffer->size * 2;
+		while (nsize < buffer->offset + len)
+		{
+			nsize = nsize * 2;
+		}
+		char* nptr = (char*)malloc(nsize);
+		memcpy(nptr, buffer->ptr, buffer->offset);
+		buffer->size = nsize;
+
+		if (buffer->ptr != buffer->init)
+			free(buffer->ptr);
+		buffer->ptr = nptr;
+	}
+}
+
+void buffer_reset(struct write_buffer* buffer)
+{
+	buffer->offset = 0;
+}
+
+void buffer_release(struct write_buffer* buffer)
+{
+	if (buffer->ptr != buffer->init)
+		free(buffer->ptr);
+	buffer_init(buffer);
+}
+
+void buffer_addchar(struct write_buffer* buffer, char c)
+{
+	buffer_reserve(buffer, 1);
+	buffer->ptr[buffer->offset++] = c;
+}
+
+void buffer_addstring(struct write_buffer* buffer, const char* str)
+{
+	buffer_addlstring(buffer, str, strlen(str));
+}
+
+void buffer_addlstring(struct write_buffer* buffer, const char* str, size_t len)
+{
+	buffer_reserve(buffer, len);
+	memcpy(buffer->ptr + buffer->offset, str, len);
+	buffer->offset += len;
+}
+
+static void write_uint32(struct write_buffer* buffer, unsigned int value)
+{
+	buffer_reserve(buffer, 4);
+	unsigned char* ptr = (unsigned char*)buffer->ptr + buffer->offset;
+	ptr[0] = value & 0xff;
+	ptr[1] = (value >> 8) & 0xff;
+	ptr[2] = (value >> 16) & 0xff;
+	ptr[3] = (value >> 24) & 0xff;
+	buffer->offset += 4;
+}
+
+static size_t encode_uvarint(unsigned char* ptr, unsigned long long value)
+{
+	size_t n = 0;
+	while (value >= 0x80)
+	{
+		ptr[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	ptr[n++] = (unsigned char)value;
+	return n;
+}
+
+void wire_write_uvarint(struct write_buffer* buffer, unsigned long long value)
+{
+	buffer_reserve(buffer, WIRE_MAX_VARINT);
+	buffer->offset += encode_uvarint((unsigned char*)buffer->ptr + buffer->offset, value);
+}
+
+void wire_write_int(struct write_buffer* buffer, int value)
+{
+	//zigzag：绝对值小的负数也编码为短varint
+	unsigned int u = ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+	buffer_reserve(buffer, 5);
+	buffer->offset += encode_uvarint((unsigned char*)buffer->ptr + buffer->offset, u);
+}
+
+void wire_write_float(struct write_buffer* buffer, float value)
+{
+	unsigned int u;
+	memcpy(&u, &value, sizeof(u));
+	write_uint32(buffer, u);
+}
+
+void wire_write_double(struct write_buffer* buffer, double value)
+{
+	unsigned int u[2];
+	memcpy(u, &value, sizeof(u));
+#ifdef WIRE_BIG_ENDIAN
+	write_uint32(buffer, u[1]);
+	write_uint32(buffer, u[0]);
+#else
+	write_uint32(buffer, u[0]);
+	write_uint32(buffer, u[1]);
+#endif
+}
+
+void wire_write_count(struct write_buffer* buffer, size_t count)
+{
+	wire_write_uvarint(buffer, count);
+}
+
+void wire_write_string(struct write_buffer* buffer, const char* str, size_t len)
+{
+	buffer_reserve(buffer, WIRE_MAX_VARINT + len);
+	buffer->offset += encode_uvarint((unsigned char*)buffer->ptr + buffer->offset, len);
+	memcpy(buffer->ptr + buffer->offset, str, len);
+	buffer->offset += len;
+}
+
+void wire_write_integer(struct write_buffer* buffer, int type, unsigned long long value)
+{
+	buffer_reserve(buffer, WIRE_MAX_VARINT);
+	wire_put_integer(buffer, type, value);
+}
+
+size_t wire_begin_bitmap(struct write_buffer* buffer, size_t bytes)
+{
+	buffer_reserve(buffer, bytes);
+	return wire_put_bitmap(buffer, bytes);
+}
+
+//长度先按最长的5字节预留，写完内容后再把数据前移到实际长度之后
+#define BLOCK_RESERVE WIRE_MAX_INT
+
+static size_t reserve_block(struct write_buffer* buffer, size_t reserve)
+{
+	buffer_reserve(buffer, BLOCK_RESERVE + reserve);
+	size_t mark = buffer->offset;
+	buffer->offset += BLOCK_RESERVE;
+	return mark;
+}
+
+void wire_end_block(struct write_buffer* buffer, size_t mark)
+{
+	size_t bytes = buffer->offset - mark - BLOCK_RESERVE;
+	unsigned char* ptr = (unsigned char*)buffer->ptr + mark;
+	unsigned char len[BLOCK_RESERVE];
+	size_t n = encode_uvarint(len, bytes);
+	memmove(ptr + n, ptr + BLOCK_RESERVE, bytes);
+	memcpy(ptr, len, n);
+	buffer->offset = mark + n + bytes;
+}
+
+size_t wire_begin_block(struct write_buffer* buffer)
+{
+	return reserve_block(buffer, 0);
+}
+
+size_t wire_begin_int_array(struct write_buffer* buffer, size_t count)
+{
+	wire_write_count(buffer, count);
+	if (count == 0)
+		return (size_t)-1;
+	return reserve_block(buffer, count * 5);
+}
+
+void wire_end_int_array(struct write_buffer* buffer, size_t mark)
+{
+	if (mark != (size_t)-1)
+		wire_end_block(buffer, mark);
+}
+
+void wire_write_int_array(struct write_buffer* buffer, const int* values, size_t count)
+{
+	size_t mark = wire_begin_int_array(buffer, count);
+	for (size_t i = 0; i < count; i++)
+		wire_write_int(buffer, values[i]);
+	wire_end_int_array(buffer, mark);
+}
+
+void wire_write_integer_array(struct write_buffer* buffer, int type, const unsigned long long* values, size_t count)
+{
+	wire_write_count(buffer, count);
+	if (count == 0)
+		return;
+	size_t mark = reserve_block(buffer, count * WIRE_MAX_VARINT);
+	for (size_t i = 0; i < count; i++)
+		wire_put_integer(buffer, type, values[i]);
+	wire_end_block(buffer, mark);
+}
+
+void wire_write_bool_array(struct write_buffer* buffer, const bool* values, size_t count)
+{
+	wire_write_count(buffer, count);
+	size_t mark = wire_begin_bitmap(buffer, WIRE_BITMAP_SIZE(count));
+	for (size_t i = 0; i < count; i++)
+	{
+		if (values[i])
+			wire_set_bit(buffer, mark, (int)i);
+	}
+}
+
+void wire_write_float_array(struct write_buffer* buffer, const float* values, size_t count)
+{
+	wire_write_count(buffer, count);
+#ifdef WIRE_BIG_ENDIAN
+	for (size_t i = 0; i < count; i++)
+		wire_write_float(buffer, values[i]);
+#else
+	buffer_reserve(buffer, count * sizeof(float));
+	memcpy(buffer->ptr + buffer->offset, values, count * sizeof(float));
+	buffer->offset += count * sizeof(float);
+#endif
+}
+
+void wire_write_double_array(struct write_buffer* buffer, const double* values, size_t count)
+{
+	wire_write_count(buffer, count);
+#ifdef WIRE_BIG_ENDIAN
+	for (size_t i = 0; i < count; i++)
+		wire_write_double(buffer, values[i]);
+#else
+	buffer_reserve(buffer, count * sizeof(double));
+	memcpy(buffer->ptr + buffer->offset, values, count * sizeof(double));
+	buffer->offset += count * sizeof(double);
+#endif
+}
+
+void reader_init(struct read_buffer* reader, const char* ptr, size_t size)
+{
+	reader->ptr = ptr;
+	reader->size = size;
+	reader->offset = 0;
+}
+
+static int decode_uvarint(const unsigned char** ptr, const unsigned char* end, unsigned long long* value)
+{
+	const unsigned char* p = *ptr;
+	unsigned long long result = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		if (p == end)
+			return -1;
+		unsigned char c = *p++;
+		result |= (unsigned long long)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0)
+		{
+			*ptr = p;
+			*value = result;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int wire_read_uvarint(struct read_buffer* reader, unsigned long long* value)
+{
+	const unsigned char* ptr = (const unsigned char*)reader->ptr + reader->offset;
+	if (decode_uvarint(&ptr, (const unsigned char*)reader->ptr + reader->size, value) < 0)
+		return -1;
+	reader->offset = (const char*)ptr - reader->ptr;
+	return 0;
+}
+
+static int read_uint32(struct read_buffer* reader, unsigned int* value)
+{
+	if (reader->size - reader->offset < 4)
+		return -1;
+	const unsigned char* ptr = (const unsigned char*)reader->ptr + reader->offset;
+	*value = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int)ptr[3] << 24);
+	reader->offset += 4;
+	return 0;
+}
+
+int wire_next_int(const char** ptr, const char* end, int* value)
+{
+	unsigned long long u;
+	const unsigned char* p = (const unsigned char*)*ptr;
+	if (decode_uvarint(&p, (const unsigned char*)end, &u) < 0)
+		return -1;
+	*ptr = (const char*)p;
+	unsigned int z = (unsigned int)u;
+	*value = (int)((z >> 1) ^ (0u - (z & 1)));
+	return 0;
+}
+
+int wire_read_int(struct read_buffer* reader, int* value)
+{
+	const char* ptr = reader->ptr + reader->offset;
+	if (wire_next_int(&ptr, reader->ptr + reader->size, value) < 0)
+		return -1;
+	reader->offset = ptr - reader->ptr;
+	return 0;
+}
+
+int wire_next_integer(const char** ptr, const char* end, int type, unsigned long long* value)
+{
+	unsigned long long u;
+	const unsigned char* p = (const unsigned char*)*ptr;
+	if (decode_uvarint(&p, (const unsigned char*)end, &u) < 0)
+		return -1;
+	if (type_signed(type))
+		u = (unsigned long long)wire_unzigzag(u);
+	if (!wire_integer_fits(type, u))
+		return -1;
+	*ptr = (const char*)p;
+	*value = u;
+	return 0;
+}
+
+int wire_read_integer(struct read_buffer* reader, int type, unsigned long long* value)
+{
+	const char* ptr = reader->ptr + reader->offset;
+	if (wire_next_integer(&ptr, reader->ptr + reader->size, type, value) < 0)
+		return -1;
+	reader->offset = ptr - reader->ptr;
+	return 0;
+}
+
+int wire_read_float(struct read_buffer* reader, float* value)
+{
+	unsigned int u;
+	if (read_uint32(reader, &u) < 0)
+		return -1;
+	memcpy(value, &u, sizeof(u));
+	return 0;
+}
+
+int wire_read_double(struct read_buffer* reader, double* value)
+{
+	unsigned int u[2];
+#ifdef WIRE_BIG_ENDIAN
+	if (read_uint32(reader, &u[1]) < 0 || read_uint32(reader, &u[0]) < 0)
+		return -1;
+#else
+	if (read_uint32(reader, &u[0]) < 0 || read_uint32(reader, &u[1]) < 0)
+		return -1;
+#endif
+	memcpy(value, u, sizeof(u));
+	return 0;
+}
+
+int wire_read_count(struct read_buffer* reader, size_t* count)
+{
+	unsigned long long u;
+	if (wire_read_uvarint(reader, &u) < 0)
+		return -1;
+	//每个元素至少占1字节，超过剩余数据长度必然不合法
+	if (u > reader->size - reader->offset && u != 0)
+		return -1;
+	*count = (size_t)u;
+	return 0;
+}
+
+int wire_read_string(struct read_buffer* reader, const char** str, size_t* len)
+{
+	size_t size;
+	if (wire_read_count(reader, &size) < 0)
+		return -1;
+	*str = reader->ptr + reader->offset;
+	*len = size;
+	reader->offset += size;
+	return 0;
+}
+
+int wire_read_bitmap(struct read_buffer* reader, size_t bytes, const char** bitmap)
+{
+	if (bytes > reader->size - reader->offset)
+		return -1;
+	*bitmap = reader->ptr + reader->offset;
+	reader->offset += bytes;
+	return 0;
+}
+
+int wire_read_array(struct read_buffer* reader, int type, size_t* count, const char** data, size_t* bytes)
+{
+	size_t size;
+	//bool[]每字节8个元素，个数按剩余位数检查；先取整再比较会在u接近2^64时回绕
+	if (type == TYPE_BOOL_ARRAY)
+	{
+		unsigned long long u;
+		if (wire_read_uvarint(reader, &u) < 0 || u > (unsigned long long)(reader->size - reader->offset) * 8)
+			return -1;
+		*count = (size_t)u;
+		type = -1;
+	}
+	else if (wire_read_count(reader, count) < 0)
+	{
+		return -1;
+	}
+
+	switch (type)
+	{
+	case -1:
+		size = WIRE_BITMAP_SIZE(*count);
+		break;
+	case TYPE_INT_ARRAY:
+	case TYPE_INT8_ARRAY:
+	case TYPE_INT16_ARRAY:
+	case TYPE_INT64_ARRAY:
+	case TYPE_UINT8_ARRAY:
+	case TYPE_UINT16_ARRAY:
+	case TYPE_UINT32_ARRAY:
+	case TYPE_UINT64_ARRAY:
+	case TYPE_ENUM_ARRAY:
+		if (*count == 0)
+			size = 0;
+		else if (wire_read_count(reader, &size) < 0 || size < *count)
+			return -1;
+		break;
+	case TYPE_FLOAT_ARRAY:
+		if (*count > (reader->size - reader->offset) / 4)
+			return -1;
+		size = *count * 4;
+		break;
+	case TYPE_DOUBLE_ARRAY:
+		if (*count > (reader->size - reader->offset) / 8)
+			return -1;
+		size = *count * 8;
+		break;
+	default:
+		return -1;
+	}
+
+	*data = reader->ptr + reader->offset;
+	*bytes = size;
+	reader->offset += size;
+	return 0;
+}
+
+#ifdef WIRE_BIG_ENDIAN
+static void copy_swap(char* dst, const char* src, size_t count, size_t width)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		for (size_t j = 0; j < width; j++)
+			dst[i * width + j] = src[i * width + width - 1 - j];
+	}
+}
+#endif
+
+void wire_copy_float(float* values, const char* data, size_t count)
+{
+#ifdef WIRE_BIG_ENDIAN
+	copy_swap((char*)values, data, count, sizeof(float));
+#else
+	memcpy(values, data, count * sizeof(float));
+#endif
+}
+
+void wire_copy_double(double* values, const char* data, size_t count)
+{
+#ifdef WIRE_BIG_ENDIAN
+	copy_swap((char*)values, data, count, sizeof(double));
+#else
+	memcpy(values, data, count * sizeof(double));
+#endif
+}
+
+int wire_skip(struct read_buffer* reader, int type)
+{
+	size_t count;
+	size_t bytes;
+	const char* data;
+	switch (type)
+	{
+	case TYPE_INT:
+	{
+		int value;
+		return wire_read_int(reader, &value);
+	}
+	case TYPE_FLOAT:
+	{
+		float value;
+		return wire_read_float(reader, &value);
+	}
+	case TYPE_DOUBLE:
+	{
+		double value;
+		return wire_read_double(reader, &value);
+	}
+	case TYPE_STRING:
+		return wire_read_string(reader, &data, &bytes);
+	case TYPE_STRING_ARRAY:
+		if (wire_read_count(reader, &count) < 0)
+			return -1;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (wire_read_string(reader, &data, &bytes) < 0)
+				return -1;
+		}
+		return 0;
+	case TYPE_PROTOCOL:
+		return -1;
+	}
+	if (type & 1)
+	{
+		//整数数组逐个检查元素：恰好count个varint填满数据块，扩展整数还要检查范围
+		if (wire_read_array(reader, type, &count, &data, &bytes) < 0)
+			return -1;
+		if (!type_integer(type))
+			return 0;
+		int i32;
+		unsigned long long value;
+		const char* end = data + bytes;
+		for (size_t i = 0; i < count; i++)
+		{
+			if ((type == TYPE_INT_ARRAY ? wire_next_int(&data, end, &i32) : wire_next_integer(&data, end, type - 1, &value)) < 0)
+				return -1;
+		}
+		return data == end ? 0 : -1;
+	}
+	if (type_integer(type) || type == TYPE_BOOL)
+	{
+		unsigned long long value;
+		return wire_read_integer(reader, type, &value);
+	}
+	return -1;
+}
+
+int wire_tag_type(int type)
+{
+	if (type == TYPE_BOOL || (type_integer(type) && (type & 1) == 0))
+		return WIRE_VARINT;
+	switch (type)
+	{
+	case TYPE_FLOAT:
+		return WIRE_FIXED32;
+	case TYPE_DOUBLE:
+		return WIRE_FIXED64;
+	}
+	return WIRE_BYTES;
+}
+
+int wire_read_key(struct read_buffer* reader, unsigned int* key)
+{
+	unsigned long long u;
+	if (wire_read_uvarint(reader, &u) < 0 || u > 0xffffffffULL)
+		return -1;
+	*key = (unsigned int)u;
+	return 0;
+}
+
+int wire_skip_value(struct read_buffer* reader, unsigned int key)
+{
+	unsigned long long u;
+	size_t n;
+	switch (WIRE_KEY_TYPE(key))
+	{
+	case WIRE_VARINT:
+		return wire_read_uvarint(reader, &u);
+	case WIRE_FIXED32:
+		n = 4;
+		break;
+	case WIRE_FIXED64:
+		n = 8;
+		break;
+	default:
+		if (wire_read_count(reader, &n) < 0)
+			return -1;
+		break;
+	}
+	if (reader->size - reader->offset < n)
+		return -1;
+	reader->offset += n;
+	return 0;
+}
+
+int wire_skip_tagged(struct read_buffer* reader)
+{
+	unsigned int key;
+	for (;;)
+	{
+		if (wire_read_key(reader, &key) < 0)
+			return -1;
+		if (key == 0)
+			return 0;
+		if (wire_skip_value(reader, key) < 0)
+			return -1;
+	}
+}
+
+void batch_init(struct wire_batch* batch)
+{
+	buffer_init(&batch->buffer);
+	batch->frame = NULL;
+	batch->size = 0;
+	batch->cap = 0;
+	batch->mark = (size_t)-1;
+}
+
+void batch_reset(struct wire_batch* batch)
+{
+	buffer_reset(&batch->buffer);
+	batch->size = 0;
+	batch->mark = (size_t)-1;
+}
+
+void batch_release(struct wire_batch* batch)
+{
+	buffer_release(&batch->buffer);
+	free(batch->frame);
+	batch_init(batch);
+}
+
+void batch_begin(struct wire_batch* batch, int id)
+{
+	if (batch->size == batch->cap)
+	{
+		batch->cap = batch->cap == 0 ? 64 : batch->cap * 2;
+		batch->frame = (size_t*)realloc(batch->frame, sizeof(size_t) * batch->cap);
+	}
+	batch->frame[batch->size] = batch->buffer.offset;
+	batch->mark = reserve_block(&batch->buffer, WIRE_MAX_VARINT);
+	wire_write_uvarint(&batch->buffer, (unsigned int)id);
+}
+
+void batch_end(struct wire_batch* batch)
+{
+	wire_end_block(&batch->buffer, batch->mark);
+	batch->mark = (size_t)-1;
+	batch->size++;
+}
+
+//编码中途出错时丢弃未完成的消息
+void batch_cancel(struct wire_batch* batch)
+{
+	if (batch->mark == (size_t)-1)
+		return;
+	batch->buffer.offset = batch->frame[batch->size];
+	batch->mark = (size_t)-1;
+}
+
+int batch_iovec(struct wire_batch* batch, struct wire_iovec* iov, int first, int count)
+{
+	int n = 0;
+	for (int i = first; i < batch->size && n < count; i++, n++)
+	{
+		size_t end = i + 1 < batch->size ? batch->frame[i + 1] : batch->buffer.offset;
+		iov[n].base = batch->buffer.ptr + batch->frame[i];
+		iov[n].len = end - batch->frame[i];
+	}
+	return n;
+}
+
+int batch_next(struct read_buffer* reader, int* id, const char** data, size_t* size)
+{
+	size_t len;
+	unsigned long long u;
+	if (wire_read_count(reader, &len) < 0)
+		return -1;
+	size_t end = reader->offset + len;
+	if (wire_read_uvarint(reader, &u) < 0 || reader->offset > end || u > PROTOCOL_ID_MAX)
+		return -1;
+	*id = (int)u;
+	*data = reader->ptr + reader->offset;
+	*size = end - reader->offset;
+	reader->offset = end;
+	return 0;
+}
+
+void dict_init(struct wire_dict* d, int capacity)
+{
+	if (capacity < 1)
+		capacity = 1;
+	unsigned int buckets = 16;
+	while (buckets < (unsigned int)capacity * 2)
+		buckets *= 2;
+	d->entry = (struct dict_entry*)malloc(sizeof(struct dict_entry) * capacity);
+	memset(d->entry, 0, sizeof(struct dict_entry) * capacity);
+	d->capacity = capacity;
+	d->bucket = (int*)malloc(sizeof(int) * buckets);
+	d->mask = buckets - 1;
+	dict_reset(d);
+}
+
+//连接重建时两端同时清空，已分配的字符串空间保留
+void dict_reset(struct wire_dict* d)
+{
+	d->size = 0;
+	d->head = -1;
+	d->tail = -1;
+	memset(d->bucket, -1, sizeof(int) * (d->mask + 1));
+}
+
+void dict_release(struct wire_dict* d)
+{
+	for (int i = 0; i < d->capacity; i++)
+		free(d->entry[i].str);
+	free(d->entry);
+	free(d->bucket);
+	d->entry = NULL;
+	d->bucket = NULL;
+}
+
+static unsigned int dict_hash(const char* str, size_t len)
+{
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void dict_unlink(struct wire_dict* d, int slot)
+{
+	struct dict_entry* e = &d->entry[slot];
+	if (e->prev >= 0)
+		d->entry[e->prev].next = e->next;
+	else
+		d->head = e->next;
+	if (e->next >= 0)
+		d->entry[e->next].prev = e->prev;
+	else
+		d->tail = e->prev;
+}
+
+static void dict_touch(struct wire_dict* d, int slot)
+{
+	if (d->head == slot)
+		return;
+	dict_unlink(d, slot);
+	struct dict_entry* e = &d->entry[slot];
+	e->prev = -1;
+	e->next = d->head;
+	d->entry[d->head].prev = slot;
+	d->head = slot;
+}
+
+static int dict_find(struct wire_dict* d, const char* str, size_t len, unsigned int hash)
+{
+	for (int slot = d->bucket[hash & d->mask]; slot >= 0; slot = d->entry[slot].chain)
+	{
+		struct dict_entry* e = &d->entry[slot];
+		if (e->hash == hash && e->len == len && memcmp(e->str, str, len) == 0)
+			return slot;
+	}
+	return -1;
+}
+
+//满时复用最久未使用的槽位，先把它从hash链上摘下
+static void dict_insert(struct wire_dict* d, const char* str, size_t len, unsigned int hash)
+{
+	int slot;
+	if (d->size < d->capacity)
+	{
+		slot = d->size++;
+	}
+	else
+	{
+		slot = d->tail;
+		dict_unlink(d, slot);
+		int* link = &d->bucket[d->entry[slot].hash & d->mask];
+		while (*link != slot)
+			link = &d->entry[*link].chain;
+		*link = d->entry[slot].chain;
+	}
+
+	struct dict_entry* e = &d->entry[slot];
+	if (e->cap < len)
+	{
+		free(e->str);
+		e->cap = (len + 31) & ~(size_t)31;
+		e->str = (char*)malloc(e->cap);
+	}
+	memcpy(e->str, str, len);
+	e->len = len;
+	e->hash = hash;
+	e->chain = d->bucket[hash & d->mask];
+	d->bucket[hash & d->mask] = slot;
+
+	e->prev = -1;
+	e->next = d->head;
+	if (d->head >= 0)
+		d->entry[d->head].prev = slot;
+	else
+		d->tail = slot;
+	d->head = slot;
+}
+
+void dict_put_string(struct wire_dict* d, struct write_buffer* buffer, const char* str, size_t len)
+{
+	if (len < DICT_MIN_STRING || len > DICT_MAX_STRING)
+	{
+		wire_put_uvarint(buffer, (unsigned long long)len << 1);
+		memcpy(buffer->ptr + buffer->offset, str, len);
+		buffer->offset += len;
+		return;
+	}
+	unsigned int hash = dict_hash(str, len);
+	int slot = dict_find(d, str, len, hash);
+	if (slot >= 0)
+	{
+		wire_put_uvarint(buffer, ((unsigned long long)slot << 1) | 1);
+		dict_touch(d, slot);
+		return;
+	}
+	wire_put_uvarint(buffer, (unsigned long long)len << 1);
+	memcpy(buffer->ptr + buffer->offset, str, len);
+	buffer->offset += len;
+	dict_insert(d, str, len, hash);
+}
+
+//接收端不需要按内容查找，但hash链照常维护，两端的结构完全相同
+int dict_read_string(struct wire_dict* d, struct read_buffer* reader, const char** str, size_t* len)
+{
+	unsigned long long head;
+	if (wire_read_uvarint(reader, &head) < 0)
+		return -1;
+	if (head & 1)
+	{
+		head >>= 1;
+		if (head >= (unsigned long long)d->size)
+			return -1;
+		struct dict_entry* e = &d->entry[head];
+		*str = e->str;
+		*len = e->len;
+		dict_touch(d, (int)head);
+		return 0;
+	}
+	head >>= 1;
+	if (head > reader->size - reader->offset)
+		return -1;
+	*str = reader->ptr + reader->offset;
+	*len = (size_t)head;
+	reader->offset += (size_t)head;
+	if (head >= DICT_MIN_STRING && head <= DICT_MAX_STRING)
+		dict_insert(d, *str, *len, dict_hash(*str, *len));
+	return 0;
+}
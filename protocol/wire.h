@@ -0,0 +1,318 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "protocol.h"
+
+//协议二进制格式：
+//int为zigzag编码的varint，float为4字节，double为8字节，均为小端
+//string为varint长度+内容，string[]和协议数组为varint元素个数+元素
+//int[]打包为varint个数+varint字节数+连续的zigzag varint，个数为0时省略字节数
+//float[]/double[]打包为varint个数+连续的定长小端数据，小端机器上整块拷贝
+//协议以存在位图开头，每个位置字段一位(按定义顺序，每字节低位在前)，位图长度由位置字段个数决定。
+//取默认值(数值0、空字符串、空数组)的位置字段位为0且不写入，嵌套协议总是写入。
+//之后存在的位置字段按定义顺序依次排列，嵌套协议直接展开
+//带标签的可选字段不按位置排列，统一放在必选字段之后，每项为varint key(标签<<2|类型)+值，以key 0结束。
+//类型决定值的长度：varint、4字节、8字节、varint长度+内容，不认识的标签按类型直接跳过。
+//string的内容即字符串本身，数组和协议的内容为其正常编码
+//扩展标量：int8/int16/int64为64位zigzag varint(值在int范围内时与int编码相同)，无符号整数和枚举为原值的varint。
+//位置字段的bool只占存在位图的一位(true即存在)，不写入值；可选字段的bool为varint 0/1。
+//bool[]为varint个数+按位打包的(个数+7)/8字节，每字节低位在前；其余整数数组与int[]相同
+//定长数组T[N]与T[]的编码相同，个数必须为N；位置字段的定长数组与嵌套协议一样总是写入，不足N个的元素按默认值补齐。
+//map<K,V>为varint项数+依次的键和值，键和值按各自类型编码(bool为varint 0/1，协议直接展开)，不使用字符串字典。
+//空map与空数组一样按默认值省略
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define WIRE_BIG_ENDIAN
+#endif
+
+#define WIRE_MAX_VARINT 10
+//int、个数、长度前缀和可选字段key最多5字节
+#define WIRE_MAX_INT 5
+
+#define WIRE_VARINT		0
+#define WIRE_FIXED32	1
+#define WIRE_FIXED64	2
+#define WIRE_BYTES		3
+
+#define WIRE_KEY(tag, type) (((tag) << 2) | (type))
+#define WIRE_KEY_TAG(key) ((key) >> 2)
+#define WIRE_KEY_TYPE(key) ((key) & 3)
+
+#define WIRE_BITMAP_SIZE(n) (((n) + 7) >> 3)
+#define WIRE_BIT(bitmap, i) ((((const unsigned char*)(bitmap))[(i) >> 3] >> ((i) & 7)) & 1)
+
+#define WIRE_BUFFER_SIZE 64 * 1024
+
+struct write_buffer {
+	char* ptr;
+	size_t size;
+	size_t offset;
+	char init[WIRE_BUFFER_SIZE];
+};
+
+struct read_buffer {
+	const char* ptr;
+	size_t size;
+	size_t offset;
+};
+
+void buffer_init(struct write_buffer* buffer);
+void buffer_reserve(struct write_buffer* buffer, size_t len);
+void buffer_reset(struct write_buffer* buffer);
+void buffer_release(struct write_buffer* buffer);
+void buffer_addchar(struct write_buffer* buffer, char c);
+void buffer_addstring(struct write_buffer* buffer, const char* str);
+void buffer_addlstring(struct write_buffer* buffer, const char* str, size_t len);
+
+void wire_write_uvarint(struct write_buffer* buffer, unsigned long long value);
+void wire_write_int(struct write_buffer* buffer, int value);
+void wire_write_float(struct write_buffer* buffer, float value);
+void wire_write_double(struct write_buffer* buffer, double value);
+void wire_write_count(struct write_buffer* buffer, size_t count);
+void wire_write_string(struct write_buffer* buffer, const char* str, size_t len);
+void wire_write_integer(struct write_buffer* buffer, int type, unsigned long long value);
+
+//以下写入不检查容量，调用者需要先用buffer_reserve预留足够的空间
+inline void wire_put_uvarint(struct write_buffer* buffer, unsigned long long value)
+{
+	unsigned char* ptr = (unsigned char*)buffer->ptr + buffer->offset;
+	while (value >= 0x80)
+	{
+		*ptr++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	*ptr++ = (unsigned char)value;
+	buffer->offset = (char*)ptr - buffer->ptr;
+}
+
+inline void wire_put_int(struct write_buffer* buffer, int value)
+{
+	wire_put_uvarint(buffer, ((unsigned int)value << 1) ^ (unsigned int)(value >> 31));
+}
+
+inline void wire_put_uint32(struct write_buffer* buffer, unsigned int value)
+{
+	unsigned char* ptr = (unsigned char*)buffer->ptr + buffer->offset;
+	ptr[0] = value & 0xff;
+	ptr[1] = (value >> 8) & 0xff;
+	ptr[2] = (value >> 16) & 0xff;
+	ptr[3] = (value >> 24) & 0xff;
+	buffer->offset += 4;
+}
+
+inline void wire_put_float(struct write_buffer* buffer, float value)
+{
+	unsigned int u;
+	memcpy(&u, &value, sizeof(u));
+	wire_put_uint32(buffer, u);
+}
+
+inline void wire_put_double(struct write_buffer* buffer, double value)
+{
+	unsigned int u[2];
+	memcpy(u, &value, sizeof(u));
+#ifdef WIRE_BIG_ENDIAN
+	wire_put_uint32(buffer, u[1]);
+	wire_put_uint32(buffer, u[0]);
+#else
+	wire_put_uint32(buffer, u[0]);
+	wire_put_uint32(buffer, u[1]);
+#endif
+}
+
+inline void wire_put_string(struct write_buffer* buffer, const char* str, size_t len)
+{
+	wire_put_uvarint(buffer, len);
+	memcpy(buffer->ptr + buffer->offset, str, len);
+	buffer->offset += len;
+}
+
+//与wire_begin_block相同，但不预留容量，之后用wire_end_block回填
+inline size_t wire_put_block(struct write_buffer* buffer)
+{
+	size_t mark = buffer->offset;
+	buffer->offset += WIRE_MAX_INT;
+	return mark;
+}
+
+//写入全0的存在位图，返回位图的位置，之后用wire_set_bit置位
+inline size_t wire_put_bitmap(struct write_buffer* buffer, size_t bytes)
+{
+	size_t mark = buffer->offset;
+	memset(buffer->ptr + mark, 0, bytes);
+	buffer->offset += bytes;
+	return mark;
+}
+
+inline void wire_set_bit(struct write_buffer* buffer, size_t mark, int bit)
+{
+	buffer->ptr[mark + (bit >> 3)] |= (char)(1 << (bit & 7));
+}
+
+//+0.0按默认值省略，-0.0和NaN照常写入
+inline bool wire_is_zero(double value)
+{
+	unsigned long long u;
+	memcpy(&u, &value, sizeof(u));
+	return u == 0;
+}
+
+//整数类型(type_integer)和bool的值按64位传递，有符号类型按补码解释
+inline unsigned long long wire_zigzag(long long value)
+{
+	return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+inline long long wire_unzigzag(unsigned long long value)
+{
+	return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+//值是否在类型的范围内
+inline bool wire_integer_fits(int type, unsigned long long value)
+{
+	long long s = (long long)value;
+	switch (type & ~1)
+	{
+	case TYPE_INT:
+		return s >= -2147483647LL - 1 && s <= 2147483647LL;
+	case TYPE_INT8:
+		return s >= -128 && s <= 127;
+	case TYPE_INT16:
+		return s >= -32768 && s <= 32767;
+	case TYPE_BOOL:
+		return value <= 1;
+	case TYPE_UINT8:
+		return value <= 0xff;
+	case TYPE_UINT16:
+		return value <= 0xffff;
+	case TYPE_UINT32:
+	case TYPE_ENUM:
+		return value <= 0xffffffffULL;
+	}
+	return true;
+}
+
+//不检查范围，最多WIRE_MAX_VARINT字节
+inline void wire_put_integer(struct write_buffer* buffer, int type, unsigned long long value)
+{
+	wire_put_uvarint(buffer, type_signed(type) ? wire_zigzag((long long)value) : value);
+}
+
+size_t wire_begin_bitmap(struct write_buffer* buffer, size_t bytes);
+
+//begin预留varint长度，end回填begin之后写入的字节数
+size_t wire_begin_block(struct write_buffer* buffer);
+void wire_end_block(struct write_buffer* buffer, size_t mark);
+
+//int[]：begin写入个数并预留字节数，之后逐个wire_write_int，end回填字节数
+size_t wire_begin_int_array(struct write_buffer* buffer, size_t count);
+void wire_end_int_array(struct write_buffer* buffer, size_t mark);
+void wire_write_int_array(struct write_buffer* buffer, const int* values, size_t count);
+void wire_write_float_array(struct write_buffer* buffer, const float* values, size_t count);
+void wire_write_double_array(struct write_buffer* buffer, const double* values, size_t count);
+//整数数组的元素为按类型编码的64位值
+void wire_write_integer_array(struct write_buffer* buffer, int type, const unsigned long long* values, size_t count);
+void wire_write_bool_array(struct write_buffer* buffer, const bool* values, size_t count);
+
+//读取失败(数据不足或格式错误)返回-1
+void reader_init(struct read_buffer* reader, const char* ptr, size_t size);
+int wire_read_uvarint(struct read_buffer* reader, unsigned long long* value);
+int wire_read_int(struct read_buffer* reader, int* value);
+int wire_read_float(struct read_buffer* reader, float* value);
+int wire_read_double(struct read_buffer* reader, double* value);
+int wire_read_count(struct read_buffer* reader, size_t* count);
+int wire_read_string(struct read_buffer* reader, const char** str, size_t* len);
+//整数类型和bool，值超出类型的范围同样返回-1
+int wire_read_integer(struct read_buffer* reader, int type, unsigned long long* value);
+//bitmap指向数据中的位图，用WIRE_BIT测试
+int wire_read_bitmap(struct read_buffer* reader, size_t bytes, const char** bitmap);
+
+//读取数组头，data/bytes为元素数据块(整数数组为varint序列，float[]/double[]为定长数据，bool[]为位)
+int wire_read_array(struct read_buffer* reader, int type, size_t* count, const char** data, size_t* bytes);
+//从int[]数据块中依次解出元素
+int wire_next_int(const char** ptr, const char* end, int* value);
+//从整数数组的数据块中依次解出元素，type为元素类型
+int wire_next_integer(const char** ptr, const char* end, int type, unsigned long long* value);
+void wire_copy_float(float* values, const char* data, size_t count);
+void wire_copy_double(double* values, const char* data, size_t count);
+
+//跳过一个内置类型(TYPE_INT~TYPE_STRING_ARRAY、TYPE_BOOL~TYPE_ENUM_ARRAY)的值。位置字段的bool没有值，不能用它跳过；
+//map需要键值类型，由调用者按map_entry逐项跳过
+int wire_skip(struct read_buffer* reader, int type);
+
+//可选字段：字段类型对应的key类型，读取key(0表示结束)，按key类型跳过值，跳过整个可选字段区
+int wire_tag_type(int type);
+int wire_read_key(struct read_buffer* reader, unsigned int* key);
+int wire_skip_value(struct read_buffer* reader, unsigned int key);
+int wire_skip_tagged(struct read_buffer* reader);
+
+//批量编码：多条消息依次写入同一缓冲，每条消息为varint长度+varint协议id+消息数据，
+//长度包含id。整块一次发送，或按消息取出iovec分发给不同连接，不需要逐条分配
+struct wire_iovec {
+	const void* base;
+	size_t len;
+};
+
+struct wire_batch {
+	struct write_buffer buffer;
+	size_t* frame;
+	int size;
+	int cap;
+	size_t mark;
+};
+
+void batch_init(struct wire_batch* batch);
+void batch_reset(struct wire_batch* batch);
+void batch_release(struct wire_batch* batch);
+//begin/end之间把消息数据写入batch->buffer
+void batch_begin(struct wire_batch* batch, int id);
+void batch_end(struct wire_batch* batch);
+void batch_cancel(struct wire_batch* batch);
+//从第first条消息开始最多填充count项，返回实际数量；batch修改后之前取出的iovec失效
+int batch_iovec(struct wire_batch* batch, struct wire_iovec* iov, int first, int count);
+//依次读取一条消息，data/size为消息数据
+int batch_next(struct read_buffer* reader, int* id, const char** data, size_t* size);
+
+//字符串字典：连接的发送端和接收端各持有一份，按消息顺序做相同的插入和淘汰，槽位号始终一致。
+//字典模式下位置字段的string和string[]元素写为varint头：
+//低位为0时是字面量，头>>1为长度，之后是内容，长度在[DICT_MIN_STRING, DICT_MAX_STRING]内的插入字典；
+//低位为1时头>>1为字典槽位。引用和插入都把槽位移到最近使用，满时淘汰最久未使用的。
+//可选字段不使用字典，不认识它的接收端跳过时两端字典不会因此错开
+#define DICT_MIN_STRING 2
+#define DICT_MAX_STRING 256
+
+struct dict_entry {
+	char* str;
+	size_t len;
+	size_t cap;
+	unsigned int hash;
+	//最近使用链表和hash链，-1表示没有
+	int prev;
+	int next;
+	int chain;
+};
+
+struct wire_dict {
+	struct dict_entry* entry;
+	int capacity;
+	int size;
+	//head为最近使用，tail为最久未使用
+	int head;
+	int tail;
+	int* bucket;
+	unsigned int mask;
+};
+
+void dict_init(struct wire_dict* d, int capacity);
+void dict_reset(struct wire_dict* d);
+void dict_release(struct wire_dict* d);
+//写入时不检查容量，长度上限与wire_put_string相同
+void dict_put_string(struct wire_dict* d, struct write_buffer* buffer, const char* str, size_t len);
+//str指向输入数据或字典内部，下一次读写字典之前有效。槽位无效时返回-1
+int dict_read_string(struct wire_dict* d, struct read_buffer* reader, const char** str, size_t* len);
+
+#endif